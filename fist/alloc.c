@@ -0,0 +1,163 @@
+#include "alloc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Header of an allocation over SLAB_MAX, which stays in a list so slab_destroy() can free it
+struct slab_large
+{
+    struct slab_large *prev;
+    struct slab_large *next;
+};
+
+// Pages start with the pointer to the next one, padded so chunks stay aligned to SLAB_MIN
+#define SLAB_PAGE_HEADER SLAB_MIN
+
+char *arena_alloc(struct arena *arena, uint32_t size) {
+    struct arena_chunk *chunk = arena->chunks;
+    if(!chunk || chunk->size - chunk->used < size) {
+        // A large allocation gets a chunk of its own behind the newest one, which keeps its room
+        int large = size > ARENA_CHUNK / 4;
+        uint32_t chunk_size = large ? size : ARENA_CHUNK;
+        chunk = malloc(sizeof(struct arena_chunk) + chunk_size);
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        if(large && arena->chunks) {
+            chunk->next = arena->chunks->next;
+            arena->chunks->next = chunk;
+        } else {
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+        }
+        arena->reserved += sizeof(struct arena_chunk) + chunk_size;
+    }
+    char *data = (char *)(chunk + 1) + chunk->used;
+    chunk->used += size;
+    arena->used += size;
+    return data;
+}
+
+void arena_release(struct arena *arena, uint32_t size) {
+    arena->used -= size;
+}
+
+void arena_free(struct arena *arena) {
+    struct arena_chunk *chunk = arena->chunks;
+    while(chunk) {
+        struct arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    memset(arena, 0, sizeof(struct arena));
+}
+
+static uint32_t slab_class(uint32_t size) {
+    uint32_t class = 0;
+    while((uint32_t)SLAB_MIN << class < size)
+        class++;
+    return class;
+}
+
+void *slab_alloc(struct slab *slab, uint32_t size) {
+    if(size == 0)
+        return NULL;
+    if(!slab)
+        return malloc(size);
+    slab->used += size;
+    if(size > SLAB_MAX) {
+        struct slab_large *large = malloc(sizeof(struct slab_large) + size);
+        large->prev = NULL;
+        large->next = slab->large;
+        if(slab->large)
+            slab->large->prev = large;
+        slab->large = large;
+        slab->reserved += sizeof(struct slab_large) + size;
+        return large + 1;
+    }
+
+    uint32_t class = slab_class(size);
+    void *chunk = slab->free[class];
+    if(chunk) {
+        slab->free[class] = *(void **)chunk;
+        return chunk;
+    }
+    uint32_t chunk_size = SLAB_MIN << class;
+    if(!slab->pages || SLAB_PAGE - slab->page_used < chunk_size) {
+        // What is left of the old page goes to the free lists of the classes it still fits
+        for(uint32_t c = SLAB_CLASSES; slab->pages && c-- > 0;) {
+            while(SLAB_PAGE - slab->page_used >= (uint32_t)SLAB_MIN << c) {
+                void *rest = slab->pages + slab->page_used;
+                *(void **)rest = slab->free[c];
+                slab->free[c] = rest;
+                slab->page_used += SLAB_MIN << c;
+            }
+        }
+        char *page = malloc(SLAB_PAGE);
+        *(char **)page = slab->pages;
+        slab->pages = page;
+        slab->page_used = SLAB_PAGE_HEADER;
+        slab->reserved += SLAB_PAGE;
+    }
+    chunk = slab->pages + slab->page_used;
+    slab->page_used += chunk_size;
+    return chunk;
+}
+
+void slab_free(struct slab *slab, void *ptr, uint32_t size) {
+    if(!ptr)
+        return;
+    if(!slab) {
+        free(ptr);
+        return;
+    }
+    slab->used -= size;
+    if(size > SLAB_MAX) {
+        struct slab_large *large = (struct slab_large *)ptr - 1;
+        if(large->prev)
+            large->prev->next = large->next;
+        else
+            slab->large = large->next;
+        if(large->next)
+            large->next->prev = large->prev;
+        slab->reserved -= sizeof(struct slab_large) + size;
+        free(large);
+        return;
+    }
+    uint32_t class = slab_class(size);
+    *(void **)ptr = slab->free[class];
+    slab->free[class] = ptr;
+}
+
+void *slab_realloc(struct slab *slab, void *ptr, uint32_t old_size, uint32_t size) {
+    if(size == 0) {
+        slab_free(slab, ptr, old_size);
+        return NULL;
+    }
+    if(!slab)
+        return realloc(ptr, size);
+    // Sizes in the same class already fit
+    if(ptr && old_size <= SLAB_MAX && size <= SLAB_MAX &&
+       slab_class(old_size) == slab_class(size)) {
+        slab->used += (uint64_t)size - old_size;
+        return ptr;
+    }
+    void *moved = slab_alloc(slab, size);
+    if(ptr && moved)
+        memcpy(moved, ptr, old_size < size ? old_size : size);
+    slab_free(slab, ptr, old_size);
+    return moved;
+}
+
+void slab_destroy(struct slab *slab) {
+    while(slab->pages) {
+        char *next = *(char **)slab->pages;
+        free(slab->pages);
+        slab->pages = next;
+    }
+    while(slab->large) {
+        struct slab_large *next = slab->large->next;
+        free(slab->large);
+        slab->large = next;
+    }
+    memset(slab, 0, sizeof(struct slab));
+}
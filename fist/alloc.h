@@ -0,0 +1,53 @@
+#ifndef H_ALLOC
+#define H_ALLOC
+
+#include <stdint.h>
+
+#define ARENA_CHUNK 65536 // Bytes an arena reserves at a time, more for larger allocations
+
+#define SLAB_PAGE 65536 // Bytes a slab reserves at a time for its size classes
+#define SLAB_MIN 16     // Smallest size class, each class is twice the one before
+#define SLAB_CLASSES 8
+#define SLAB_MAX (SLAB_MIN << (SLAB_CLASSES - 1)) // Larger allocations are malloc'd one by one
+
+struct arena_chunk
+{
+    struct arena_chunk *next;
+    uint32_t size; // Bytes after the header
+    uint32_t used;
+};
+
+// Bytes that are never freed on their own, such as the keys of a hashmap. An allocation is a bump
+// of the offset into the newest chunk and nothing is aligned. Everything is freed at once by
+// arena_free(), so freeing a million keys costs as much as freeing a few chunks.
+struct arena
+{
+    struct arena_chunk *chunks; // Newest first, allocations come from the first one
+    uint64_t used;              // Bytes handed out and not released since
+    uint64_t reserved;          // Bytes of all chunks
+};
+
+// Allocations of up to SLAB_MAX bytes rounded up to a size class, cut from shared pages and put
+// on a free list of their class when freed. Like an arena everything is freed at once by
+// slab_destroy(), unlike one memory can be reused before. Callers pass the size of an allocation
+// back when freeing it. A NULL slab stands for malloc(), so code can work with either.
+struct slab
+{
+    void *free[SLAB_CLASSES]; // Freed chunks of each class, linked through their first bytes
+    char *pages;              // Newest first, linked through their first bytes
+    uint32_t page_used;       // Bytes of the newest page cut into chunks
+    struct slab_large *large; // Allocations over SLAB_MAX
+    uint64_t used;            // Bytes asked for and not freed since
+    uint64_t reserved;        // Bytes of the pages and large allocations
+};
+
+char *arena_alloc(struct arena *arena, uint32_t size);
+void arena_release(struct arena *arena, uint32_t size); // Counts size bytes as no longer used
+void arena_free(struct arena *arena); // Frees every chunk, the arena can be reused afterwards
+
+void *slab_alloc(struct slab *slab, uint32_t size); // NULL if size is 0
+void *slab_realloc(struct slab *slab, void *ptr, uint32_t old_size, uint32_t size); // Frees at 0
+void slab_free(struct slab *slab, void *ptr, uint32_t size);
+void slab_destroy(struct slab *slab); // Frees everything, the slab can be reused afterwards
+
+#endif
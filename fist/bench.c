@@ -0,0 +1,715 @@
+#include "bench.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "database.h"
+#include "dstring.h"
+#include "eventloop.h"
+#include "indexer.h"
+#include "postings.h"
+#include "rank.h"
+#include "serializer.h"
+#include "server.h"
+#include "utils.h"
+
+#define BENCH_WORDS 50000
+#define BENCH_VOCABULARY 5000
+#define BENCH_MAX_PHRASE_LENGTH 10
+
+#define BENCH_PORT 15599
+#define BENCH_DB_PATH "/tmp/fist-bench.db"
+#define BENCH_IDLE 10000
+#define BENCH_ACTIVE 1000
+#define BENCH_DOCUMENTS 100
+#define BENCH_SECONDS 2
+#define BENCH_CLIENT_THREADS 4
+#define BENCH_CLIENT_CONNECTIONS 16
+#define BENCH_WRITE_EVERY 20 // One INDEX for every so many requests in the read-heavy mix
+#define BENCH_PIPELINE_MAX 128
+
+struct benchmark
+{
+    const char *name;
+    void (*run)();
+};
+
+static double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t bench_random(uint32_t *state) {
+    *state = *state * 1103515245 + 12345;
+    return *state >> 8;
+}
+
+// Builds the same text of space separated words from a fixed vocabulary on every run
+static dstring bench_text(uint32_t nwords) {
+    uint32_t state = 42;
+    char vocabulary[BENCH_VOCABULARY][12];
+    for(int i = 0; i < BENCH_VOCABULARY; i++) {
+        int length = 2 + bench_random(&state) % 9;
+        for(int j = 0; j < length; j++) {
+            vocabulary[i][j] = 'a' + bench_random(&state) % 26;
+        }
+        vocabulary[i][length] = 0;
+    }
+
+    dstring text = dempty();
+    for(uint32_t i = 0; i < nwords; i++) {
+        if(i > 0)
+            text = dappendc(text, ' ');
+        text = dappend(text, vocabulary[bench_random(&state) % BENCH_VOCABULARY]);
+    }
+    return text;
+}
+
+// Phrase generation as the indexer did it before spans: split into a dstring per word, then copy
+// every phrase into a fresh array and join it into a fresh string.
+static uint64_t bench_phrases_dstring(dstring text, int max) {
+    uint64_t phrases = 0;
+    dstringa words = dsplit(text, ' ');
+    for(int j = 0; j < words.length; j++) {
+        for(int k = 0; k < MIN(words.length - j, max); k++) {
+            dstringa range = drange(words, j, j + k);
+            dstring joined = djoin(range, ' ');
+            phrases += joined.length > 0;
+            dfreea(range);
+            dfree(joined);
+        }
+    }
+    dfreea(words);
+    return phrases;
+}
+
+static uint64_t bench_phrases_span(char *text, uint32_t length, int max) {
+    uint64_t phrases = 0;
+    struct ngrams it;
+    struct span phrase;
+    length = tnormalize(text, length);
+    ngrams_init(&it, text, length, max);
+    while(ngrams_next(&it, &phrase)) {
+        phrases += phrase.length > 0;
+    }
+    return phrases;
+}
+
+static void bench_tokenizer() {
+    dstring text = bench_text(BENCH_WORDS);
+    char *buffer = malloc(text.length);
+    memcpy(buffer, dtext(text), text.length);
+
+    double start = bench_now();
+    dstringa words = dsplit(text, ' ');
+    double split_time = bench_now() - start;
+    dfreea(words);
+
+    start = bench_now();
+    uint32_t offset = 0;
+    uint64_t nwords = 0;
+    struct span word;
+    while(tnext(buffer, text.length, &offset, &word))
+        nwords++;
+    double tnext_time = bench_now() - start;
+
+    start = bench_now();
+    uint64_t before = bench_phrases_dstring(text, BENCH_MAX_PHRASE_LENGTH);
+    double before_time = bench_now() - start;
+
+    start = bench_now();
+    uint64_t after = bench_phrases_span(buffer, text.length, BENCH_MAX_PHRASE_LENGTH);
+    double after_time = bench_now() - start;
+
+    printf("tokenizer: %llu words, %u bytes\n", (unsigned long long)nwords, text.length);
+    printf("  words    dsplit: %12.0f tokens/sec   spans: %12.0f tokens/sec  (%.1fx)\n",
+           nwords / split_time, nwords / tnext_time, split_time / tnext_time);
+    printf("  phrases  djoin:  %12.0f tokens/sec   spans: %12.0f tokens/sec  (%.1fx)\n",
+           before / before_time, after / after_time, before_time / after_time);
+
+    free(buffer);
+    dfree(text);
+}
+
+// dappendc() before strings had a capacity: past static_text every char is one realloc
+static dstring bench_dappendc_exact(dstring input, char character) {
+    int new_size = input.length + 2;
+    char *string;
+    if(input.alloc_len == 0) {
+        if(new_size <= DSTRING_SMALL) {
+            string = input.static_text;
+        } else {
+            string = malloc(sizeof(char) * new_size);
+            memcpy(string, input.static_text, input.length);
+            input.alloc_len = new_size;
+            input.text = string;
+        }
+    } else {
+        string = realloc(dtext(input), sizeof(char) * new_size);
+        input.alloc_len = new_size;
+        input.text = string;
+    }
+    string[input.length] = character;
+    string[input.length + 1] = 0;
+    input.length++;
+    return input;
+}
+
+static uint64_t bench_append_exact(const char *text, uint32_t length) {
+    uint64_t allocations = 0;
+    dstring string = dempty();
+    for(uint32_t i = 0; i < length; i++) {
+        int capacity = string.alloc_len;
+        string = bench_dappendc_exact(string, text[i]);
+        allocations += string.alloc_len != capacity;
+    }
+    dfree(string);
+    return allocations;
+}
+
+static uint64_t bench_append_doubling(const char *text, uint32_t length) {
+    uint64_t allocations = 0;
+    dstring string = dempty();
+    for(uint32_t i = 0; i < length; i++) {
+        int capacity = string.alloc_len;
+        string = dappendc(string, text[i]);
+        allocations += string.alloc_len != capacity;
+    }
+    dfree(string);
+    return allocations;
+}
+
+// Pushes the words as dpush() did before arrays had a capacity: the array is reallocated to the
+// exact length and the word copied for every push
+static uint64_t bench_push_exact(char *text, uint32_t length) {
+    uint64_t allocations = 0;
+    dstring *values = NULL;
+    uint32_t count = 0;
+    uint32_t offset = 0;
+    struct span word;
+    while(tnext(text, length, &offset, &word)) {
+        dstring pushed = dcreaten(word.text, word.length);
+        dstring copy = dcreaten(dtext(pushed), pushed.length);
+        values = realloc(values, sizeof(dstring) * (count + 1));
+        values[count++] = copy;
+        allocations += 1 + (pushed.alloc_len != 0) + (copy.alloc_len != 0);
+        dfree(pushed);
+    }
+    for(uint32_t i = 0; i < count; i++) {
+        dfree(values[i]);
+    }
+    free(values);
+    return allocations;
+}
+
+static uint64_t bench_push_adopt(char *text, uint32_t length) {
+    uint64_t allocations = 0;
+    dstringa array = dcreatea();
+    uint32_t offset = 0;
+    struct span word;
+    while(tnext(text, length, &offset, &word)) {
+        int capacity = array.capacity;
+        dstring pushed = dcreaten(word.text, word.length);
+        array = dadopt(array, pushed);
+        allocations += (array.capacity != capacity) + (pushed.alloc_len != 0);
+    }
+    dfreea(array);
+    return allocations;
+}
+
+static void bench_strings() {
+    dstring text = bench_text(BENCH_WORDS);
+    char *buffer = malloc(text.length);
+    memcpy(buffer, dtext(text), text.length);
+
+    double start = bench_now();
+    uint64_t append_exact = bench_append_exact(buffer, text.length);
+    double append_exact_time = bench_now() - start;
+    start = bench_now();
+    uint64_t append_doubling = bench_append_doubling(buffer, text.length);
+    double append_doubling_time = bench_now() - start;
+
+    start = bench_now();
+    uint64_t push_exact = bench_push_exact(buffer, text.length);
+    double push_exact_time = bench_now() - start;
+    start = bench_now();
+    uint64_t push_adopt = bench_push_adopt(buffer, text.length);
+    double push_adopt_time = bench_now() - start;
+
+    printf("strings: %d words, %u bytes\n", BENCH_WORDS, text.length);
+    printf("  append   exact: %9llu allocs %8.3f ms   doubling: %9llu allocs %8.3f ms\n",
+           (unsigned long long)append_exact, append_exact_time * 1000,
+           (unsigned long long)append_doubling, append_doubling_time * 1000);
+    printf("  push     copy:  %9llu allocs %8.3f ms   adopt:    %9llu allocs %8.3f ms\n",
+           (unsigned long long)push_exact, push_exact_time * 1000, (unsigned long long)push_adopt,
+           push_adopt_time * 1000);
+
+    free(buffer);
+    dfree(text);
+}
+
+#define BENCH_INTERSECT_IDS 1000000
+#define BENCH_INTERSECT_ROUNDS 20
+
+// Intersection as a plain merge, one id of either array at a time
+static uint32_t bench_intersect_merge(uint32_t *out, const uint32_t *a, uint32_t na,
+                                      const uint32_t *b, uint32_t nb) {
+    uint32_t i = 0, j = 0, count = 0;
+    while(i < na && j < nb) {
+        if(a[i] < b[j]) {
+            i++;
+        } else if(a[i] > b[j]) {
+            j++;
+        } else {
+            out[count++] = a[i];
+            i++;
+            j++;
+        }
+    }
+    return count;
+}
+
+// Sorted ids below BENCH_INTERSECT_IDS, each taken with a chance of one in every
+static uint32_t bench_ids(uint32_t *ids, uint32_t every, uint32_t *state) {
+    uint32_t count = 0;
+    for(uint32_t id = 0; id < BENCH_INTERSECT_IDS; id++) {
+        if(bench_random(state) % every == 0)
+            ids[count++] = id;
+    }
+    return count;
+}
+
+static void bench_intersect() {
+    uint32_t *a = malloc(sizeof(uint32_t) * BENCH_INTERSECT_IDS);
+    uint32_t *b = malloc(sizeof(uint32_t) * BENCH_INTERSECT_IDS);
+    uint32_t *out = malloc(sizeof(uint32_t) * BENCH_INTERSECT_IDS);
+    uint32_t state = 42;
+    uint32_t every[] = {2, 20, 2000};
+
+    printf("intersect: %u ids against every 2nd, 20th and 2000th\n", BENCH_INTERSECT_IDS / 2);
+    uint32_t na = bench_ids(a, 2, &state);
+    for(size_t t = 0; t < sizeof(every) / sizeof(every[0]); t++) {
+        uint32_t nb = bench_ids(b, every[t], &state);
+        uint32_t merged = 0, intersected = 0;
+        double start = bench_now();
+        for(int round = 0; round < BENCH_INTERSECT_ROUNDS; round++)
+            merged += bench_intersect_merge(out, a, na, b, nb);
+        double merge_time = bench_now() - start;
+        start = bench_now();
+        for(int round = 0; round < BENCH_INTERSECT_ROUNDS; round++)
+            intersected += pintersect(out, a, na, b, nb);
+        double intersect_time = bench_now() - start;
+        if(merged != intersected)
+            printf("  Results differ\n");
+        printf("  %7u ids  merge: %8.3f ms   pintersect: %8.3f ms  (%.1fx)\n", nb,
+               merge_time * 1000 / BENCH_INTERSECT_ROUNDS,
+               intersect_time * 1000 / BENCH_INTERSECT_ROUNDS, merge_time / intersect_time);
+    }
+    free(a);
+    free(b);
+    free(out);
+}
+
+#define BENCH_RANK_DOCUMENTS 200000
+#define BENCH_RANK_WORDS 20
+#define BENCH_RANK_QUERIES 200
+
+// Ranks the top 10 and every match for queries mixing frequent and rare words, in a database whose
+// word n appears about twice as often as word n + 1
+static void bench_rank() {
+    struct database *db = database_create(INDEX_MODE_POSITIONAL, BENCH_MAX_PHRASE_LENGTH);
+    uint32_t state = 42;
+    for(uint32_t i = 0; i < BENCH_RANK_DOCUMENTS; i++) {
+        char name[16], text[BENCH_RANK_WORDS * 8];
+        uint32_t length = 0;
+        for(int j = 0; j < BENCH_RANK_WORDS; j++) {
+            length += sprintf(text + length, "w%d ", __builtin_ctz(bench_random(&state) | 1 << 16));
+        }
+        snprintf(name, sizeof(name), "%u", i);
+        dstring document = dcreate(name);
+        database_index(db, document, text, length);
+        dfree(document);
+    }
+
+    uint32_t sizes[] = {10, RANK_MAX};
+    printf("rank: %u documents, queries of 3 words\n", BENCH_RANK_DOCUMENTS);
+    for(size_t t = 0; t < sizeof(sizes) / sizeof(sizes[0]); t++) {
+        uint32_t query_state = 7;
+        double start = bench_now();
+        for(int i = 0; i < BENCH_RANK_QUERIES; i++) {
+            char query[32];
+            uint32_t frequent = bench_random(&query_state) % 3;
+            uint32_t common = bench_random(&query_state) % 8;
+            uint32_t rare = 6 + bench_random(&query_state) % 8;
+            int length = sprintf(query, "w%u w%u w%u", frequent, common, rare);
+            uint32_t *ids;
+            rank_search(db, query, length, sizes[t], &ids);
+            free(ids);
+        }
+        printf("  top %5u: %8.3f ms per query\n", sizes[t],
+               (bench_now() - start) * 1000 / BENCH_RANK_QUERIES);
+    }
+    database_free(db);
+}
+
+static void bench_raise_fd_limit() {
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// Starts a server in a child process with its output discarded
+static pid_t bench_spawn_server(int backend, int workers) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid != 0)
+        return pid;
+
+    freopen("/dev/null", "w", stdout);
+    freopen("/dev/null", "w", stderr);
+    struct config *config = calloc(1, sizeof(struct config));
+    config->db_path = dcreate(BENCH_DB_PATH);
+    config->event_backend = backend;
+    config->host = dcreate(CONFIG_DEFAULT_HOST);
+    config->index_mode = CONFIG_DEFAULT_INDEX_MODE;
+    config->max_phrase_length = CONFIG_DEFAULT_MAX_PHRASE_LEN;
+    config->port = BENCH_PORT;
+    config->save_period = 0;
+    config->so_backlog = 4096;
+    config->workers = workers;
+    int rc = start_server(config);
+    config_free(config);
+    _exit(rc ? 1 : 0);
+}
+
+static void bench_stop_server(pid_t pid) {
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+    sremove(BENCH_DB_PATH);
+}
+
+static int bench_connect() {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(BENCH_PORT);
+    inet_aton(CONFIG_DEFAULT_HOST, &addr.sin_addr);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd == -1)
+        return -1;
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends a command and waits for its one line reply. Returns 0 if the server hung up.
+static int bench_roundtrip(int fd, const char *command, uint32_t length) {
+    char buf[256];
+    if(send(fd, command, length, 0) != length)
+        return 0;
+    for(;;) {
+        ssize_t nbytes = recv(fd, buf, sizeof(buf), 0);
+        if(nbytes <= 0)
+            return 0;
+        if(buf[nbytes - 1] == '\n')
+            return 1;
+    }
+}
+
+// Waits for the server to come up and indexes the documents the SEARCH requests find. Returns
+// the connection used, or -1 if the server did not start.
+static int bench_seed_server(pid_t pid) {
+    int seed = -1;
+    for(int i = 0; i < 500 && seed == -1; i++) {
+        if((seed = bench_connect()) == -1)
+            usleep(10000);
+    }
+    if(seed == -1) {
+        fprintf(stderr, "bench: server did not start\n");
+        bench_stop_server(pid);
+        return -1;
+    }
+
+    dstring text = bench_text(BENCH_WORDS / BENCH_DOCUMENTS);
+    for(int i = 0; i < BENCH_DOCUMENTS; i++) {
+        char head[64];
+        snprintf(head, sizeof(head), "INDEX doc_%d the quick ", i);
+        dstring command = dcreate(head);
+        command = dappendd(command, text);
+        command = dappend(command, "\r\n");
+        bench_roundtrip(seed, dtext(command), command.length);
+        dfree(command);
+    }
+    dfree(text);
+    return seed;
+}
+
+// Holds idle connections open while active ones send SEARCH requests back to back
+static void bench_connections_run(int backend, int nidle) {
+    static const char query[] = "SEARCH the quick\r\n";
+    pid_t pid = bench_spawn_server(backend, 1);
+    int seed = bench_seed_server(pid);
+    if(seed == -1)
+        return;
+
+    int *idle = malloc(sizeof(int) * (nidle + 1));
+    int opened = 0;
+    while(opened < nidle && (idle[opened] = bench_connect()) != -1)
+        opened++;
+
+    struct pollfd *active = calloc(BENCH_ACTIVE, sizeof(struct pollfd));
+    double *sent_at = calloc(BENCH_ACTIVE, sizeof(double));
+    int nactive = 0;
+    for(; nactive < BENCH_ACTIVE; nactive++) {
+        if((active[nactive].fd = bench_connect()) == -1)
+            break;
+        active[nactive].events = POLLIN;
+    }
+
+    uint64_t requests = 0;
+    double latency = 0;
+    int served = nactive;
+    double start = bench_now();
+    for(int i = 0; i < nactive; i++) {
+        send(active[i].fd, query, sizeof(query) - 1, 0);
+        sent_at[i] = start;
+    }
+    while(served > 0 && bench_now() - start < BENCH_SECONDS) {
+        if(poll(active, nactive, 100) <= 0)
+            continue;
+        double now = bench_now();
+        for(int i = 0; i < nactive; i++) {
+            if(!active[i].revents)
+                continue;
+            char buf[256];
+            ssize_t nbytes = recv(active[i].fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if(nbytes <= 0) {
+                if(nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    continue;
+                // Negative descriptors are skipped by poll()
+                close(active[i].fd);
+                active[i].fd = -1;
+                served--;
+                continue;
+            }
+            if(buf[nbytes - 1] != '\n')
+                continue;
+            requests++;
+            latency += now - sent_at[i];
+            sent_at[i] = now;
+            send(active[i].fd, query, sizeof(query) - 1, 0);
+        }
+    }
+    double elapsed = bench_now() - start;
+
+    // Connections the server could not watch were closed by it
+    int held = 0;
+    for(int i = 0; i < opened; i++) {
+        char c;
+        ssize_t nbytes = recv(idle[i], &c, 1, MSG_DONTWAIT);
+        held += nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        close(idle[i]);
+    }
+    for(int i = 0; i < nactive; i++) {
+        if(active[i].fd != -1)
+            close(active[i].fd);
+    }
+    close(seed);
+    bench_stop_server(pid);
+
+    printf("  %-6s %5d/%-5d idle held  %4d/%-4d active served  %9.0f req/sec  %8.3f ms avg\n",
+           event_backend_name(backend), held, nidle, served, BENCH_ACTIVE, requests / elapsed,
+           requests ? latency / requests * 1000 : 0.0);
+
+    free(sent_at);
+    free(active);
+    free(idle);
+}
+
+static void bench_connections() {
+    static const int backends[] = {
+#ifdef HAVE_EPOLL
+        EVENT_BACKEND_EPOLL,
+#endif
+        EVENT_BACKEND_SELECT,
+    };
+    bench_raise_fd_limit();
+    printf("connections: %d active clients, %d seconds each\n", BENCH_ACTIVE, BENCH_SECONDS);
+    for(size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        bench_connections_run(backends[i], 0);
+        bench_connections_run(backends[i], BENCH_IDLE);
+    }
+}
+
+struct bench_client
+{
+    int id;
+    double deadline;
+    uint64_t requests;
+};
+
+// Keeps BENCH_CLIENT_CONNECTIONS requests in flight, mostly SEARCH with the odd INDEX
+static void *bench_client_run(void *arg) {
+    static const char query[] = "SEARCH the quick\r\n";
+    struct bench_client *client = arg;
+    struct pollfd fds[BENCH_CLIENT_CONNECTIONS];
+    uint32_t sent = 0;
+    int nfds = 0;
+
+    for(; nfds < BENCH_CLIENT_CONNECTIONS; nfds++) {
+        if((fds[nfds].fd = bench_connect()) == -1)
+            break;
+        fds[nfds].events = POLLIN;
+        send(fds[nfds].fd, query, sizeof(query) - 1, 0);
+    }
+
+    while(bench_now() < client->deadline) {
+        if(poll(fds, nfds, 100) <= 0)
+            continue;
+        for(int i = 0; i < nfds; i++) {
+            char buf[4096];
+            if(!fds[i].revents)
+                continue;
+            ssize_t nbytes = recv(fds[i].fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if(nbytes <= 0 || buf[nbytes - 1] != '\n')
+                continue;
+            client->requests++;
+            if(++sent % BENCH_WRITE_EVERY == 0) {
+                char command[64];
+                int length = snprintf(command, sizeof(command),
+                                      "INDEX new_%d_%u brown fox jumps\r\n", client->id, sent);
+                send(fds[i].fd, command, length, 0);
+            } else {
+                send(fds[i].fd, query, sizeof(query) - 1, 0);
+            }
+        }
+    }
+
+    for(int i = 0; i < nfds; i++)
+        close(fds[i].fd);
+    return NULL;
+}
+
+static void bench_workers() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int counts[] = {1, 2, 4, 8};
+    printf("workers: %d client threads x %d connections, 1 in %d requests is an INDEX, %ld CPUs\n",
+           BENCH_CLIENT_THREADS, BENCH_CLIENT_CONNECTIONS, BENCH_WRITE_EVERY, cpus);
+
+    for(size_t n = 0; n < sizeof(counts) / sizeof(counts[0]); n++) {
+        if(counts[n] > 1 && counts[n] > cpus * 2)
+            break;
+        pid_t pid = bench_spawn_server(CONFIG_DEFAULT_EVENT_BACKEND, counts[n]);
+        int seed = bench_seed_server(pid);
+        if(seed == -1)
+            return;
+
+        struct bench_client clients[BENCH_CLIENT_THREADS];
+        pthread_t threads[BENCH_CLIENT_THREADS];
+        double start = bench_now();
+        for(int i = 0; i < BENCH_CLIENT_THREADS; i++) {
+            clients[i].id = i;
+            clients[i].deadline = start + BENCH_SECONDS;
+            clients[i].requests = 0;
+            pthread_create(&threads[i], NULL, bench_client_run, &clients[i]);
+        }
+        uint64_t requests = 0;
+        for(int i = 0; i < BENCH_CLIENT_THREADS; i++) {
+            pthread_join(threads[i], NULL);
+            requests += clients[i].requests;
+        }
+        double elapsed = bench_now() - start;
+        close(seed);
+        bench_stop_server(pid);
+
+        printf("  %d workers  %9.0f req/sec\n", counts[n], requests / elapsed);
+    }
+}
+
+// Sends depth SEARCH commands at once and waits for all their replies, over and over
+static void bench_pipeline_run(int fd, int depth) {
+    static const char query[] = "SEARCH pipelined search\r\n";
+    char batch[BENCH_PIPELINE_MAX * sizeof(query)];
+    for(int i = 0; i < depth; i++)
+        memcpy(batch + i * (sizeof(query) - 1), query, sizeof(query) - 1);
+
+    uint64_t requests = 0;
+    double start = bench_now();
+    double elapsed;
+    while((elapsed = bench_now() - start) < BENCH_SECONDS) {
+        if(send(fd, batch, depth * (sizeof(query) - 1), 0) <= 0)
+            break;
+        int replies = 0;
+        while(replies < depth) {
+            char buf[4096];
+            ssize_t nbytes = recv(fd, buf, sizeof(buf), 0);
+            if(nbytes <= 0)
+                return;
+            for(const char *on = buf; (on = memchr(on, '\n', buf + nbytes - on)); on++)
+                replies++;
+        }
+        requests += depth;
+    }
+    printf("  depth %3d  %9.0f ops/sec\n", depth, requests / elapsed);
+}
+
+static void bench_pipeline() {
+    static const char document[] = "INDEX pipeline_doc some pipelined search\r\n";
+    int depths[] = {1, 16, BENCH_PIPELINE_MAX};
+    printf("pipeline: 1 connection, 1 worker\n");
+
+    pid_t pid = bench_spawn_server(CONFIG_DEFAULT_EVENT_BACKEND, 1);
+    int seed = bench_seed_server(pid);
+    if(seed == -1)
+        return;
+    bench_roundtrip(seed, document, sizeof(document) - 1);
+    for(size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); i++)
+        bench_pipeline_run(seed, depths[i]);
+    close(seed);
+    bench_stop_server(pid);
+}
+
+static const struct benchmark benchmarks[] = {
+    {"connections", bench_connections},
+    {"intersect", bench_intersect},
+    {"pipeline", bench_pipeline},
+    {"rank", bench_rank},
+    {"strings", bench_strings},
+    {"tokenizer", bench_tokenizer},
+    {"workers", bench_workers},
+};
+
+int run_benchmarks(const char *name) {
+    int found = 0;
+    for(size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        if(!strcmp(name, "all") || !strcmp(name, benchmarks[i].name)) {
+            benchmarks[i].run();
+            found = 1;
+        }
+    }
+    if(!found) {
+        fprintf(stderr, "Unknown benchmark '%s'\n", name);
+        return 1;
+    }
+    return 0;
+}
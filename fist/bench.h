@@ -0,0 +1,8 @@
+#ifndef H_BENCH
+#define H_BENCH
+
+// Runs the benchmark called name, or every benchmark if name is "all". Returns 1 if there is no
+// benchmark with that name.
+int run_benchmarks(const char *name);
+
+#endif
@@ -0,0 +1,136 @@
+#include "cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+void cache_init(struct cache *cache, uint32_t capacity) {
+    memset(cache, 0, sizeof(struct cache));
+    cache->free = -1;
+    if(capacity == 0)
+        return;
+    uint32_t nbuckets = 1;
+    while(nbuckets < capacity)
+        nbuckets *= 2;
+    cache->capacity = capacity;
+    cache->entries = calloc(capacity, sizeof(struct cache_entry));
+    for(uint32_t i = 0; i < capacity; i++) {
+        cache->entries[i].next = i + 1 < capacity ? (int32_t)i + 1 : -1;
+    }
+    cache->free = 0;
+    cache->buckets = malloc(sizeof(int32_t) * nbuckets);
+    memset(cache->buckets, 0xff, sizeof(int32_t) * nbuckets);
+    cache->mask = nbuckets - 1;
+}
+
+void cache_free(struct cache *cache) {
+    for(uint32_t i = 0; i < cache->capacity; i++) {
+        if(cache->entries[i].reply) {
+            free(cache->entries[i].key);
+            outshared_release(cache->entries[i].reply);
+        }
+    }
+    free(cache->entries);
+    free(cache->buckets);
+    memset(cache, 0, sizeof(struct cache));
+    cache->free = -1;
+}
+
+static struct cache_entry *cache_find(struct cache *cache, const char *key, uint32_t length,
+                                      uint64_t hash) {
+    for(int32_t i = cache->buckets[hash & cache->mask]; i != -1; i = cache->entries[i].next) {
+        struct cache_entry *entry = &cache->entries[i];
+        if(entry->hash == hash && entry->key_length == length && !memcmp(entry->key, key, length))
+            return entry;
+    }
+    return NULL;
+}
+
+// Stores are relaxed atomics so cache_stats() never reads a torn value, the owner is the only
+// writer so it needs no atomic increment
+static void cache_count(uint64_t *counter) {
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+struct outshared *cache_get(struct cache *cache, const char *key, uint32_t length,
+                            uint64_t generation) {
+    if(!cache->capacity)
+        return NULL;
+    struct cache_entry *entry = cache_find(cache, key, length, hhash(key, length));
+    if(!entry || entry->generation != generation) {
+        cache_count(&cache->misses);
+        return NULL;
+    }
+    cache_count(&cache->hits);
+    entry->referenced = 1;
+    return entry->reply;
+}
+
+// Takes the entry out of its bucket and puts it on the free ones
+static void cache_remove(struct cache *cache, int32_t index) {
+    struct cache_entry *entry = &cache->entries[index];
+    int32_t *link = &cache->buckets[entry->hash & cache->mask];
+    while(*link != index)
+        link = &cache->entries[*link].next;
+    *link = entry->next;
+
+    cache->memory -= entry->reply->length;
+    cache->length--;
+    free(entry->key);
+    outshared_release(entry->reply);
+    entry->reply = NULL;
+    entry->next = cache->free;
+    cache->free = index;
+}
+
+// Frees the next entry the clock hand finds unreferenced
+static void cache_evict(struct cache *cache) {
+    for(;;) {
+        struct cache_entry *entry = &cache->entries[cache->hand];
+        uint32_t on = cache->hand;
+        cache->hand = (cache->hand + 1) % cache->capacity;
+        if(!entry->reply)
+            continue;
+        if(!entry->referenced) {
+            cache_remove(cache, on);
+            return;
+        }
+        entry->referenced = 0;
+    }
+}
+
+void cache_put(struct cache *cache, const char *key, uint32_t length, uint64_t generation,
+               struct outshared *reply) {
+    if(!cache->capacity || reply->length > CACHE_REPLY_MAX)
+        return;
+    uint64_t hash = hhash(key, length);
+    struct cache_entry *entry = cache_find(cache, key, length, hash);
+    if(entry)
+        cache_remove(cache, entry - cache->entries);
+    while(cache->length > 0 &&
+          (cache->free == -1 || cache->memory + reply->length > CACHE_MEMORY_MAX))
+        cache_evict(cache);
+
+    int32_t index = cache->free;
+    entry = &cache->entries[index];
+    cache->free = entry->next;
+    entry->hash = hash;
+    entry->generation = generation;
+    entry->key = malloc(length ? length : 1);
+    memcpy(entry->key, key, length);
+    entry->key_length = length;
+    // Only a hit marks it, so keys searched once are the first to go
+    entry->referenced = 0;
+    entry->reply = reply;
+    reply->refs++;
+    entry->next = cache->buckets[hash & cache->mask];
+    cache->buckets[hash & cache->mask] = index;
+    cache->memory += reply->length;
+    cache->length++;
+}
+
+void cache_stats(const struct cache *cache, uint64_t *hits, uint64_t *misses) {
+    *hits = __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,52 @@
+#ifndef H_CACHE
+#define H_CACHE
+
+#include <stdint.h>
+
+#include "outbuf.h"
+
+#define CACHE_MEMORY_MAX (64 * 1024 * 1024)      // Bytes of replies one cache holds at most
+#define CACHE_REPLY_MAX (CACHE_MEMORY_MAX / 16) // Longer replies are not cached
+
+struct cache_entry
+{
+    uint64_t hash;
+    uint64_t generation; // What the database was at when reply was built
+    char *key;
+    uint32_t key_length;
+    int referenced;          // Hit since the clock hand passed it last
+    struct outshared *reply; // NULL if the entry is free
+    int32_t next;            // Next entry of the same bucket or of the free ones, -1 at the end
+};
+
+// Replies to recent searches by their normalized text. Replies are shared with the connections
+// they are queued on, so a hit is sent without copying it. Once it is full the clock hand sweeps
+// over the entries, clearing referenced, and the first one that was not hit since it last passed
+// makes room. It is not locked, every worker has its own.
+struct cache
+{
+    struct cache_entry *entries;
+    uint32_t length;   // Entries in use
+    uint32_t capacity; // 0 if caching is off
+    int32_t *buckets;  // First entry of each bucket by hash, -1 if there is none
+    uint32_t mask;
+    int32_t free; // First free entry
+    uint32_t hand;
+    uint64_t memory; // Bytes of the replies
+    uint64_t hits;   // Only written by the owner, other threads read them with cache_stats()
+    uint64_t misses;
+};
+
+void cache_init(struct cache *cache, uint32_t capacity);
+void cache_free(struct cache *cache);
+// The reply cached for key if it was built at generation, otherwise NULL. The reply stays with the
+// cache, take a reference to keep it. Counts a hit or a miss.
+struct outshared *cache_get(struct cache *cache, const char *key, uint32_t length,
+                            uint64_t generation);
+// Keeps a reference to reply as the one for key at generation, unless it is longer than
+// CACHE_REPLY_MAX
+void cache_put(struct cache *cache, const char *key, uint32_t length, uint64_t generation,
+               struct outshared *reply);
+void cache_stats(const struct cache *cache, uint64_t *hits, uint64_t *misses); // From any thread
+
+#endif
@@ -0,0 +1,332 @@
+#include "cmdlog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "database.h"
+#include "dstring.h"
+#include "hashmap.h"
+#include "utils.h"
+
+#define CMDLOG_RECORD_HEADER 8 // Length and checksum
+#define CMDLOG_BODY_MIN 5      // Operation and name length
+
+static uint32_t cmdlog_checksum(const char *body, uint32_t length) {
+    return (uint32_t)hhash(body, length);
+}
+
+static int write_all(int fd, const char *data, uint64_t length) {
+    while(length > 0) {
+        ssize_t n = write(fd, data, length);
+        if(n == -1) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// Creates a log holding only its header, returns the file descriptor or -1
+static int cmdlog_create(const char *path, uint64_t id) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if(fd == -1)
+        return -1;
+    char header[CMDLOG_HEADER];
+    memcpy(header, CMDLOG_MAGIC, 8);
+    memcpy(header + 8, &id, sizeof(id));
+    if(write_all(fd, header, sizeof(header)) == -1 || fdatasync(fd) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void *cmdlog_sync_run(void *arg) {
+    struct cmdlog *log = arg;
+    uint64_t synced = 0;
+    pthread_mutex_lock(&log->lock);
+    while(!log->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec++;
+        while(!log->stop &&
+              pthread_cond_timedwait(&log->cond, &log->lock, &deadline) != ETIMEDOUT)
+            ;
+        pthread_mutex_unlock(&log->lock);
+
+        pthread_mutex_lock(&log->file_lock);
+        if(log->size != synced && fdatasync(log->fd) == -1)
+            perror("cmdlog: fdatasync");
+        synced = log->size;
+        pthread_mutex_unlock(&log->file_lock);
+
+        pthread_mutex_lock(&log->lock);
+    }
+    pthread_mutex_unlock(&log->lock);
+    return NULL;
+}
+
+struct cmdlog *cmdlog_open(const char *path, int policy, struct database *db) {
+    int fd = open(path, O_RDWR | O_APPEND);
+    uint64_t id = db->log_id + 1;
+    if(fd == -1 && errno == ENOENT)
+        fd = cmdlog_create(path, id);
+    if(fd == -1) {
+        perror("cmdlog: open");
+        return NULL;
+    }
+
+    char header[CMDLOG_HEADER];
+    if(pread(fd, header, sizeof(header), 0) != sizeof(header) ||
+       memcmp(header, CMDLOG_MAGIC, 8)) {
+        fprintf(stderr, "cmdlog: %s is not a command log\n", path);
+        close(fd);
+        return NULL;
+    }
+    memcpy(&id, header + 8, sizeof(id));
+
+    struct cmdlog *log = calloc(1, sizeof(struct cmdlog));
+    log->path = strdup(path);
+    log->fd = fd;
+    log->fsync = policy;
+    log->id = id;
+    log->size = lseek(fd, 0, SEEK_END);
+    log->appended = log->committed = log->size;
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->cond, NULL);
+    pthread_mutex_init(&log->file_lock, NULL);
+    if(policy == CMDLOG_FSYNC_EVERYSEC &&
+       pthread_create(&log->syncer, NULL, cmdlog_sync_run, log)) {
+        perror("cmdlog: pthread_create");
+        log->fsync = CMDLOG_FSYNC_NO;
+    }
+    return log;
+}
+
+void cmdlog_close(struct cmdlog *log) {
+    cmdlog_commit(log, log->appended);
+    if(log->fsync == CMDLOG_FSYNC_EVERYSEC) {
+        pthread_mutex_lock(&log->lock);
+        log->stop = 1;
+        pthread_cond_broadcast(&log->cond);
+        pthread_mutex_unlock(&log->lock);
+        pthread_join(log->syncer, NULL);
+    }
+    if(fdatasync(log->fd) == -1)
+        perror("cmdlog: fdatasync");
+    close(log->fd);
+    pthread_mutex_destroy(&log->lock);
+    pthread_cond_destroy(&log->cond);
+    pthread_mutex_destroy(&log->file_lock);
+    free(log->buffer);
+    free(log->spare);
+    free(log->path);
+    free(log);
+}
+
+// Runs the record body, returns 0 if it is malformed
+static int cmdlog_apply(struct database *db, char *body, uint32_t length) {
+    uint32_t name_length;
+    memcpy(&name_length, body + 1, sizeof(name_length));
+    if(name_length > length - CMDLOG_BODY_MIN)
+        return 0;
+    char *name = body + CMDLOG_BODY_MIN;
+    char *text = name + name_length;
+    uint32_t text_length = length - CMDLOG_BODY_MIN - name_length;
+
+    if(body[0] == CMDLOG_DELETE) {
+        database_delete(db, name, name_length);
+        return 1;
+    }
+    if(body[0] != CMDLOG_INDEX && body[0] != CMDLOG_DELETE_DOCUMENT && body[0] != CMDLOG_REINDEX)
+        return 0;
+
+    dstring document = dcreaten(name, name_length);
+    if(body[0] == CMDLOG_INDEX)
+        database_index(db, document, text, text_length);
+    else if(body[0] == CMDLOG_REINDEX)
+        database_reindex(db, document, text, text_length);
+    else
+        database_delete_document(db, document);
+    dfree(document);
+    return 1;
+}
+
+uint32_t cmdlog_replay(struct cmdlog *log, struct database *db) {
+    // A snapshot taken from this log already holds the records before its mark
+    uint64_t offset = CMDLOG_HEADER;
+    if(db->log_id == log->id && db->log_offset > offset && db->log_offset <= log->size)
+        offset = db->log_offset;
+
+    char *body = NULL;
+    uint32_t capacity = 0;
+    uint32_t replayed = 0;
+    for(;;) {
+        uint32_t header[2];
+        if(pread(log->fd, header, sizeof(header), offset) != sizeof(header) ||
+           header[0] < CMDLOG_BODY_MIN || offset + sizeof(header) + header[0] > log->size)
+            break;
+        if(header[0] > capacity) {
+            capacity = header[0];
+            body = realloc(body, capacity);
+        }
+        if(pread(log->fd, body, header[0], offset + sizeof(header)) != header[0] ||
+           cmdlog_checksum(body, header[0]) != header[1] || !cmdlog_apply(db, body, header[0]))
+            break;
+        offset += sizeof(header) + header[0];
+        replayed++;
+    }
+    free(body);
+
+    // Whatever follows the last good record was cut short by a crash
+    if(offset < log->size) {
+        fprintf(stderr, "cmdlog: Dropping %llu bytes of a partly written record\n",
+                (unsigned long long)(log->size - offset));
+        if(ftruncate(log->fd, offset) == -1)
+            perror("cmdlog: ftruncate");
+        else
+            log->size = log->appended = log->committed = offset;
+    }
+    return replayed;
+}
+
+uint64_t cmdlog_append(struct cmdlog *log, int op, const char *name, uint32_t name_length,
+                       const char *text, uint32_t text_length) {
+    uint32_t body_length = CMDLOG_BODY_MIN + name_length + text_length;
+    uint32_t length = CMDLOG_RECORD_HEADER + body_length;
+
+    pthread_mutex_lock(&log->lock);
+    if(log->length + length > log->capacity) {
+        uint32_t capacity = log->capacity ? log->capacity : 4096;
+        while(capacity < log->length + length)
+            capacity *= 2;
+        log->buffer = realloc(log->buffer, capacity);
+        log->capacity = capacity;
+    }
+    char *record = log->buffer + log->length;
+    char *body = record + CMDLOG_RECORD_HEADER;
+    body[0] = op;
+    memcpy(body + 1, &name_length, sizeof(name_length));
+    memcpy(body + CMDLOG_BODY_MIN, name, name_length);
+    if(text_length)
+        memcpy(body + CMDLOG_BODY_MIN + name_length, text, text_length);
+    uint32_t checksum = cmdlog_checksum(body, body_length);
+    memcpy(record, &body_length, sizeof(body_length));
+    memcpy(record + 4, &checksum, sizeof(checksum));
+    log->length += length;
+    log->appended += length;
+    uint64_t position = log->appended;
+    pthread_mutex_unlock(&log->lock);
+    return position;
+}
+
+int cmdlog_commit(struct cmdlog *log, uint64_t position) {
+    pthread_mutex_lock(&log->lock);
+    while(!log->failed && log->committed < position) {
+        if(log->committing) {
+            pthread_cond_wait(&log->cond, &log->lock);
+            continue;
+        }
+
+        // Whoever finds no commit running writes everything appended so far, the threads that
+        // appended meanwhile wait for it instead of writing their own records
+        char *data = log->buffer;
+        uint32_t length = log->length;
+        uint32_t capacity = log->capacity;
+        uint64_t end = log->appended;
+        log->buffer = log->spare;
+        log->capacity = log->spare_capacity;
+        log->length = 0;
+        log->committing = 1;
+        pthread_mutex_unlock(&log->lock);
+
+        pthread_mutex_lock(&log->file_lock);
+        int rc = write_all(log->fd, data, length);
+        if(rc == 0 && log->fsync == CMDLOG_FSYNC_ALWAYS)
+            rc = fdatasync(log->fd);
+        if(rc == -1)
+            perror("cmdlog: write");
+        else
+            log->size += length;
+        pthread_mutex_unlock(&log->file_lock);
+
+        pthread_mutex_lock(&log->lock);
+        log->spare = data;
+        log->spare_capacity = capacity;
+        log->committing = 0;
+        if(rc == -1)
+            log->failed = 1;
+        else
+            log->committed = end;
+        pthread_cond_broadcast(&log->cond);
+    }
+    int rc = log->failed ? -1 : 0;
+    pthread_mutex_unlock(&log->lock);
+    return rc;
+}
+
+void cmdlog_mark(struct cmdlog *log, uint64_t *id, uint64_t *offset) {
+    pthread_mutex_lock(&log->lock);
+    *id = log->id;
+    *offset = log->appended - log->shift;
+    pthread_mutex_unlock(&log->lock);
+}
+
+int cmdlog_rewrite(struct cmdlog *log, uint64_t offset) {
+    // Every record up to the mark must be in the file before the rest can be copied
+    pthread_mutex_lock(&log->lock);
+    uint64_t position = offset + log->shift;
+    pthread_mutex_unlock(&log->lock);
+    if(cmdlog_commit(log, position) == -1)
+        return -1;
+
+    pthread_mutex_lock(&log->file_lock);
+    if(offset < CMDLOG_HEADER || offset > log->size) {
+        pthread_mutex_unlock(&log->file_lock);
+        return -1;
+    }
+
+    // Records appended after the mark are copied over to a new log, which replaces the old one
+    // once it is complete
+    dstring tmp_path = dappend(dcreate(log->path), ".tmp");
+    int fd = cmdlog_create(dtext(tmp_path), log->id + 1);
+    int rc = fd == -1 ? -1 : 0;
+    char buffer[65536];
+    for(uint64_t from = offset; rc == 0 && from < log->size;) {
+        ssize_t n = pread(log->fd, buffer, MIN((uint64_t)sizeof(buffer), log->size - from), from);
+        if(n <= 0 || write_all(fd, buffer, n) == -1)
+            rc = -1;
+        from += n;
+    }
+    if(rc == 0 && (fdatasync(fd) == -1 || rename(dtext(tmp_path), log->path) == -1))
+        rc = -1;
+    if(rc == -1) {
+        perror("cmdlog: rewrite");
+        if(fd != -1) {
+            close(fd);
+            unlink(dtext(tmp_path));
+        }
+        pthread_mutex_unlock(&log->file_lock);
+        dfree(tmp_path);
+        return -1;
+    }
+    dfree(tmp_path);
+
+    close(log->fd);
+    log->fd = fd;
+    log->size = CMDLOG_HEADER + log->size - offset;
+    pthread_mutex_lock(&log->lock);
+    log->id++;
+    log->shift += offset - CMDLOG_HEADER;
+    pthread_mutex_unlock(&log->lock);
+    pthread_mutex_unlock(&log->file_lock);
+    return 0;
+}
@@ -0,0 +1,85 @@
+#ifndef H_CMDLOG
+#define H_CMDLOG
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "database.h"
+
+// The file starts with CMDLOG_MAGIC and the uint64 id of the log, which changes whenever the log
+// is rewritten. Every record is a uint32 length and a uint32 checksum of its body, followed by the
+// body: the operation, the uint32 length of the name and the name, and for INDEX and REINDEX the
+// text.
+#define CMDLOG_MAGIC "FISTLOG1"
+#define CMDLOG_HEADER 16
+
+// When records are flushed to disk, see CommandLogFsync in fist_config(5)
+enum cmdlog_fsync
+{
+    CMDLOG_FSYNC_NO = 0,       // Written to the file, the OS decides when it reaches the disk
+    CMDLOG_FSYNC_EVERYSEC = 1, // Flushed once a second by a thread of the log
+    CMDLOG_FSYNC_ALWAYS = 2,   // Flushed before the commands that wrote the records are answered
+};
+
+enum cmdlog_op
+{
+    CMDLOG_INDEX = 1,
+    CMDLOG_DELETE = 2,
+    CMDLOG_DELETE_DOCUMENT = 3,
+    CMDLOG_REINDEX = 4,
+};
+
+// Append-only log of the commands that changed the index since the last snapshot. Records are
+// appended to a buffer in the order the commands changed the database, committing writes every
+// record appended so far, so one write and fsync covers the commands of every thread that
+// committed in the meantime. Positions handed out by cmdlog_append() count every byte ever
+// appended and are never reset by a rewrite.
+struct cmdlog
+{
+    char *path;
+    int fd;
+    int fsync; // One of cmdlog_fsync
+    uint64_t id;   // Guarded by lock
+    uint64_t size; // Bytes in the file, guarded by file_lock like fd
+
+    pthread_mutex_t lock; // Guards the fields below
+    pthread_cond_t cond;  // Signalled whenever a commit finishes
+    char *buffer;         // Records not written yet
+    uint32_t length;
+    uint32_t capacity;
+    char *spare; // Buffer the records go to while a commit writes the other one
+    uint32_t spare_capacity;
+    uint64_t appended;  // Bytes appended
+    uint64_t committed; // Bytes written, and flushed with CMDLOG_FSYNC_ALWAYS
+    uint64_t shift;     // Bytes dropped by rewrites, position - shift is the offset in the file
+    int committing;     // A thread is writing, the others wait for it
+    int failed;
+
+    pthread_mutex_t file_lock; // Taken by whoever writes, flushes or replaces the file
+    pthread_t syncer;
+    int stop;
+};
+
+// Opens the log at path, creating it if it does not exist yet. A new log gets the id after the one
+// db was saved with, so none of its records is taken as part of the snapshot. Returns NULL on
+// failure.
+struct cmdlog *cmdlog_open(const char *path, int policy, struct database *db);
+void cmdlog_close(struct cmdlog *log); // Commits the remaining records, flushes and frees the log
+// Runs the records the snapshot db was loaded from does not hold yet. A record that was only
+// partly written is cut off. Returns the number of records replayed.
+uint32_t cmdlog_replay(struct cmdlog *log, struct database *db);
+// Appends a record for a command that was just run, name and text as they were passed to
+// database_index(), database_delete(), database_delete_document() or database_reindex(). Must be
+// called under the same lock as the command, so the records are in the order the database changed.
+// Returns the position to commit up to.
+uint64_t cmdlog_append(struct cmdlog *log, int op, const char *name, uint32_t name_length,
+                       const char *text, uint32_t text_length);
+int cmdlog_commit(struct cmdlog *log, uint64_t position); // Returns -1 if writing failed
+// The id and the offset in the file just past the last record appended, to be stored with a
+// snapshot of the database as it is now
+void cmdlog_mark(struct cmdlog *log, uint64_t *id, uint64_t *offset);
+// Drops the records before offset once a snapshot taken at that mark was saved, the log gets a
+// new id. Returns -1 on failure, the log is then left as it was.
+int cmdlog_rewrite(struct cmdlog *log, uint64_t offset);
+
+#endif
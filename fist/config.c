@@ -8,12 +8,19 @@
 #include "dstring.h"
 
 static void config_set_default(struct config *config) {
+    config->command_log = CONFIG_DEFAULT_COMMAND_LOG;
+    config->command_log_fsync = CONFIG_DEFAULT_COMMAND_LOG_FSYNC;
     config->db_path = dcreate(CONFIG_DEFAULT_DB_PATH);
+    config->event_backend = CONFIG_DEFAULT_EVENT_BACKEND;
     config->host = dcreate(CONFIG_DEFAULT_HOST);
+    config->index_mode = CONFIG_DEFAULT_INDEX_MODE;
     config->max_phrase_length = CONFIG_DEFAULT_MAX_PHRASE_LEN;
+    config->output_limit = CONFIG_DEFAULT_OUTPUT_LIMIT;
     config->port = CONFIG_DEFAULT_PORT;
     config->save_period = CONFIG_DEFAULT_SAVE_PERIOD;
+    config->search_cache = CONFIG_DEFAULT_SEARCH_CACHE;
     config->so_backlog = CONFIG_DEFAULT_SO_BACKLOG;
+    config->workers = CONFIG_DEFAULT_WORKERS;
 }
 
 static void config_parse_int(const char *val, int *target) {
@@ -22,6 +29,52 @@ static void config_parse_int(const char *val, int *target) {
     *target = atoi(val);
 }
 
+static void config_parse_bool(const char *key, const char *val, int *target) {
+    if(!strcmp(val, "yes")) {
+        *target = 1;
+    } else if(!strcmp(val, "no")) {
+        *target = 0;
+    } else {
+        fprintf(stderr, "config_parse: %s must be yes or no, not '%s'\n", key, val);
+    }
+}
+
+static void config_parse_fsync(const char *val, int *target) {
+    if(!strcmp(val, "always")) {
+        *target = CMDLOG_FSYNC_ALWAYS;
+    } else if(!strcmp(val, "everysec")) {
+        *target = CMDLOG_FSYNC_EVERYSEC;
+    } else if(!strcmp(val, "no")) {
+        *target = CMDLOG_FSYNC_NO;
+    } else {
+        fprintf(stderr, "config_parse: Unknown CommandLogFsync '%s'\n", val);
+    }
+}
+
+static void config_parse_event_backend(const char *val, int *target) {
+    if(!strcmp(val, "epoll")) {
+#ifdef HAVE_EPOLL
+        *target = EVENT_BACKEND_EPOLL;
+#else
+        fprintf(stderr, "config_parse: EventLoop epoll is not available, using select\n");
+#endif
+    } else if(!strcmp(val, "select")) {
+        *target = EVENT_BACKEND_SELECT;
+    } else {
+        fprintf(stderr, "config_parse: Unknown EventLoop '%s'\n", val);
+    }
+}
+
+static void config_parse_index_mode(const char *val, int *target) {
+    if(!strcmp(val, "phrase")) {
+        *target = INDEX_MODE_PHRASE;
+    } else if(!strcmp(val, "positional")) {
+        *target = INDEX_MODE_POSITIONAL;
+    } else {
+        fprintf(stderr, "config_parse: Unknown IndexMode '%s'\n", val);
+    }
+}
+
 void config_free(struct config *config) {
     dfree(config->db_path);
     dfree(config->host);
@@ -77,18 +130,32 @@ struct config *config_parse(const char *path)
         dstring key = dcreate(tokens[0]);
         dstring value = dcreate(tokens[1]);
 
-        if(dequalsc(key, "DatabaseFile")) {
+        if(dequalsc(key, "CommandLog")) {
+            config_parse_bool(tokens[0], tokens[1], &config->command_log);
+        } else if(dequalsc(key, "CommandLogFsync")) {
+            config_parse_fsync(tokens[1], &config->command_log_fsync);
+        } else if(dequalsc(key, "DatabaseFile")) {
             config->db_path = dcreate(dtext(value));
+        } else if(dequalsc(key, "EventLoop")) {
+            config_parse_event_backend(tokens[1], &config->event_backend);
         } else if(dequalsc(key, "Host")) {
             config->host = dcreate(dtext(value));
+        } else if(dequalsc(key, "IndexMode")) {
+            config_parse_index_mode(tokens[1], &config->index_mode);
         } else if(dequalsc(key, "MaxPhraseLength")) {
             config_parse_int(tokens[1], &config->max_phrase_length);
+        } else if(dequalsc(key, "OutputLimit")) {
+            config_parse_int(tokens[1], &config->output_limit);
         } else if(dequalsc(key, "Port")) {
             config_parse_int(tokens[1], &config->port);
         } else if(dequalsc(key, "SavePeriod")) {
             config_parse_int(tokens[1], &config->save_period);
+        } else if(dequalsc(key, "SearchCache")) {
+            config_parse_int(tokens[1], &config->search_cache);
         } else if(dequalsc(key, "SoBacklog")) {
             config_parse_int(tokens[1], &config->so_backlog);
+        } else if(dequalsc(key, "Workers")) {
+            config_parse_int(tokens[1], &config->workers);
         } else {
             fprintf(stderr, "config_parse: %s:%u: Unknown config key '%s'\n", path, line_num,
                     tokens[0]);
@@ -1,24 +1,45 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include "cmdlog.h"
+#include "database.h"
 #include "dstring.h"
+#include "eventloop.h"
 
+#define CONFIG_DEFAULT_COMMAND_LOG 0
+#define CONFIG_DEFAULT_COMMAND_LOG_FSYNC CMDLOG_FSYNC_EVERYSEC
 #define CONFIG_DEFAULT_DB_PATH "fist.db"
+#ifdef HAVE_EPOLL
+#define CONFIG_DEFAULT_EVENT_BACKEND EVENT_BACKEND_EPOLL
+#else
+#define CONFIG_DEFAULT_EVENT_BACKEND EVENT_BACKEND_SELECT
+#endif
 #define CONFIG_DEFAULT_HOST "127.0.0.1"
+#define CONFIG_DEFAULT_INDEX_MODE INDEX_MODE_PHRASE
 #define CONFIG_DEFAULT_MAX_PHRASE_LEN 10
+#define CONFIG_DEFAULT_OUTPUT_LIMIT (16 * 1024 * 1024)
 #define CONFIG_DEFAULT_PATH "/usr/local/etc/fist/fist_config"
 #define CONFIG_DEFAULT_PORT 5575
 #define CONFIG_DEFAULT_SAVE_PERIOD 120
+#define CONFIG_DEFAULT_SEARCH_CACHE 4096
 #define CONFIG_DEFAULT_SO_BACKLOG 10
+#define CONFIG_DEFAULT_WORKERS 0
 
 struct config
 {
+    int command_log; // 1 to log INDEX and DELETE to <db_path>.log
+    int command_log_fsync;
     dstring db_path;
+    int event_backend;
     dstring host;
+    int index_mode;
     int max_phrase_length;
+    int output_limit; // Bytes of unsent replies a connection may have, 0 for no limit
     int port;
     int save_period;
+    int search_cache; // SEARCH replies each worker keeps, 0 to cache none
     int so_backlog;
+    int workers; // 0 for one per CPU
 };
 
 void config_free(struct config *config);
@@ -0,0 +1,592 @@
+#include "database.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "docdict.h"
+#include "dstring.h"
+#include "hashmap.h"
+#include "indexer.h"
+#include "postings.h"
+#include "utils.h"
+
+// A word of a document and where it appears
+struct occurrence
+{
+    struct span word;
+    uint32_t position;
+};
+
+static int cmpoccurrence(const void *pa, const void *pb) {
+    const struct occurrence *a = pa;
+    const struct occurrence *b = pb;
+    int cmp = memcmp(a->word.text, b->word.text, MIN(a->word.length, b->word.length));
+    if(!cmp)
+        cmp = (a->word.length > b->word.length) - (a->word.length < b->word.length);
+    if(cmp)
+        return cmp;
+    return (a->position > b->position) - (a->position < b->position);
+}
+
+static void forward_add(struct forward *fwd, uint32_t document, const char *text,
+                        uint32_t length) {
+    uint32_t page = document / DATABASE_FORWARD_PAGE;
+    if(page >= fwd->npages) {
+        uint32_t npages = fwd->npages ? fwd->npages : 1;
+        while(npages <= page)
+            npages *= 2;
+        fwd->pages = realloc(fwd->pages, sizeof(dstring *) * npages);
+        memset(fwd->pages + fwd->npages, 0, sizeof(dstring *) * (npages - fwd->npages));
+        fwd->npages = npages;
+    }
+    if(!fwd->pages[page])
+        fwd->pages[page] = calloc(DATABASE_FORWARD_PAGE, sizeof(dstring));
+
+    dstring *texts = &fwd->pages[page][document % DATABASE_FORWARD_PAGE];
+    if(texts->length)
+        *texts = dappendc(*texts, '\n');
+    *texts = dappendn(*texts, text, length);
+}
+
+// Hands the texts of document over to the caller, who frees them
+static dstring forward_take(struct forward *fwd, uint32_t document) {
+    uint32_t page = document / DATABASE_FORWARD_PAGE;
+    if(page >= fwd->npages || !fwd->pages[page])
+        return dempty();
+    dstring *texts = &fwd->pages[page][document % DATABASE_FORWARD_PAGE];
+    dstring taken = *texts;
+    *texts = dempty();
+    return taken;
+}
+
+static void forward_free(struct forward *fwd) {
+    for(uint32_t page = 0; page < fwd->npages; page++) {
+        for(uint32_t i = 0; fwd->pages[page] && i < DATABASE_FORWARD_PAGE; i++) {
+            dfree(fwd->pages[page][i]);
+        }
+        free(fwd->pages[page]);
+    }
+    free(fwd->pages);
+    fwd->pages = NULL;
+    fwd->npages = 0;
+}
+
+static int index_phrases(struct database *db, uint32_t document, const char *text,
+                         uint32_t length) {
+    struct ngrams it;
+    struct span phrase;
+    int keys = 0;
+    uint32_t nwords = 0;
+    ngrams_init(&it, text, length, db->max_phrase_length);
+    while(ngrams_next(&it, &phrase)) {
+        padd(hputn(db->hm, phrase.text, phrase.length), document);
+        keys++;
+        nwords += it.words == 1;
+    }
+    docdict_set_length(db->docs, document, db->docs->lengths[document] + nwords);
+    return keys;
+}
+
+// Sorts the words of the text so all positions of a word are added to its postings at once
+static int index_positions(struct database *db, uint32_t document, const char *text,
+                           uint32_t length) {
+    uint32_t nwords = 0;
+    uint32_t offset = 0;
+    struct span word;
+    while(tnext(text, length, &offset, &word))
+        nwords++;
+    if(nwords == 0)
+        return 0;
+
+    // Leave a gap after text indexed earlier so phrases never span two INDEX commands
+    uint32_t base = db->docs->lengths[document];
+    if(base > 0)
+        base++;
+
+    struct occurrence *occurrences = malloc(sizeof(struct occurrence) * nwords);
+    uint32_t *positions = malloc(sizeof(uint32_t) * nwords);
+    offset = 0;
+    for(uint32_t i = 0; tnext(text, length, &offset, &word); i++) {
+        occurrences[i].word = word;
+        occurrences[i].position = base + i;
+    }
+    qsort(occurrences, nwords, sizeof(struct occurrence), cmpoccurrence);
+
+    int keys = 0;
+    for(uint32_t i = 0; i < nwords;) {
+        struct span on = occurrences[i].word;
+        uint32_t npos = 0;
+        uint32_t j = i;
+        while(j < nwords && occurrences[j].word.length == on.length &&
+              !memcmp(occurrences[j].word.text, on.text, on.length)) {
+            positions[npos++] = occurrences[j].position;
+            j++;
+        }
+        padd_positions(hputn(db->hm, on.text, on.length), document, positions, npos);
+        keys++;
+        i = j;
+    }
+
+    docdict_set_length(db->docs, document, base + nwords);
+    free(occurrences);
+    free(positions);
+    return keys;
+}
+
+// Keeps the positions in candidates that are followed by a position in next at distance offset
+static uint32_t follow_positions(uint32_t *candidates, uint32_t ncandidates, const uint32_t *next,
+                                 uint32_t nnext, uint32_t offset) {
+    uint32_t kept = 0;
+    uint32_t j = 0;
+    for(uint32_t i = 0; i < ncandidates; i++) {
+        uint32_t want = candidates[i] + offset;
+        while(j < nnext && next[j] < want)
+            j++;
+        if(j < nnext && next[j] == want)
+            candidates[kept++] = candidates[i];
+    }
+    return kept;
+}
+
+// Checks whether the words under the cursors appear next to each other in the current document
+static int phrase_matches(struct pcursor *cursors, int nwords, uint32_t **scratch,
+                          uint32_t *scratch_capacity) {
+    uint32_t needed = 0;
+    for(int i = 0; i < nwords; i++) {
+        needed += pcursor_npos(&cursors[i]);
+    }
+    if(needed > *scratch_capacity) {
+        *scratch_capacity = needed;
+        *scratch = realloc(*scratch, sizeof(uint32_t) * needed);
+    }
+
+    uint32_t *candidates = *scratch;
+    uint32_t ncandidates = pcursor_npos(&cursors[0]);
+    pcursor_positions(&cursors[0], candidates);
+    uint32_t *next = candidates + ncandidates;
+    for(int i = 1; i < nwords && ncandidates > 0; i++) {
+        uint32_t nnext = pcursor_npos(&cursors[i]);
+        pcursor_positions(&cursors[i], next);
+        ncandidates = follow_positions(candidates, ncandidates, next, nnext, i);
+    }
+    return ncandidates > 0;
+}
+
+static uint32_t search_positions(struct database *db, const char *phrase, uint32_t length,
+                                 uint32_t **ids) {
+    int nwords = 0;
+    uint32_t offset = 0;
+    struct span word;
+    while(tnext(phrase, length, &offset, &word))
+        nwords++;
+    uint32_t count = 0;
+    *ids = NULL;
+
+    struct lookup *lists = malloc(sizeof(struct lookup) * nwords);
+    struct pcursor *cursors = malloc(sizeof(struct pcursor) * nwords);
+    int rarest = 0;
+    offset = 0;
+    for(int i = 0; tnext(phrase, length, &offset, &word); i++) {
+        database_lookup(db, word.text, word.length, &lists[i]);
+        if(lists[i].list.length < lists[rarest].list.length)
+            rarest = i;
+        pcursor_init(&cursors[i], &lists[i].list);
+    }
+    if(nwords == 0 || lists[rarest].list.length == 0)
+        goto done;
+
+    *ids = malloc(sizeof(uint32_t) * lists[rarest].list.length);
+    uint32_t *scratch = NULL;
+    uint32_t scratch_capacity = 0;
+
+    // Drive the intersection from the rarest word and let every other cursor skip ahead to it
+    uint32_t candidate;
+    int more = pcursor_next(&cursors[rarest], &candidate);
+    while(more) {
+        uint32_t highest = candidate;
+        for(int i = 0; i < nwords; i++) {
+            uint32_t found;
+            if(!(more = pcursor_seek(&cursors[i], candidate, &found)))
+                break;
+            if(found > highest)
+                highest = found;
+        }
+        if(!more)
+            break;
+        if(highest != candidate) {
+            candidate = highest;
+            continue;
+        }
+        if(phrase_matches(cursors, nwords, &scratch, &scratch_capacity))
+            (*ids)[count++] = candidate;
+        more = pcursor_next(&cursors[rarest], &candidate);
+    }
+    free(scratch);
+
+done:
+    for(int i = 0; i < nwords; i++) {
+        lookup_release(&lists[i]);
+    }
+    free(lists);
+    free(cursors);
+    return count;
+}
+
+struct database *database_create(int mode, int max_phrase_length) {
+    struct database *db = calloc(1, sizeof(struct database));
+    db->mode = mode;
+    db->max_phrase_length = max_phrase_length;
+    db->hm = hcreate();
+    db->deleted = hcreate();
+    db->next_segment = 1;
+    db->docs = docdict_create();
+    db->generations = calloc(HMAP_GENERATIONS, sizeof(uint64_t));
+    db->hm->generations = db->deleted->generations = db->generations;
+    return db;
+}
+
+void database_free(struct database *db) {
+    hfree(db->hm);
+    hfree(db->deleted);
+    if(db->frozen) {
+        hfree(db->frozen);
+        hfree(db->frozen_deleted);
+    }
+    idset_free(&db->frozen_ranges);
+    idset_free(&db->frozen_removed);
+    free(db->frozen_lengths);
+    forward_free(&db->forward);
+    for(uint32_t i = 0; i < db->nsegments; i++) {
+        segment_close(db->segments[i]);
+    }
+    free(db->segments);
+    docdict_free(db->docs);
+    free(db->generations);
+    free(db);
+}
+
+int database_index(struct database *db, dstring name, char *text, uint32_t length) {
+    uint32_t document = docdict_add(db->docs, name);
+    if(docdict_removed(db->docs, document))
+        document = docdict_renew(db->docs, name);
+    length = tnormalize(text, length);
+    if(length)
+        forward_add(&db->forward, document, text, length);
+    if(db->mode == INDEX_MODE_POSITIONAL)
+        return index_positions(db, document, text, length);
+    return index_phrases(db, document, text, length);
+}
+
+static void unindex_key(struct database *db, const char *key, uint32_t length,
+                        uint32_t document) {
+    if(!hcontainsn(db->hm, key, length))
+        return;
+    postings *list = hputn(db->hm, key, length);
+    premove(list, document);
+    if(!list->length)
+        hdeln(db->hm, key, length);
+}
+
+int database_delete_document(struct database *db, dstring name) {
+    uint32_t document;
+    if(!docdict_find(db->docs, name, &document) || docdict_removed(db->docs, document))
+        return 0;
+
+    // The keys of the texts indexed since the last freeze are exactly the ones the document added
+    // to hm, so this costs as much as indexing them did
+    dstring texts = forward_take(&db->forward, document);
+    const char *text = dtext(texts);
+    for(uint32_t start = 0; start < (uint32_t)texts.length;) {
+        const char *newline = memchr(text + start, '\n', texts.length - start);
+        uint32_t end = newline ? (uint32_t)(newline - text) : (uint32_t)texts.length;
+        struct span key;
+        if(db->mode == INDEX_MODE_POSITIONAL) {
+            uint32_t offset = start;
+            while(tnext(text, end, &offset, &key))
+                unindex_key(db, key.text, key.length, document);
+        } else {
+            struct ngrams it;
+            ngrams_init(&it, text + start, end - start, db->max_phrase_length);
+            while(ngrams_next(&it, &key))
+                unindex_key(db, key.text, key.length, document);
+        }
+        start = end + 1;
+    }
+    dfree(texts);
+    docdict_remove(db->docs, document);
+    db->removals++;
+    return 1;
+}
+
+int database_reindex(struct database *db, dstring name, char *text, uint32_t length) {
+    database_delete_document(db, name);
+    return database_index(db, name, text, length);
+}
+
+// Drops the ids of removed documents from the count ids of a search
+static uint32_t drop_removed(struct database *db, uint32_t *ids, uint32_t count) {
+    if(!db->docs->nremoved)
+        return count;
+    uint32_t kept = 0;
+    for(uint32_t i = 0; i < count; i++) {
+        if(!docdict_removed(db->docs, ids[i]))
+            ids[kept++] = ids[i];
+    }
+    return kept;
+}
+
+uint32_t database_search(struct database *db, const char *phrase, uint32_t length, uint32_t **ids) {
+    if(db->mode == INDEX_MODE_POSITIONAL) {
+        uint32_t count = search_positions(db, phrase, length, ids);
+        return drop_removed(db, *ids, count);
+    }
+
+    struct lookup values;
+    database_lookup(db, phrase, length, &values);
+    *ids = malloc(sizeof(uint32_t) * values.list.length);
+    uint32_t count = pdecode(&values.list, *ids);
+    lookup_release(&values);
+    return drop_removed(db, *ids, count);
+}
+
+// The key may still be in the frozen layer or a segment, the tombstone hides it there
+static void delete_key(struct database *db, const char *key, uint32_t length) {
+    hdeln(db->hm, key, length);
+    if(db->frozen || db->nsegments)
+        hputn(db->deleted, key, length);
+}
+
+int database_delete(struct database *db, const char *key, uint32_t length) {
+    if(db->mode != INDEX_MODE_POSITIONAL) {
+        delete_key(db, key, length);
+        return 0;
+    }
+
+    // Keys are single words in positional mode. A phrase has no key of its own, and removing its
+    // words would take them out of every other document as well.
+    uint32_t offset = 0;
+    struct span word;
+    if(!tnext(key, length, &offset, &word))
+        return 0;
+    struct span next;
+    if(tnext(key, length, &offset, &next))
+        return -1;
+    delete_key(db, word.text, word.length);
+    return 0;
+}
+
+uint64_t database_generation(struct database *db, const char *phrase, uint32_t length) {
+    // The counts never go down, so their sum only stays the same while none of them changes
+    uint64_t generation = db->removals;
+    if(db->mode != INDEX_MODE_POSITIONAL)
+        return generation + db->generations[hkey_hash(phrase, length) % HMAP_GENERATIONS];
+
+    uint32_t offset = 0;
+    struct span word;
+    while(tnext(phrase, length, &offset, &word))
+        generation += db->generations[hkey_hash(word.text, word.length) % HMAP_GENERATIONS];
+    return generation;
+}
+
+uint64_t database_keys(struct database *db) {
+    uint64_t keys = database_delta_keys(db);
+    for(uint32_t i = 0; i < db->nsegments; i++) {
+        keys += segment_keys(db->segments[i]);
+    }
+    return keys;
+}
+
+uint64_t database_delta_keys(struct database *db) {
+    return (db->frozen ? db->frozen->length : 0) + db->hm->length;
+}
+
+static void hmemory(hashmap *hm, uint64_t *used, uint64_t *reserved) {
+    *used += hm->slab.used + hm->keys.used;
+    *reserved += hm->slab.reserved + hm->keys.reserved;
+}
+
+void database_memory(struct database *db, uint64_t *used, uint64_t *reserved) {
+    *used = db->docs->text.used;
+    *reserved = db->docs->text.reserved;
+    hmemory(db->hm, used, reserved);
+    hmemory(db->deleted, used, reserved);
+    if(db->frozen) {
+        hmemory(db->frozen, used, reserved);
+        hmemory(db->frozen_deleted, used, reserved);
+    }
+}
+
+int database_unsaved(struct database *db) {
+    uint32_t ndocs = db->nsegments ? db->segments[db->nsegments - 1]->header->ndocs : 0;
+    return db->frozen || db->hm->length || db->deleted->length || db->docs->length != ndocs ||
+           !idset_empty(&db->docs->removed_changed);
+}
+
+// Postings of a key found in the layers so far, newest first. Lookups rarely see more layers than
+// fit on the stack.
+struct sources
+{
+    postings stack[8];
+    int stack_owned[8];
+    postings *found;
+    int *owned;
+    uint32_t n;
+};
+
+static void sources_init(struct sources *src, uint32_t layers) {
+    src->found = src->stack;
+    src->owned = src->stack_owned;
+    src->n = 0;
+    if(layers > 8) {
+        src->found = malloc(sizeof(postings) * layers);
+        src->owned = malloc(sizeof(int) * layers);
+    }
+}
+
+static void sources_add(struct sources *src, postings list, int owned) {
+    src->found[src->n] = list;
+    src->owned[src->n++] = owned;
+}
+
+// Returns 1 if one of the segments deleted the key, the ones below it are not looked at
+static int sources_segments(struct sources *src, struct segment **segments, uint32_t count,
+                            const char *key, uint32_t length) {
+    for(uint32_t i = count; i-- > 0;) {
+        postings list;
+        uint32_t flags;
+        if(!segment_find(segments[i], key, length, &list, &flags))
+            continue;
+        if(list.length)
+            sources_add(src, list, LOOKUP_BORROWED);
+        if(flags & SEGMENT_ENTRY_TOMBSTONE)
+            return 1;
+    }
+    return 0;
+}
+
+// Merges the postings found, oldest first so the first ones are copied block by block
+static void sources_merge(struct sources *src, struct lookup *out) {
+    if(src->n <= 1) {
+        out->list = src->n ? src->found[0] : pcreate();
+        out->owned = src->n ? src->owned[0] : LOOKUP_BORROWED;
+    } else {
+        out->list = pcreate();
+        out->owned = LOOKUP_MERGED;
+        for(uint32_t i = src->n; i-- > 0;) {
+            pmerge(&out->list, &src->found[i]);
+        }
+    }
+    if(src->found != src->stack) {
+        free(src->found);
+        free(src->owned);
+    }
+}
+
+void database_lookup(struct database *db, const char *key, uint32_t length, struct lookup *out) {
+    struct sources src;
+    sources_init(&src, db->nsegments + 2);
+    postings list = hgetn(db->hm, key, length);
+    if(list.length)
+        sources_add(&src, list, LOOKUP_BORROWED);
+    if(!hcontainsn(db->deleted, key, length)) {
+        if(db->frozen && (list = hgetn(db->frozen, key, length)).length)
+            sources_add(&src, list, LOOKUP_BORROWED);
+        if(!db->frozen || !hcontainsn(db->frozen_deleted, key, length))
+            sources_segments(&src, db->segments, db->nsegments, key, length);
+    }
+    sources_merge(&src, out);
+}
+
+void segments_lookup(struct segment **segments, uint32_t count, const char *key, uint32_t length,
+                     struct lookup *out, int *deleted) {
+    struct sources src;
+    sources_init(&src, count);
+    *deleted = sources_segments(&src, segments, count, key, length);
+    sources_merge(&src, out);
+}
+
+void lookup_release(struct lookup *lookup) {
+    if(lookup->owned == LOOKUP_MERGED)
+        pfree(&lookup->list);
+}
+
+void database_freeze(struct database *db) {
+    if(!db->frozen) {
+        db->frozen = db->hm;
+        db->frozen_deleted = db->deleted;
+    } else {
+        // The last snapshot failed, what changed since goes on top of what it was writing. The
+        // deletes came before anything still in hm for the same key.
+        uint32_t slot = 0;
+        keyval *kv;
+        while((kv = hnext(db->deleted, &slot))) {
+            hdeln(db->frozen, itext(&kv->key), kv->key.length);
+            hputn(db->frozen_deleted, itext(&kv->key), kv->key.length);
+        }
+        slot = 0;
+        while((kv = hnext(db->hm, &slot))) {
+            pmerge(hputn(db->frozen, itext(&kv->key), kv->key.length), &kv->values);
+        }
+        hfree(db->hm);
+        hfree(db->deleted);
+    }
+    db->hm = hcreate();
+    db->deleted = hcreate();
+    db->hm->generations = db->deleted->generations = db->generations;
+    idset_move(&db->frozen_ranges, &db->docs->changed);
+    idset_move(&db->frozen_removed, &db->docs->removed_changed);
+    db->frozen_ndocs = db->docs->length;
+    uint32_t nranges = 0;
+    for(uint32_t range = 0; idset_next(&db->frozen_ranges, &range); range++)
+        nranges++;
+    free(db->frozen_lengths);
+    db->frozen_lengths = malloc(sizeof(uint32_t) * DOCDICT_RANGE * (nranges ? nranges : 1));
+    uint32_t *to = db->frozen_lengths;
+    for(uint32_t range = 0; idset_next(&db->frozen_ranges, &range); range++) {
+        uint32_t first = range * DOCDICT_RANGE;
+        memcpy(to, db->docs->lengths + first,
+               sizeof(uint32_t) * MIN(db->docs->length - first, DOCDICT_RANGE));
+        to += DOCDICT_RANGE;
+    }
+    // The frozen layer is never changed, removed documents are skipped there by searches
+    forward_free(&db->forward);
+}
+
+void database_install(struct database *db, struct segment *segment) {
+    db->segments = realloc(db->segments, sizeof(struct segment *) * (db->nsegments + 1));
+    db->segments[db->nsegments++] = segment;
+    if(db->frozen) {
+        hfree(db->frozen);
+        hfree(db->frozen_deleted);
+        db->frozen = db->frozen_deleted = NULL;
+    }
+    idset_free(&db->frozen_ranges);
+    idset_free(&db->frozen_removed);
+    free(db->frozen_lengths);
+    db->frozen_lengths = NULL;
+}
+
+int database_merge_policy(struct database *db, uint32_t *first, uint32_t *count) {
+    if(db->nsegments < 2)
+        return 0;
+
+    // Grow the run from the newest segment while the one before it is not much larger than the
+    // whole run
+    uint32_t i = db->nsegments - 1;
+    uint64_t size = db->segments[i]->size;
+    while(i > 0 && db->segments[i - 1]->size <= DATABASE_MERGE_RATIO * size) {
+        i--;
+        size += db->segments[i]->size;
+    }
+    *first = i;
+    *count = db->nsegments - i;
+    return *count >= 2;
+}
+
+void database_replace(struct database *db, uint32_t first, uint32_t count,
+                      struct segment *segment) {
+    db->segments[first] = segment;
+    memmove(&db->segments[first + 1], &db->segments[first + count],
+            sizeof(struct segment *) * (db->nsegments - first - count));
+    db->nsegments -= count - 1;
+}
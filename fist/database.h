@@ -0,0 +1,127 @@
+#ifndef H_DATABASE
+#define H_DATABASE
+
+#include <stdint.h>
+
+#include "docdict.h"
+#include "dstring.h"
+#include "hashmap.h"
+#include "postings.h"
+#include "segment.h"
+
+// How documents are turned into keys, see IndexMode in fist_config(5)
+enum index_mode
+{
+    INDEX_MODE_PHRASE = 0,     // Every phrase up to max_phrase_length words is its own key
+    INDEX_MODE_POSITIONAL = 1, // Every word is a key, postings hold the word positions
+};
+
+// Segments are merged once the newer ones together reach 1 / DATABASE_MERGE_RATIO of the size of
+// the one before them, so sizes grow geometrically and there are O(log n) segments
+#define DATABASE_MERGE_RATIO 2
+
+#define DATABASE_FORWARD_PAGE 128 // Documents per page of struct forward
+
+// The normalized texts indexed into hm since the last freeze, by document and separated by a
+// newline, so the keys a document added there can be found again when it is removed. A page of
+// DATABASE_FORWARD_PAGE documents is only allocated once one of them was indexed.
+struct forward
+{
+    dstring **pages;
+    uint32_t npages;
+};
+
+// Everything that is persisted to the database files: the key -> postings table and the document
+// names the postings refer to. The keys are kept in layers that are searched together, newest
+// first: hm holds what changed since the last snapshot, frozen what a snapshot in progress is
+// writing, then the segments the snapshots were saved as, mapped from their files. Keys in the
+// deleted table of a layer, or with SEGMENT_ENTRY_TOMBSTONE in a segment, were deleted after
+// everything in the layers below it was written, which no longer count for them. Postings of
+// removed documents are taken out of hm right away, in the layers below they are skipped by
+// searches until a merge drops them.
+struct database
+{
+    int mode;
+    int max_phrase_length;
+    hashmap *hm;
+    hashmap *deleted;
+    hashmap *frozen; // NULL unless a snapshot is being written
+    hashmap *frozen_deleted;
+    struct idset frozen_ranges; // Word counts changed before the freeze, see docs->changed
+    struct idset frozen_removed; // Documents removed before the freeze
+    // Documents and the word counts of frozen_ranges at the freeze, DOCDICT_RANGE counts for each
+    // range in ascending order. Writes may come in before the snapshot is written, so it is
+    // written from these rather than from docs.
+    uint32_t frozen_ndocs;
+    uint32_t *frozen_lengths;
+    struct forward forward;
+    struct segment **segments; // Oldest first
+    uint32_t nsegments;
+    uint64_t next_segment; // Number of the next segment file
+    struct docdict *docs;
+    // Writes to hm and deleted are counted here by key, see hashmap.generations, and removals
+    // counts the documents removed, so together they tell when a search may find something else
+    uint64_t *generations;
+    uint64_t removals;
+    // The command log the segments were saved from and the offset of the first record they do not
+    // hold, see cmdlog_mark()
+    uint64_t log_id;
+    uint64_t log_offset;
+};
+
+// The postings of a key merged from every layer
+struct lookup
+{
+    postings list;
+    int owned; // One of lookup_owned, how list is released
+};
+
+enum lookup_owned
+{
+    LOOKUP_BORROWED = 0, // Belongs to a layer or points into a segment, see segment_find()
+    LOOKUP_MERGED = 1,   // Built from several layers
+};
+
+struct database *database_create(int mode, int max_phrase_length);
+void database_free(struct database *db);
+// Indexes text under the document name, returns the number of keys that were written. The text is
+// normalized in place.
+int database_index(struct database *db, dstring name, char *text, uint32_t length);
+// Ids of the documents containing the normalized phrase in ascending order. The caller frees *ids.
+uint32_t database_search(struct database *db, const char *phrase, uint32_t length, uint32_t **ids);
+// Removes the key. In positional mode the key must be a single word, -1 is returned for a phrase.
+int database_delete(struct database *db, const char *key, uint32_t length);
+// A number that stays the same until a write could change what database_search() finds for the
+// normalized phrase. It only grows, and is only meaningful for the same phrase.
+uint64_t database_generation(struct database *db, const char *phrase, uint32_t length);
+// Removes the document and every key it was indexed under. Returns 0 if there is no such document.
+int database_delete_document(struct database *db, dstring name);
+// Replaces everything indexed under the document name with text, like database_index()
+int database_reindex(struct database *db, dstring name, char *text, uint32_t length);
+// Number of keys in the segments and in the layers above them, keys in several layers count once
+// for each
+uint64_t database_keys(struct database *db);
+uint64_t database_delta_keys(struct database *db); // The keys not in a segment yet
+// Bytes the postings, keys and document names in memory use, and what was reserved for them
+void database_memory(struct database *db, uint64_t *used, uint64_t *reserved);
+int database_unsaved(struct database *db); // 1 if anything changed since the newest segment
+void database_lookup(struct database *db, const char *key, uint32_t length, struct lookup *out);
+// Looks key up in count segments only, newest first from segments[count - 1]. Sets *deleted if one
+// of them holds a tombstone for it.
+void segments_lookup(struct segment **segments, uint32_t count, const char *key, uint32_t length,
+                     struct lookup *out, int *deleted);
+void lookup_release(struct lookup *lookup);
+// Starts a snapshot: the changes so far become read only and new ones go to a fresh layer, so the
+// snapshot can be written from the layers while the database keeps changing
+void database_freeze(struct database *db);
+// Finishes a snapshot: segment holds everything that was frozen, which is dropped
+void database_install(struct database *db, struct segment *segment);
+// Finds segments worth merging by DATABASE_MERGE_RATIO. Returns 0 if there are none, otherwise
+// sets the run of segments to merge.
+int database_merge_policy(struct database *db, uint32_t *first, uint32_t *count);
+// Puts segment in place of the count segments from first on, which it is the merge of. The
+// caller closes them.
+void database_replace(struct database *db, uint32_t first, uint32_t count,
+                      struct segment *segment);
+
+#endif
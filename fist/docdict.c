@@ -0,0 +1,144 @@
+#include "docdict.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dstring.h"
+#include "hashmap.h"
+
+static inline uint64_t docdict_hash(dstring name) {
+    uint64_t hash = hhash(dtext(name), name.length);
+    return hash ? hash : 1;
+}
+
+static int docdict_lookup(struct docdict *docs, dstring name, uint64_t hash, uint32_t *slot) {
+    uint32_t mask = docs->capacity - 1;
+    uint32_t i = hash & mask;
+    while(docs->hashes[i]) {
+        if(docs->hashes[i] == hash) {
+            if(iequals(&docs->names[docs->ids[i]], dtext(name), name.length)) {
+                *slot = i;
+                return 1;
+            }
+        }
+        i = (i + 1) & mask;
+    }
+    *slot = i;
+    return 0;
+}
+
+static void docdict_resize(struct docdict *docs, uint32_t capacity) {
+    uint64_t *old_hashes = docs->hashes;
+    uint32_t *old_ids = docs->ids;
+    uint32_t old_capacity = docs->capacity;
+
+    docs->capacity = capacity;
+    docs->hashes = calloc(capacity, sizeof(uint64_t));
+    docs->ids = malloc(sizeof(uint32_t) * capacity);
+
+    uint32_t mask = capacity - 1;
+    for(uint32_t i = 0; i < old_capacity; i++) {
+        if(!old_hashes[i])
+            continue;
+        uint32_t j = old_hashes[i] & mask;
+        while(docs->hashes[j])
+            j = (j + 1) & mask;
+        docs->hashes[j] = old_hashes[i];
+        docs->ids[j] = old_ids[i];
+    }
+
+    free(old_hashes);
+    free(old_ids);
+}
+
+struct docdict *docdict_create() {
+    struct docdict *docs = calloc(1, sizeof(struct docdict));
+    docs->capacity = DOCDICT_INITIAL_CAPACITY;
+    docs->hashes = calloc(docs->capacity, sizeof(uint64_t));
+    docs->ids = malloc(sizeof(uint32_t) * docs->capacity);
+    return docs;
+}
+
+void docdict_free(struct docdict *docs) {
+    arena_free(&docs->text);
+    free(docs->names);
+    free(docs->lengths);
+    idset_free(&docs->changed);
+    idset_free(&docs->removed);
+    idset_free(&docs->removed_changed);
+    free(docs->hashes);
+    free(docs->ids);
+    free(docs);
+}
+
+// Hands out the next id, with renew even to a name that already has one
+static uint32_t docdict_assign(struct docdict *docs, dstring name, int renew) {
+    uint64_t hash = docdict_hash(name);
+    uint32_t slot;
+    int found = docdict_lookup(docs, name, hash, &slot);
+    if(found && !renew)
+        return docs->ids[slot];
+
+    if(!found && (uint64_t)(docs->length + 1) * 100 > (uint64_t)docs->capacity * HMAP_MAX_LOAD) {
+        docdict_resize(docs, docs->capacity * 2);
+        docdict_lookup(docs, name, hash, &slot);
+    }
+
+    if(docs->length == docs->names_capacity) {
+        docs->names_capacity = docs->names_capacity ? docs->names_capacity * 2 : 16;
+        docs->names = realloc(docs->names, sizeof(istring) * docs->names_capacity);
+        docs->lengths = realloc(docs->lengths, sizeof(uint32_t) * docs->names_capacity);
+    }
+
+    uint32_t id = docs->length++;
+    if(found)
+        docs->names[id] = docs->names[docs->ids[slot]];
+    else
+        docs->names[id] = icreate(&docs->text, dtext(name), name.length);
+    docs->lengths[id] = 0;
+    docs->hashes[slot] = hash;
+    docs->ids[slot] = id;
+    return id;
+}
+
+uint32_t docdict_add(struct docdict *docs, dstring name) {
+    return docdict_assign(docs, name, 0);
+}
+
+uint32_t docdict_renew(struct docdict *docs, dstring name) {
+    return docdict_assign(docs, name, 1);
+}
+
+int docdict_find(struct docdict *docs, dstring name, uint32_t *id) {
+    uint32_t slot;
+    if(!docdict_lookup(docs, name, docdict_hash(name), &slot))
+        return 0;
+    *id = docs->ids[slot];
+    return 1;
+}
+
+const istring *docdict_name(struct docdict *docs, uint32_t id) {
+    return &docs->names[id];
+}
+
+void docdict_set_length(struct docdict *docs, uint32_t id, uint32_t length) {
+    if(docs->lengths[id] == length)
+        return;
+    docs->total_length += (uint64_t)length - docs->lengths[id];
+    docs->lengths[id] = length;
+    idset_add(&docs->changed, id / DOCDICT_RANGE);
+}
+
+void docdict_remove(struct docdict *docs, uint32_t id) {
+    if(idset_has(&docs->removed, id))
+        return;
+    idset_add(&docs->removed, id);
+    idset_add(&docs->removed_changed, id);
+    docs->nremoved++;
+    docdict_set_length(docs, id, 0);
+}
+
+int docdict_removed(struct docdict *docs, uint32_t id) {
+    return idset_has(&docs->removed, id);
+}
@@ -0,0 +1,49 @@
+#ifndef H_DOCDICT
+#define H_DOCDICT
+
+#include <stdint.h>
+
+#include "alloc.h"
+#include "dstring.h"
+#include "idset.h"
+#include "istring.h"
+
+#define DOCDICT_INITIAL_CAPACITY 64
+#define DOCDICT_RANGE 128 // Ids per range of word counts tracked for changes
+
+// Assigns every document name a dense id, starting at 0, in the order names are first seen.
+// Postings only store ids, names are looked up when results are sent back to the client. Ids are
+// never reused: a removed document keeps its id and name, indexing the name again gives it a new
+// id through docdict_renew().
+struct docdict
+{
+    uint32_t length; // Number of ids handed out
+    uint32_t names_capacity;
+    istring *names;    // id -> name, a renewed name shares the text of its old id
+    struct arena text; // Of the names
+    uint32_t *lengths; // Words in each document, word positions used in positional mode
+    uint64_t total_length; // Of all documents, removed ones have length 0
+    // Ranges of DOCDICT_RANGE lengths changed since the last snapshot was started, a snapshot only
+    // writes the lengths of those
+    struct idset changed;
+    struct idset removed;         // Ids of removed documents, their postings no longer count
+    struct idset removed_changed; // Removed since the last snapshot was started
+    uint32_t nremoved;
+    uint32_t capacity; // Slots in the name -> id table, always a power of two
+    uint64_t *hashes;  // Hash of the name in each slot, 0 marks an empty slot
+    uint32_t *ids;
+};
+
+struct docdict *docdict_create();
+void docdict_free(struct docdict *docs);
+uint32_t docdict_add(struct docdict *docs, dstring name); // Id of name, assigned if it is new
+// Gives name the next id even if it has one already, the old id keeps its name but is no longer
+// found by it
+uint32_t docdict_renew(struct docdict *docs, dstring name);
+int docdict_find(struct docdict *docs, dstring name, uint32_t *id); // 1 if name has an id
+const istring *docdict_name(struct docdict *docs, uint32_t id);
+void docdict_set_length(struct docdict *docs, uint32_t id, uint32_t length); // Tracks the change
+void docdict_remove(struct docdict *docs, uint32_t id); // Also sets its length to 0
+int docdict_removed(struct docdict *docs, uint32_t id);
+
+#endif
@@ -13,56 +13,50 @@ int dequalsc(dstring s1, char *s2) {
     return !strcmp(dtext(s1), s2);
 }
 
-dstring dappendc(dstring input, char character) {
-    int new_size = input.length + 2;
-    char *string;
-    if(input.alloc_len == 0) {
-        if(new_size <= DSTRING_SMALL) {
-            string = input.static_text;
-        } else {
-            string = malloc(sizeof(char) * new_size);
-            memcpy(string, input.static_text, input.length);
-            input.alloc_len = new_size;
-            input.text = string;
-        }
-    } else {
-        string = realloc(dtext(input), sizeof(char) * new_size);
-        input.alloc_len = new_size;
-        input.text = string;
+// Makes room for extra more chars and the '\0' and returns where the text is
+static char *dreserve(dstring *input, int extra) {
+    int needed = input->length + extra + 1;
+    if(input->alloc_len == 0) {
+        if(needed <= DSTRING_SMALL)
+            return input->static_text;
+        int capacity = DSTRING_SMALL * 2;
+        while(capacity < needed)
+            capacity *= 2;
+        input->text = malloc(sizeof(char) * capacity);
+        memcpy(input->text, input->static_text, input->length);
+        input->alloc_len = capacity;
+    } else if(needed > input->alloc_len) {
+        int capacity = input->alloc_len * 2;
+        while(capacity < needed)
+            capacity *= 2;
+        input->text = realloc(input->text, sizeof(char) * capacity);
+        input->alloc_len = capacity;
     }
+    return input->text;
+}
+
+dstring dappendc(dstring input, char character) {
+    char *string = dreserve(&input, 1);
     string[input.length] = character;
     string[input.length + 1] = 0;
     input.length++;
     return input;
 }
 
-dstring dappend(dstring input, char *characters) {
-    int increase_by = strlen(characters) + 1;
-    int new_size = strlen(dtext(input)) + increase_by;
-    char *new_dstring = NULL;
-
-    if(input.alloc_len == 0) {
-        if(new_size <= DSTRING_SMALL) {
-            new_dstring = input.static_text;
-        } else {
-            new_dstring = malloc(sizeof(char) * new_size);
-            strcpy(new_dstring, input.static_text);
-            input.alloc_len = new_size;
-            input.text = new_dstring;
-        }
-    } else {
-        new_dstring = realloc(input.text, sizeof(char) * new_size);
-        input.alloc_len = new_size;
-        input.text = new_dstring;
-    }
-    memcpy(&new_dstring[input.length], characters, increase_by);
-
-    input.length += increase_by - 1;
+dstring dappendn(dstring input, const char *characters, int length) {
+    char *string = dreserve(&input, length);
+    memcpy(&string[input.length], characters, length);
+    input.length += length;
+    string[input.length] = 0;
     return input;
 }
 
+dstring dappend(dstring input, char *characters) {
+    return dappendn(input, characters, strlen(characters));
+}
+
 dstring dappendd(dstring input, dstring word) {
-    return dappend(input, dtext(word));
+    return dappendn(input, dtext(word), word.length);
 }
 
 dstring dempty() {
@@ -74,6 +68,20 @@ dstring dcreate(char *initial) {
     return dappend(dempty(), initial);
 }
 
+dstring dcreaten(const char *initial, int length) {
+    dstring output = dempty();
+    char *text = output.static_text;
+    if(length + 1 > DSTRING_SMALL) {
+        text = malloc(sizeof(char) * (length + 1));
+        output.text = text;
+        output.alloc_len = length + 1;
+    }
+    memcpy(text, initial, length);
+    text[length] = 0;
+    output.length = length;
+    return output;
+}
+
 dstring dreverse(dstring input) {
     dstring reversed = dempty();
     for(int i = input.length - 1; i >= 0; i--) {
@@ -105,17 +113,21 @@ int dindexof(dstring input, char character) {
 }
 
 dstringa dcreatea() {
-    dstringa strings = {0, NULL};
+    dstringa strings = {0, 0, NULL};
     return strings;
 }
 
+dstringa dadopt(dstringa array, dstring input) {
+    if(array.length == array.capacity) {
+        array.capacity = array.capacity ? array.capacity * 2 : 4;
+        array.values = realloc(array.values, sizeof(dstring) * array.capacity);
+    }
+    array.values[array.length++] = input;
+    return array;
+}
+
 dstringa dpush(dstringa array, dstring input) {
-    dstring new = dcreate(dtext(input)); // Created new object
-    int new_length = array.length + 1;
-    dstring *new_array = realloc(array.values, sizeof(dstring) * new_length);
-    new_array[array.length] = new;
-    dstringa new_dstringa = {new_length, new_array};
-    return new_dstringa;
+    return dadopt(array, dcreaten(dtext(input), input.length));
 }
 
 int dindexofa(dstringa array, dstring input) {
@@ -168,23 +180,22 @@ dstringa drange(dstringa array, int start, int end) {
 }
 
 dstringa dsplit(dstring input, char at) {
-    dstring new = dcreate(dtext(input));
     dstringa array = dcreatea();
     dstring string = dempty();
-    for(int i = 0; i < new.length; i++) {
-        char on = dtext(new)[i];
+    for(int i = 0; i < input.length; i++) {
+        char on = dtext(input)[i];
         if(on == at && string.length > 0) {
-            array = dpush(array, string);
+            array = dadopt(array, string);
             string = dempty();
         } else {
             string = dappendc(string, on);
         }
     }
 
-    if(string.length > 0) {
-        array = dpush(array, string);
-    }
-    dfree(string);
+    if(string.length > 0)
+        array = dadopt(array, string);
+    else
+        dfree(string);
     return array;
 }
 
@@ -200,11 +211,9 @@ int dfreea(dstringa array) {
 dstringa dpop(dstringa array) {
     if(array.length == 0)
         return array;
-    int new_length = array.length - 1;
-    dfree(array.values[new_length]);
-    dstring *shrunk = realloc(array.values, sizeof(dstring) * new_length);
-    dstringa shrunk_dstringa = {new_length, shrunk};
-    return shrunk_dstringa;
+    // The slot is kept for the next push
+    dfree(array.values[--array.length]);
+    return array;
 }
 
 dstringa dremove(dstringa array, dstring input) {
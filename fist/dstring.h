@@ -5,17 +5,20 @@
 // Increasing this will reduce malloc overhead, improve cache hits, but increase memory wastage.
 #define DSTRING_SMALL 32
 
+// Text that outgrows static_text moves to the heap, which at least doubles whenever it is too
+// small, so a string built one append at a time is only reallocated a logarithmic number of times
 typedef struct dstring
 {
     int length;
     char *text;
-    int alloc_len;
+    int alloc_len; // Bytes allocated for text, 0 while static_text holds it
     char static_text[DSTRING_SMALL];
 } dstring;
 
 typedef struct dstringa
 {
     int length;
+    int capacity; // Slots allocated for values, doubled when a push needs more
     dstring *values;
 } dstringa;
 
@@ -25,12 +28,14 @@ int dequals(dstring s1, dstring s2);
 int dequalsc(dstring s1, char *s2);               // compare dstring and c string
 dstring dappendc(dstring input, char character);  // Apppend single char to string
 dstring dappend(dstring input, char *characters); // Appends a string to the end of the dstring
+dstring dappendn(dstring input, const char *characters, int length); // Appends length chars
 dstring
 dtrim(dstring input); // Trims whitespace and new line characters from beginning and end of dstring
 dstring dreverse(dstring input);                        // Reverses a dstring
 dstring dreplace(dstring input, char there, char with); // Replaces char with another
 int dindexof(dstring input, char character);            // Returns the index of a character or -1
 dstring dcreate(char *initial);                         // Creates and returns a new dstring
+dstring dcreaten(const char *initial, int length);      // Creates a dstring of length chars
 dstring dempty();                                       // Creates an empty dstring
 dstring dsubstr(dstring input, unsigned int start,
                 unsigned int end); // Returns the string between to indices of the input dstring
@@ -42,7 +47,8 @@ dstring dappendd(dstring input, dstring word); // Append two dstrings together
 
 dstringa dsplit(dstring input, char at);         // Splits string at character
 dstringa dcreatea();                             // Create empty array of dstrings
-dstringa dpush(dstringa array, dstring input);   // Push dstring to list of dstrings
+dstringa dpush(dstringa array, dstring input);   // Push a copy of dstring to list of dstrings
+dstringa dadopt(dstringa array, dstring input);  // Push dstring itself, the list now frees it
 dstringa dremove(dstringa array, dstring input); // Remove item from dstring array
 dstringa dpop(dstringa array);                   // Pop from stack
 dstringa dsorta(dstringa array);                 // sort an array of dstrings
@@ -0,0 +1,175 @@
+#include "eventloop.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <unistd.h>
+
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#include "utils.h"
+
+struct event_loop
+{
+    int backend;
+    // select()
+    fd_set fds;
+    fd_set write_fds;
+    int fd_max;
+    int scan_from; // Where the last scan stopped, so no descriptor starves when max is small
+    fd_set ready;
+    fd_set write_ready;
+    int scanning; // The results of the last select() are not all returned yet
+    // epoll
+    int epoll_fd;
+};
+
+struct event_loop *event_loop_create(int backend) {
+    struct event_loop *loop = calloc(1, sizeof(struct event_loop));
+    loop->backend = backend;
+    loop->fd_max = -1;
+    loop->epoll_fd = -1;
+    FD_ZERO(&loop->fds);
+    FD_ZERO(&loop->write_fds);
+    FD_ZERO(&loop->ready);
+    FD_ZERO(&loop->write_ready);
+
+    switch(backend) {
+    case EVENT_BACKEND_SELECT:
+        return loop;
+#ifdef HAVE_EPOLL
+    case EVENT_BACKEND_EPOLL:
+        loop->epoll_fd = epoll_create1(0);
+        if(loop->epoll_fd != -1)
+            return loop;
+        perror("epoll_create1");
+        break;
+#endif
+    default:
+        fprintf(stderr, "event_loop_create: %s is not available\n", event_backend_name(backend));
+        break;
+    }
+    free(loop);
+    return NULL;
+}
+
+void event_loop_free(struct event_loop *loop) {
+    if(!loop)
+        return;
+    if(loop->epoll_fd != -1)
+        close(loop->epoll_fd);
+    free(loop);
+}
+
+int event_loop_add(struct event_loop *loop, int fd) {
+#ifdef HAVE_EPOLL
+    if(loop->backend == EVENT_BACKEND_EPOLL) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        // Asking for EPOLLOUT up front saves an epoll_ctl() call whenever output backs up
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.fd = fd;
+        if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("epoll_ctl");
+            return -1;
+        }
+        return 0;
+    }
+#endif
+    if(fd >= FD_SETSIZE) {
+        fprintf(stderr, "event_loop_add: fd %d is above FD_SETSIZE, use epoll\n", fd);
+        return -1;
+    }
+    FD_SET(fd, &loop->fds);
+    loop->fd_max = MAX(fd, loop->fd_max);
+    return 0;
+}
+
+void event_loop_del(struct event_loop *loop, int fd) {
+#ifdef HAVE_EPOLL
+    if(loop->backend == EVENT_BACKEND_EPOLL) {
+        // Closing the descriptor removes it as well, this is for descriptors that stay open
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        return;
+    }
+#endif
+    if(fd >= FD_SETSIZE)
+        return;
+    FD_CLR(fd, &loop->fds);
+    FD_CLR(fd, &loop->write_fds);
+    FD_CLR(fd, &loop->ready);
+    FD_CLR(fd, &loop->write_ready);
+    while(loop->fd_max >= 0 && !FD_ISSET(loop->fd_max, &loop->fds))
+        loop->fd_max--;
+}
+
+void event_loop_want_write(struct event_loop *loop, int fd, int enable) {
+    if(loop->backend != EVENT_BACKEND_SELECT || fd >= FD_SETSIZE)
+        return;
+    if(enable)
+        FD_SET(fd, &loop->write_fds);
+    else
+        FD_CLR(fd, &loop->write_fds);
+}
+
+static int select_wait(struct event_loop *loop, int *fds, int max) {
+    if(!loop->scanning) {
+        loop->ready = loop->fds;
+        loop->write_ready = loop->write_fds;
+        int rc = select(loop->fd_max + 1, &loop->ready, &loop->write_ready, NULL, NULL);
+        if(rc == -1) {
+            if(errno != EINTR)
+                perror("select");
+            return -1;
+        }
+        loop->scanning = 1;
+        loop->scan_from = 0;
+    }
+
+    int n = 0;
+    int fd;
+    for(fd = loop->scan_from; fd <= loop->fd_max && n < max; fd++) {
+        if(FD_ISSET(fd, &loop->ready) || FD_ISSET(fd, &loop->write_ready)) {
+            FD_CLR(fd, &loop->ready);
+            FD_CLR(fd, &loop->write_ready);
+            fds[n++] = fd;
+        }
+    }
+    loop->scan_from = fd;
+    if(fd > loop->fd_max)
+        loop->scanning = 0;
+    return n;
+}
+
+int event_loop_wait(struct event_loop *loop, int *fds, int max) {
+#ifdef HAVE_EPOLL
+    if(loop->backend == EVENT_BACKEND_EPOLL) {
+        struct epoll_event events[max];
+        int rc = epoll_wait(loop->epoll_fd, events, max, -1);
+        if(rc == -1) {
+            if(errno != EINTR)
+                perror("epoll_wait");
+            return -1;
+        }
+        for(int i = 0; i < rc; i++)
+            fds[i] = events[i].data.fd;
+        return rc;
+    }
+#endif
+    return select_wait(loop, fds, max);
+}
+
+const char *event_backend_name(int backend) {
+    switch(backend) {
+    case EVENT_BACKEND_EPOLL:
+        return "epoll";
+    case EVENT_BACKEND_SELECT:
+        return "select";
+    default:
+        return "unknown";
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef H_EVENTLOOP
+#define H_EVENTLOOP
+
+// epoll is used on Linux unless the build defines FIST_NO_EPOLL, select() is always available
+#if defined(__linux__) && !defined(FIST_NO_EPOLL)
+#define HAVE_EPOLL 1
+#endif
+
+// Which system call the server waits on, see EventLoop in fist_config(5)
+enum event_backend
+{
+    EVENT_BACKEND_EPOLL = 0,  // Edge-triggered, O(ready descriptors) per wake-up
+    EVENT_BACKEND_SELECT = 1, // Scans every descriptor, limited to FD_SETSIZE descriptors
+};
+
+struct event_loop;
+
+// Returns NULL if the backend is not compiled in or cannot be set up
+struct event_loop *event_loop_create(int backend);
+void event_loop_free(struct event_loop *loop);
+// Watches fd for incoming data. Returns -1 if the backend cannot watch it.
+int event_loop_add(struct event_loop *loop, int fd);
+void event_loop_del(struct event_loop *loop, int fd);
+// Also reports fd once it can be written to again, for output that did not fit into the socket
+void event_loop_want_write(struct event_loop *loop, int fd, int enable);
+// Blocks until some descriptors are ready and stores up to max of them in fds. Returns the number
+// stored, or -1 on error, e.g. when interrupted by a signal.
+//
+// With epoll a descriptor is only reported again once new data arrives or room to write becomes
+// available, so callers must read and write until EAGAIN. Doing the same with select() is harmless.
+// epoll may report descriptors as writable even when no write was asked for.
+int event_loop_wait(struct event_loop *loop, int *fds, int max);
+const char *event_backend_name(int backend);
+
+#endif
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "bench.h"
 #include "config.h"
 #include "hashmap.h"
 #include "indexer.h"
@@ -13,8 +14,10 @@
 int main(int argc, char *argv[]) {
     int c;
     const char *config_file = NULL;
-    while((c = getopt(argc, argv, "tVc:")) != -1) {
+    while((c = getopt(argc, argv, "tVb:c:")) != -1) {
         switch(c) {
+        case 'b':
+            return run_benchmarks(optarg);
         case 'c':
             config_file = optarg;
             break;
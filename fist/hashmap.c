@@ -4,125 +4,256 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define HMAP_SIZE 1000081
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
 
-unsigned int hash(char *val) {
-    unsigned long sum = 0;
-    for(int x = 0; x < strlen(val); x++) {
-        sum += (unsigned long)val[x];
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t hhash(const char *data, size_t length) {
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + length;
+    uint64_t h;
+
+    if(length >= 32) {
+        const unsigned char *limit = end - 32;
+        uint64_t v1 = PRIME64_1 + PRIME64_2;
+        uint64_t v2 = PRIME64_2;
+        uint64_t v3 = 0;
+        uint64_t v4 = -PRIME64_1;
+        do {
+            v1 = xxh64_round(v1, read64(p));
+            v2 = xxh64_round(v2, read64(p + 8));
+            v3 = xxh64_round(v3, read64(p + 16));
+            v4 = xxh64_round(v4, read64(p + 24));
+            p += 32;
+        } while(p <= limit);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    } else {
+        h = PRIME64_5;
     }
 
-    return (unsigned int)(sum % HMAP_SIZE);
+    h += (uint64_t)length;
+
+    while(p + 8 <= end) {
+        h ^= xxh64_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+    if(p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    while(p < end) {
+        h ^= (*p) * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
 }
 
-hashmap *hcreate() {
-    hashmap *hm = calloc(HMAP_SIZE, sizeof(hashmap));
-    return hm;
+uint64_t hkey_hash(const char *key, uint32_t length) {
+    uint64_t hash = hhash(key, length);
+    return hash ? hash : 1; // 0 is reserved for empty slots
 }
 
-hashmap *hdel(hashmap *hm, dstring key) {
-    unsigned int hashval = hash(dtext(key));
-    hashmap *hval = &hm[hashval];
-    int index = -1;
-    for(int i = 0; i < hval->length; i++) {
-        keyval on = hval->maps[i];
-        if(dequals(on.key, key)) {
-            index = i;
-            break;
+// Finds the slot holding key. Returns 1 if it was found, otherwise 0 with *slot set to the empty
+// slot where the key would be inserted.
+static int hlookup(hashmap *hm, const char *key, uint32_t length, uint64_t hash, uint32_t *slot) {
+    uint32_t mask = hm->capacity - 1;
+    uint32_t i = hash & mask;
+    // Most keys are found in their first slot, so its entry is fetched while the hashes are read
+    __builtin_prefetch(&hm->maps[i]);
+    while(hm->hashes[i]) {
+        if(hm->hashes[i] == hash && iequals(&hm->maps[i].key, key, length)) {
+            *slot = i;
+            return 1;
         }
+        i = (i + 1) & mask;
     }
+    *slot = i;
+    return 0;
+}
 
-    if(index > -1) {
-        keyval *new_map = malloc(sizeof(keyval) * (hval->length - 1));
-        int new_map_index = 0;
-        for(int i = 0; i < hval->length; i++) {
-            keyval on = hval->maps[i];
-            if(!dequals(on.key, key)) {
-                new_map[new_map_index] = on;
-                new_map_index++;
-            } else {
-                dfreea(on.values);
-                dfree(on.key);
-            }
-        }
-        free(hval->maps);
-        hval->maps = new_map;
-        hval->length--;
+static inline void hcount_write(hashmap *hm, uint64_t hash) {
+    if(hm->generations)
+        hm->generations[hash % HMAP_GENERATIONS]++;
+}
+
+static void halloc(hashmap *hm, uint32_t capacity) {
+    hm->capacity = capacity;
+    hm->hashes = calloc(capacity, sizeof(uint64_t));
+    hm->maps = malloc(sizeof(keyval) * capacity);
+}
+
+static void hresize(hashmap *hm, uint32_t capacity) {
+    uint64_t *old_hashes = hm->hashes;
+    keyval *old_maps = hm->maps;
+    uint32_t old_capacity = hm->capacity;
+
+    halloc(hm, capacity);
+    uint32_t mask = capacity - 1;
+    for(uint32_t i = 0; i < old_capacity; i++) {
+        uint64_t hash = old_hashes[i];
+        if(!hash)
+            continue;
+        // Keys are unique so there is no need to compare them, just find the first free slot
+        uint32_t j = hash & mask;
+        while(hm->hashes[j])
+            j = (j + 1) & mask;
+        hm->hashes[j] = hash;
+        hm->maps[j] = old_maps[i];
     }
 
+    free(old_hashes);
+    free(old_maps);
+}
+
+hashmap *hcreate() {
+    hashmap *hm = calloc(1, sizeof(hashmap));
+    halloc(hm, HMAP_INITIAL_CAPACITY);
     return hm;
 }
 
-void hfree(hashmap *hm) {
-    // TODO: Free every key
-    for(int i = 0; i < HMAP_SIZE; i++) {
-        hashmap *map_array = &hm[i];
-        for(int j = 0; j < map_array->length; j++) {
-            dfree(map_array->maps[j].key);
-            dfreea(map_array->maps[j].values);
+hashmap *hdeln(hashmap *hm, const char *key, uint32_t length) {
+    uint64_t hash = hkey_hash(key, length);
+    uint32_t slot;
+    hcount_write(hm, hash);
+    if(!hlookup(hm, key, length, hash, &slot))
+        return hm;
+
+    arena_release(&hm->keys, isize(&hm->maps[slot].key));
+    pfree(&hm->maps[slot].values);
+
+    // Backward shift deletion: pull following entries of the probe sequence into the hole so
+    // lookups never need tombstones.
+    uint32_t mask = hm->capacity - 1;
+    uint32_t hole = slot;
+    uint32_t next = (slot + 1) & mask;
+    while(hm->hashes[next]) {
+        uint32_t home = hm->hashes[next] & mask;
+        if(((next - home) & mask) >= ((next - hole) & mask)) {
+            hm->hashes[hole] = hm->hashes[next];
+            hm->maps[hole] = hm->maps[next];
+            hole = next;
         }
-        free(map_array->maps);
+        next = (next + 1) & mask;
     }
+    hm->hashes[hole] = 0;
+    hm->length--;
 
+    return hm;
+}
+
+hashmap *hdel(hashmap *hm, dstring key) {
+    return hdeln(hm, dtext(key), key.length);
+}
+
+void hfree(hashmap *hm) {
+    // Every key and postings list lives in the slab or the arena, so nothing is freed one by one
+    slab_destroy(&hm->slab);
+    arena_free(&hm->keys);
+    free(hm->hashes);
+    free(hm->maps);
     free(hm);
 }
 
-hashmap *hset(hashmap *hm, dstring key, dstring value) {
-    unsigned int hash_val = hash(dtext(key));
-    hashmap *map_array = &hm[hash_val];
-    int length = map_array->length;
-    if(length == 0) {
-        map_array->maps = malloc(sizeof(keyval));
-        map_array->maps[0].key = key;
-        map_array->maps[0].values = dpush(dcreatea(), value);
-        map_array->length++;
-        // hm[hash_val] = map_array;
-    } else {
-        int index = -1;
-        for(int i = 0; i < length; i++) {
-            keyval on = map_array->maps[i];
-            if(dequals(on.key, key)) {
-                index = i;
-                break;
-            }
-        }
-        int new_length = length + 1;
-        if(index == -1) { // Element not in array
-            map_array->maps = realloc(map_array->maps, sizeof(keyval) * new_length);
-            dstringa values = dcreatea();
-            values = dpush(values, value);
-            keyval new_keyval = {key, values};
-            map_array->maps[length] = new_keyval;
-            map_array->length++;
-            // hm[hash_val] = map_array;
-        } else { // Element in array
-            dstringa values = map_array->maps[index].values;
-            if(dindexofa(values, value) == -1) {
-                map_array->maps[index].values = dpush(values, value);
-            }
-        }
+// Stores key in an empty slot with an empty postings list allocated from the map
+static postings *hstore(hashmap *hm, uint32_t slot, uint64_t hash, const char *key,
+                        uint32_t length) {
+    hm->hashes[slot] = hash;
+    hm->maps[slot].key = icreate(&hm->keys, key, length);
+    hm->maps[slot].values = pcreate();
+    hm->maps[slot].values.slab = &hm->slab;
+    hm->length++;
+    return &hm->maps[slot].values;
+}
+
+postings *hputn(hashmap *hm, const char *key, uint32_t length) {
+    uint64_t hash = hkey_hash(key, length);
+    uint32_t slot;
+
+    hcount_write(hm, hash);
+    if(hlookup(hm, key, length, hash, &slot))
+        return &hm->maps[slot].values;
+
+    if((uint64_t)(hm->length + 1) * 100 > (uint64_t)hm->capacity * HMAP_MAX_LOAD) {
+        hresize(hm, hm->capacity * 2);
+        hlookup(hm, key, length, hash, &slot);
     }
+    return hstore(hm, slot, hash, key, length);
+}
 
+postings *hput(hashmap *hm, dstring key) {
+    return hputn(hm, dtext(key), key.length);
+}
+
+hashmap *hset(hashmap *hm, dstring key, uint32_t id) {
+    padd(hput(hm, key), id);
     return hm;
 }
 
-dstringa hget(hashmap *hm, dstring key) {
-    unsigned int hash_val = hash(dtext(key));
-    hashmap map_array = hm[hash_val];
-    int length = map_array.length;
-    if(length == 0) {
-        dstringa empty = dcreatea();
-        return empty;
-    }
+int hcontainsn(hashmap *hm, const char *key, uint32_t length) {
+    uint32_t slot;
+    return hlookup(hm, key, length, hkey_hash(key, length), &slot);
+}
 
-    dstringa values = dcreatea();
-    for(int i = 0; i < length; i++) {
-        keyval on = map_array.maps[i];
-        if(dequals(on.key, key)) {
-            values = on.values;
-            break;
-        }
+postings hgetn(hashmap *hm, const char *key, uint32_t length) {
+    uint32_t slot;
+    if(!hlookup(hm, key, length, hkey_hash(key, length), &slot)) {
+        return pcreate();
     }
 
-    return values;
+    return hm->maps[slot].values;
+}
+
+postings hget(hashmap *hm, dstring key) {
+    return hgetn(hm, dtext(key), key.length);
+}
+
+keyval *hnext(hashmap *hm, uint32_t *slot) {
+    while(*slot < hm->capacity) {
+        uint32_t i = (*slot)++;
+        if(hm->hashes[i])
+            return &hm->maps[i];
+    }
+    return NULL;
 }
@@ -1,26 +1,55 @@
 #ifndef H_HASHMAP
 #define H_HASHMAP
 
-#define HMAP_SIZE 1000081
+#include <stddef.h>
+#include <stdint.h>
 
 #include "dstring.h"
+#include "istring.h"
+#include "postings.h"
+
+// Number of slots a new hashmap starts with, must be a power of two. The table doubles whenever
+// it becomes more than HMAP_MAX_LOAD percent full.
+#define HMAP_INITIAL_CAPACITY 64
+#define HMAP_MAX_LOAD 75
+#define HMAP_GENERATIONS 4096 // Slots write generations are counted in, see hashmap.generations
 
 typedef struct keyval
 {
-    dstring key;
-    dstringa values;
+    istring key;
+    postings values;
 } keyval;
 
+// Open addressing table with linear probing. The full 64 bit hash of every key is kept in its own
+// array so probing only touches 8 bytes per slot and keys are only compared on a hash match. A
+// stored hash of 0 marks an empty slot.
 typedef struct hashmap
 {
-    int length;
+    uint32_t length;
+    uint32_t capacity;
+    uint64_t *hashes;
     keyval *maps;
+    // If set, every hputn() and hdeln() of a key adds 1 to the slot of its hkey_hash()
+    // modulo HMAP_GENERATIONS, so readers can tell the key may have changed since they last looked
+    uint64_t *generations;
+    // Blocks of the postings and the keys. hfree() releases them a page at a time instead of one
+    // allocation per key.
+    struct slab slab;
+    struct arena keys;
 } hashmap;
 
+uint64_t hhash(const char *data, size_t length); // xxHash64 of data with a seed of 0
+uint64_t hkey_hash(const char *key, uint32_t length); // hhash() of a key as stored, never 0
 hashmap *hcreate();
 void hfree(hashmap *hm);
-hashmap *hset(hashmap *hm, dstring key, dstring value);
-dstringa hget(hashmap *hm, dstring key);
+hashmap *hset(hashmap *hm, dstring key, uint32_t id);
+postings *hput(hashmap *hm, dstring key); // Postings of key, created empty if key is new
+postings *hputn(hashmap *hm, const char *key, uint32_t length);
+postings hget(hashmap *hm, dstring key);
+postings hgetn(hashmap *hm, const char *key, uint32_t length);
+int hcontainsn(hashmap *hm, const char *key, uint32_t length); // 1 if key is in the map
 hashmap *hdel(hashmap *hm, dstring key);
+hashmap *hdeln(hashmap *hm, const char *key, uint32_t length);
+keyval *hnext(hashmap *hm, uint32_t *slot); // Iterate over all keys, start with *slot = 0
 
 #endif
@@ -0,0 +1,61 @@
+#include "idset.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Grows the set to hold at least nwords words, the new ones are empty
+static void idset_grow(struct idset *set, uint32_t nwords) {
+    if(nwords <= set->nwords)
+        return;
+    uint32_t capacity = set->nwords ? set->nwords : 1;
+    while(capacity < nwords)
+        capacity *= 2;
+    set->bits = realloc(set->bits, sizeof(uint64_t) * capacity);
+    memset(set->bits + set->nwords, 0, sizeof(uint64_t) * (capacity - set->nwords));
+    set->nwords = capacity;
+}
+
+void idset_add(struct idset *set, uint32_t id) {
+    idset_grow(set, id / 64 + 1);
+    set->bits[id / 64] |= 1ULL << (id % 64);
+}
+
+int idset_has(const struct idset *set, uint32_t id) {
+    return id / 64 < set->nwords && (set->bits[id / 64] >> (id % 64) & 1);
+}
+
+int idset_empty(const struct idset *set) {
+    for(uint32_t word = 0; word < set->nwords; word++) {
+        if(set->bits[word])
+            return 0;
+    }
+    return 1;
+}
+
+int idset_next(const struct idset *set, uint32_t *id) {
+    uint32_t word = *id / 64;
+    if(word >= set->nwords)
+        return 0;
+    uint64_t bits = set->bits[word] & (~0ULL << (*id % 64));
+    while(!bits) {
+        if(++word == set->nwords)
+            return 0;
+        bits = set->bits[word];
+    }
+    *id = word * 64 + __builtin_ctzll(bits);
+    return 1;
+}
+
+void idset_move(struct idset *to, struct idset *from) {
+    idset_grow(to, from->nwords);
+    for(uint32_t word = 0; word < from->nwords; word++) {
+        to->bits[word] |= from->bits[word];
+    }
+    idset_free(from);
+}
+
+void idset_free(struct idset *set) {
+    free(set->bits);
+    set->bits = NULL;
+    set->nwords = 0;
+}
@@ -0,0 +1,21 @@
+#ifndef H_IDSET
+#define H_IDSET
+
+#include <stdint.h>
+
+// Set of small integers such as document ids, one bit each. The zeroed struct is the empty set.
+struct idset
+{
+    uint64_t *bits;
+    uint32_t nwords;
+};
+
+void idset_add(struct idset *set, uint32_t id);
+int idset_has(const struct idset *set, uint32_t id);
+int idset_empty(const struct idset *set);
+// Finds the smallest id >= *id in the set, returns 0 if there is none
+int idset_next(const struct idset *set, uint32_t *id);
+void idset_move(struct idset *to, struct idset *from); // Adds from to to and empties from
+void idset_free(struct idset *set);
+
+#endif
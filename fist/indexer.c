@@ -1,29 +1,76 @@
 #include "indexer.h"
-#include "dstring.h"
-#include "utils.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-dstringa indexer(dstring text, int max_phrase_length) {
-    dstringa words = dsplit(text, ' ');
-    dstringa index = dcreatea();
-
-    max_phrase_length = MIN(max_phrase_length, words.length);
+static inline int tspace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
 
-    for(int i = 0; i < words.length; i += max_phrase_length) {
-        for(int j = i; j < i + max_phrase_length; j++) {
-            for(int k = 0; k < MIN(words.length - j, max_phrase_length); k++) {
-                dstringa range = drange(words, j, j + k);
-                dstring joined = djoin(range, ' ');
-                index = dpush(index, joined);
-                dfreea(range);
-                dfree(joined);
-            }
+uint32_t tnormalize(char *text, uint32_t length) {
+    uint32_t out = 0;
+    int pending_space = 0;
+    for(uint32_t i = 0; i < length; i++) {
+        char on = text[i];
+        if(tspace(on)) {
+            pending_space = out > 0;
+            continue;
+        }
+        if(pending_space) {
+            text[out++] = ' ';
+            pending_space = 0;
         }
+        text[out++] = on;
+    }
+    return out;
+}
+
+int tnext(const char *text, uint32_t length, uint32_t *offset, struct span *word) {
+    uint32_t i = *offset;
+    while(i < length && tspace(text[i]))
+        i++;
+    if(i == length) {
+        *offset = i;
+        return 0;
     }
 
-    dfreea(words);
+    uint32_t start = i;
+    while(i < length && !tspace(text[i]))
+        i++;
+    word->text = text + start;
+    word->length = i - start;
+    *offset = i;
+    return 1;
+}
+
+void ngrams_init(struct ngrams *it, const char *text, uint32_t length, int max) {
+    it->text = text;
+    it->length = length;
+    it->start = 0;
+    it->end = 0;
+    it->words = 0;
+    it->max = max;
+}
 
-    return index;
+int ngrams_next(struct ngrams *it, struct span *phrase) {
+    while(it->start < it->length) {
+        if(it->words < it->max && (it->words == 0 || it->end < it->length)) {
+            // Extend the phrase by one word
+            uint32_t from = it->words ? it->end + 1 : it->start;
+            const char *space = memchr(it->text + from, ' ', it->length - from);
+            it->end = space ? (uint32_t)(space - it->text) : it->length;
+            it->words++;
+            phrase->text = it->text + it->start;
+            phrase->length = it->end - it->start;
+            return 1;
+        }
+
+        // Start over from the next word
+        const char *space = memchr(it->text + it->start, ' ', it->length - it->start);
+        if(!space)
+            break;
+        it->start = space - it->text + 1;
+        it->words = 0;
+    }
+    return 0;
 }
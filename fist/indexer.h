@@ -1,7 +1,33 @@
 #ifndef H_INDEXER
 #define H_INDEXER
-#include "dstring.h"
 
-dstringa indexer(dstring text, int max_phrase_length);
+#include <stdint.h>
+
+// A word or phrase of a text. It points into the text and is not NUL terminated.
+struct span
+{
+    const char *text;
+    uint32_t length;
+};
+
+// Iterates over every phrase of up to max words of a normalized text. Since words are separated
+// by exactly one space, each phrase is a contiguous part of the text and nothing is copied.
+struct ngrams
+{
+    const char *text;
+    uint32_t length;
+    uint32_t start; // Offset of the first word of the current phrases
+    uint32_t end;   // Offset just past the last phrase returned
+    int words;      // Words in the last phrase returned
+    int max;
+};
+
+// Collapses every run of whitespace to a single space and strips it from both ends, in place.
+// Returns the new length.
+uint32_t tnormalize(char *text, uint32_t length);
+// Finds the next word at or after *offset, skipping any whitespace. Returns 0 if there is none.
+int tnext(const char *text, uint32_t length, uint32_t *offset, struct span *word);
+void ngrams_init(struct ngrams *it, const char *text, uint32_t length, int max);
+int ngrams_next(struct ngrams *it, struct span *phrase); // Returns 0 once all phrases were read
 
 #endif
@@ -0,0 +1,40 @@
+#include "istring.h"
+
+#include <string.h>
+
+#define IPREFIX 4 // Bytes of a long text kept in the istring
+
+istring icreate(struct arena *arena, const char *text, uint32_t length) {
+    istring s;
+    s.length = length;
+    memset(s.data, 0, ISTRING_SMALL);
+    if(length <= ISTRING_SMALL) {
+        memcpy(s.data, text, length);
+        return s;
+    }
+    char *stored = arena_alloc(arena, length);
+    memcpy(stored, text, length);
+    memcpy(s.data, text, IPREFIX);
+    memcpy(s.data + IPREFIX, &stored, sizeof(stored));
+    return s;
+}
+
+const char *itext(const istring *s) {
+    if(s->length <= ISTRING_SMALL)
+        return s->data;
+    const char *stored;
+    memcpy(&stored, s->data + IPREFIX, sizeof(stored));
+    return stored;
+}
+
+uint32_t isize(const istring *s) {
+    return s->length > ISTRING_SMALL ? s->length : 0;
+}
+
+int iequals(const istring *s, const char *text, uint32_t length) {
+    if(s->length != length)
+        return 0;
+    if(length <= ISTRING_SMALL)
+        return !memcmp(s->data, text, length);
+    return !memcmp(s->data, text, IPREFIX) && !memcmp(itext(s), text, length);
+}
@@ -0,0 +1,26 @@
+#ifndef H_ISTRING
+#define H_ISTRING
+
+#include <stdint.h>
+
+#include "alloc.h"
+
+#define ISTRING_SMALL 12 // Longest text an istring holds itself, longer ones are in an arena
+
+// Immutable string for text the index keeps, such as its keys and document names. It takes 16
+// bytes where a dstring takes 48: short text is stored in it, longer text in an arena with its
+// first 4 bytes kept next to the pointer so most mismatches are found without following it.
+// Copies of an istring share the text of a long one. dstring is still the one to build or parse
+// text with.
+typedef struct istring
+{
+    uint32_t length;
+    char data[ISTRING_SMALL]; // The text, or its first 4 bytes followed by a pointer to it
+} istring;
+
+istring icreate(struct arena *arena, const char *text, uint32_t length);
+const char *itext(const istring *s);                               // Not '\0' terminated
+uint32_t isize(const istring *s);                                 // Bytes taken in its arena
+int iequals(const istring *s, const char *text, uint32_t length); // 1 if s holds text
+
+#endif
@@ -0,0 +1,76 @@
+#include "linebuf.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+void linebuf_free(struct linebuf *lb) {
+    free(lb->data);
+    memset(lb, 0, sizeof(struct linebuf));
+}
+
+void linebuf_clear(struct linebuf *lb) {
+    lb->start = lb->end = lb->scanned = 0;
+}
+
+char *linebuf_space(struct linebuf *lb, uint32_t min, uint32_t *available) {
+    if(lb->start == lb->end) {
+        lb->start = lb->end = lb->scanned = 0;
+    } else if(lb->capacity - lb->end < min && lb->start > 0) {
+        // Drop the lines already returned before growing
+        memmove(lb->data, lb->data + lb->start, lb->end - lb->start);
+        lb->end -= lb->start;
+        lb->scanned -= lb->start;
+        lb->start = 0;
+    }
+
+    if(lb->capacity - lb->end < min) {
+        lb->capacity = MAX(lb->capacity * 2, lb->end + min);
+        lb->data = realloc(lb->data, lb->capacity);
+    }
+    *available = lb->capacity - lb->end;
+    return lb->data + lb->end;
+}
+
+void linebuf_commit(struct linebuf *lb, uint32_t length) {
+    lb->end += length;
+}
+
+int linebuf_next(struct linebuf *lb, char **line, uint32_t *length) {
+    uint32_t from = MAX(lb->scanned, lb->start);
+    while(from < lb->end) {
+        char *newline = memchr(lb->data + from, '\n', lb->end - from);
+        if(!newline)
+            break;
+        uint32_t at = newline - lb->data;
+        if(at > lb->start && lb->data[at - 1] == '\r') {
+            *line = lb->data + lb->start;
+            *length = at - 1 - lb->start;
+            lb->start = lb->scanned = at + 1;
+            return 1;
+        }
+        // A bare \n is part of the line
+        from = at + 1;
+    }
+    lb->scanned = lb->end;
+    return 0;
+}
+
+uint32_t linebuf_pending(struct linebuf *lb) {
+    return lb->end - lb->start;
+}
+
+void linebuf_move(struct linebuf *dst, struct linebuf *src) {
+    uint32_t pending = linebuf_pending(src);
+    uint32_t available;
+    if(pending == 0)
+        return;
+    char *space = linebuf_space(dst, pending, &available);
+    memcpy(space, src->data + src->start, pending);
+    // The moved bytes were searched already
+    if(dst->scanned == dst->end)
+        dst->scanned += src->scanned - src->start;
+    dst->end += pending;
+    linebuf_clear(src);
+}
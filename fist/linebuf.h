@@ -0,0 +1,29 @@
+#ifndef H_LINEBUF
+#define H_LINEBUF
+
+#include <stdint.h>
+
+// Bytes received on a connection, framed into \r\n terminated lines. Lines are handed out in place
+// and stay valid until the next call that adds data.
+struct linebuf
+{
+    char *data;
+    uint32_t start;    // First byte not yet returned as part of a line
+    uint32_t end;      // Bytes received
+    uint32_t scanned;  // No line ends before this offset, so it is not searched again
+    uint32_t capacity;
+};
+
+void linebuf_free(struct linebuf *lb);  // Releases the memory, lb can be reused afterwards
+void linebuf_clear(struct linebuf *lb); // Drops all data but keeps the memory
+// Returns room for at least min more bytes at the end, growing the buffer if needed. *available
+// is set to the room there is.
+char *linebuf_space(struct linebuf *lb, uint32_t min, uint32_t *available);
+void linebuf_commit(struct linebuf *lb, uint32_t length); // length bytes were written to the space
+// Finds the next complete line and returns it without its \r\n. Returns 0 if there is none yet.
+int linebuf_next(struct linebuf *lb, char **line, uint32_t *length);
+uint32_t linebuf_pending(struct linebuf *lb); // Bytes of the unfinished line
+// Moves the unfinished line from src to the end of dst, src is left empty
+void linebuf_move(struct linebuf *dst, struct linebuf *src);
+
+#endif
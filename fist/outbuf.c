@@ -0,0 +1,129 @@
+#include "outbuf.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "utils.h"
+
+struct outshared *outshared_create(uint32_t length) {
+    struct outshared *shared = malloc(sizeof(struct outshared) + length);
+    shared->refs = 1;
+    shared->length = length;
+    return shared;
+}
+
+void outshared_release(struct outshared *shared) {
+    if(--shared->refs == 0)
+        free(shared);
+}
+
+static void outseg_free(struct outseg *seg) {
+    if(seg->shared)
+        outshared_release(seg->shared);
+    else
+        free(seg->data);
+}
+
+void outbuf_free(struct outbuf *ob) {
+    for(uint32_t i = ob->head; i < ob->head + ob->count; i++)
+        outseg_free(&ob->segs[i]);
+    free(ob->segs);
+    memset(ob, 0, sizeof(struct outbuf));
+}
+
+static struct outseg *outbuf_push(struct outbuf *ob) {
+    if(ob->head + ob->count == ob->capacity) {
+        if(ob->head > 0) {
+            memmove(ob->segs, ob->segs + ob->head, sizeof(struct outseg) * ob->count);
+            ob->head = 0;
+        } else {
+            ob->capacity = ob->capacity ? ob->capacity * 2 : 8;
+            ob->segs = realloc(ob->segs, sizeof(struct outseg) * ob->capacity);
+        }
+    }
+    struct outseg *seg = &ob->segs[ob->head + ob->count++];
+    memset(seg, 0, sizeof(struct outseg));
+    return seg;
+}
+
+void outbuf_add(struct outbuf *ob, const char *data, uint32_t length) {
+    struct outseg *last = ob->count ? &ob->segs[ob->head + ob->count - 1] : NULL;
+    if(!last || (uint64_t)last->length + length > last->capacity) {
+        last = outbuf_push(ob);
+        last->capacity = MAX(length, OUTBUF_CHUNK);
+        last->data = malloc(last->capacity);
+    }
+    memcpy(last->data + last->length, data, length);
+    last->length += length;
+    ob->pending += length;
+}
+
+void outbuf_add_dstring(struct outbuf *ob, dstring s) {
+    if(!s.alloc_len || (uint32_t)s.length < OUTBUF_CHUNK / 4) {
+        outbuf_add(ob, dtext(s), s.length);
+        dfree(s);
+        return;
+    }
+    struct outseg *seg = outbuf_push(ob);
+    seg->data = s.text;
+    seg->length = s.length;
+    ob->pending += s.length;
+}
+
+void outbuf_add_shared(struct outbuf *ob, struct outshared *shared) {
+    if(shared->length < OUTBUF_CHUNK / 4) {
+        outbuf_add(ob, shared->data, shared->length);
+        return;
+    }
+    struct outseg *seg = outbuf_push(ob);
+    shared->refs++;
+    seg->shared = shared;
+    seg->data = shared->data;
+    seg->length = shared->length;
+    ob->pending += shared->length;
+}
+
+int outbuf_flush(struct outbuf *ob, int fd) {
+    while(ob->count) {
+        struct iovec iov[OUTBUF_IOV_MAX];
+        int n = MIN(ob->count, OUTBUF_IOV_MAX);
+        for(int i = 0; i < n; i++) {
+            struct outseg *seg = &ob->segs[ob->head + i];
+            iov[i].iov_base = seg->data + seg->offset;
+            iov[i].iov_len = seg->length - seg->offset;
+        }
+
+        ssize_t written = writev(fd, iov, n);
+        if(written < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            perror("writev");
+            return -1;
+        }
+
+        ob->pending -= written;
+        while(written > 0) {
+            struct outseg *seg = &ob->segs[ob->head];
+            uint32_t left = seg->length - seg->offset;
+            if((size_t)written < left) {
+                seg->offset += written;
+                break;
+            }
+            written -= left;
+            outseg_free(seg);
+            ob->head++;
+            ob->count--;
+        }
+    }
+    ob->head = 0;
+    return 0;
+}
+
+uint64_t outbuf_pending(struct outbuf *ob) {
+    return ob->pending;
+}
@@ -0,0 +1,56 @@
+#ifndef H_OUTBUF
+#define H_OUTBUF
+
+#include <stdint.h>
+
+#include "dstring.h"
+
+#define OUTBUF_CHUNK 4096 // Small replies are copied together into chunks of this size
+#define OUTBUF_IOV_MAX 64 // Segments handed to one writev()
+
+// A reply that can be queued on several connections at once without copying it, see
+// outbuf_add_shared(). The count of references is not atomic, so it has to stay with the worker
+// whose connections it is queued on.
+struct outshared
+{
+    uint32_t refs;
+    uint32_t length;
+    char data[];
+};
+
+struct outseg
+{
+    char *data;
+    struct outshared *shared; // Holds data if set, released instead of freeing data
+    uint32_t length;   // Bytes in data
+    uint32_t capacity; // Room in data for more replies, 0 once nothing may be appended
+    uint32_t offset;   // Bytes already written
+};
+
+// Replies waiting to be written to a connection, as a queue of segments that are written out
+// together with writev().
+struct outbuf
+{
+    struct outseg *segs;
+    uint32_t head; // First segment not fully written
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t pending; // Bytes not yet written
+};
+
+// Room for a reply of length bytes, with a single reference the caller releases
+struct outshared *outshared_create(uint32_t length);
+void outshared_release(struct outshared *shared);
+
+void outbuf_free(struct outbuf *ob); // Releases all memory, ob can be reused afterwards
+void outbuf_add(struct outbuf *ob, const char *data, uint32_t length); // Copies data
+// Queues the text of s and frees s. Large strings are queued without copying them.
+void outbuf_add_dstring(struct outbuf *ob, dstring s);
+// Queues the text of shared, taking a reference to it unless it is small enough to copy
+void outbuf_add_shared(struct outbuf *ob, struct outshared *shared);
+// Writes as much as the socket takes without blocking. Returns -1 if the connection failed,
+// otherwise 0, with outbuf_pending() telling whether anything is left.
+int outbuf_flush(struct outbuf *ob, int fd);
+uint64_t outbuf_pending(struct outbuf *ob);
+
+#endif
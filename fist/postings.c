@@ -0,0 +1,724 @@
+#include "postings.h"
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "utils.h"
+
+// Largest number of bytes a varint encoded uint32_t takes
+#define VARINT_MAX 5
+// Arrays whose lengths differ by more than this are intersected by galloping through the longer
+// one instead of merging them
+#define PGALLOP_RATIO 32
+
+// An id of a decoded block, its payload still points into the encoded data
+struct pentry
+{
+    uint32_t id;
+    const unsigned char *payload;
+    uint32_t size;
+};
+
+static inline unsigned char *varint_put(unsigned char *out, uint32_t value) {
+    while(value >= 0x80) {
+        *out++ = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    *out++ = value;
+    return out;
+}
+
+static inline const unsigned char *varint_get(const unsigned char *in, uint32_t *value) {
+    uint32_t result = 0;
+    int shift = 0;
+    while(*in & 0x80) {
+        result |= (uint32_t)(*in++ & 0x7F) << shift;
+        shift += 7;
+    }
+    result |= (uint32_t)(*in++) << shift;
+    *value = result;
+    return in;
+}
+
+static inline const unsigned char *varint_skip(const unsigned char *in) {
+    while(*in++ & 0x80)
+        ;
+    return in;
+}
+
+static const unsigned char *pskip_payload(const postings *list, const unsigned char *pos) {
+    if(list->payload == POSTINGS_POSITIONS) {
+        uint32_t npos;
+        pos = varint_get(pos, &npos);
+        while(npos--)
+            pos = varint_skip(pos);
+    }
+    return pos;
+}
+
+static unsigned char *pencode_positions(unsigned char *out, const uint32_t *positions,
+                                        uint32_t npos) {
+    uint32_t previous = 0;
+    out = varint_put(out, npos);
+    for(uint32_t i = 0; i < npos; i++) {
+        out = varint_put(out, positions[i] - previous);
+        previous = positions[i];
+    }
+    return out;
+}
+
+static const unsigned char *pdecode_positions(const unsigned char *in, uint32_t *positions) {
+    uint32_t npos;
+    uint32_t previous = 0;
+    in = varint_get(in, &npos);
+    for(uint32_t i = 0; i < npos; i++) {
+        uint32_t delta;
+        in = varint_get(in, &delta);
+        previous += delta;
+        positions[i] = previous;
+    }
+    return in;
+}
+
+static void pblock_reserve(struct slab *slab, struct pblock *block, uint32_t extra) {
+    if(block->size + extra <= block->capacity)
+        return;
+    uint32_t capacity = block->capacity ? block->capacity : 8;
+    while(capacity < block->size + extra)
+        capacity *= 2;
+    block->data = slab_realloc(slab, block->data, block->capacity, capacity);
+    block->capacity = capacity;
+}
+
+// Appends an id greater than the last one, the caller writes its payload after
+static void pblock_append(struct slab *slab, struct pblock *block, uint32_t id,
+                          uint32_t payload_size) {
+    if(block->count) {
+        pblock_reserve(slab, block, VARINT_MAX + payload_size);
+        unsigned char *end = varint_put(block->data + block->size, id - block->last);
+        block->size = end - block->data;
+    } else {
+        // A block holding a single id without payload needs no data at all
+        if(payload_size)
+            pblock_reserve(slab, block, payload_size);
+        block->first = id;
+    }
+    block->last = id;
+    block->count++;
+}
+
+static void pblock_append_positions(struct slab *slab, struct pblock *block, uint32_t id,
+                                    const uint32_t *positions, uint32_t npos) {
+    pblock_append(slab, block, id, VARINT_MAX * (npos + 1));
+    unsigned char *end = pencode_positions(block->data + block->size, positions, npos);
+    block->size = end - block->data;
+}
+
+static uint32_t pblock_entries(const postings *list, const struct pblock *block,
+                               struct pentry *entries) {
+    const unsigned char *pos = block->data;
+    uint32_t id = block->first;
+    for(uint32_t i = 0; i < block->count; i++) {
+        if(i > 0) {
+            uint32_t delta;
+            pos = varint_get(pos, &delta);
+            id += delta;
+        }
+        entries[i].id = id;
+        entries[i].payload = pos;
+        pos = pskip_payload(list, pos);
+        entries[i].size = pos - entries[i].payload;
+    }
+    return block->count;
+}
+
+// Encodes entries into a new block. The payloads may point into the data of any block, so the
+// old data must only be freed once all blocks built from it are done.
+static struct pblock pblock_build(struct slab *slab, const struct pentry *entries,
+                                  uint32_t count) {
+    struct pblock block = {0, 0, 0, 0, 0, NULL};
+    for(uint32_t i = 0; i < count; i++) {
+        pblock_append(slab, &block, entries[i].id, entries[i].size);
+        if(entries[i].size) {
+            memcpy(block.data + block.size, entries[i].payload, entries[i].size);
+            block.size += entries[i].size;
+        }
+    }
+    return block;
+}
+
+// The data of the copy is its own, from may point into a segment
+static struct pblock pblock_copy(struct slab *slab, const struct pblock *from) {
+    struct pblock block = *from;
+    block.capacity = block.size;
+    block.data = slab_alloc(slab, block.size);
+    if(block.size)
+        memcpy(block.data, from->data, block.size);
+    return block;
+}
+
+// Makes room for a block at index and returns it, zeroed
+static struct pblock *pinsert_block(postings *list, uint32_t index) {
+    // Grow geometrically, the capacity is implied by the number of blocks
+    if(!(list->nblocks & (list->nblocks - 1))) {
+        uint32_t capacity = list->nblocks ? list->nblocks * 2 : 1;
+        list->blocks = slab_realloc(list->slab, list->blocks, sizeof(struct pblock) * list->nblocks,
+                                    sizeof(struct pblock) * capacity);
+    }
+    memmove(&list->blocks[index + 1], &list->blocks[index],
+            sizeof(struct pblock) * (list->nblocks - index));
+    list->nblocks++;
+    memset(&list->blocks[index], 0, sizeof(struct pblock));
+    return &list->blocks[index];
+}
+
+static inline const struct pblock_stored *pstored_blocks(const postings *list) {
+    return (const struct pblock_stored *)(const void *)list->blocks;
+}
+
+static inline uint32_t pblock_last(const postings *list, uint32_t index) {
+    return list->stored ? pstored_blocks(list)[index].last : list->blocks[index].last;
+}
+
+// Index of the first block at or after from whose last id is >= id, or nblocks if there is none
+static uint32_t pfind_block(const postings *list, uint32_t from, uint32_t id) {
+    uint32_t low = from;
+    uint32_t high = list->nblocks;
+    while(low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if(pblock_last(list, mid) < id)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+// Merges two sorted position lists into out, dropping duplicates. Returns the merged count.
+static uint32_t pmerge_positions(const uint32_t *a, uint32_t na, const uint32_t *b, uint32_t nb,
+                                 uint32_t *out) {
+    uint32_t i = 0, j = 0, n = 0;
+    while(i < na || j < nb) {
+        uint32_t next;
+        if(j == nb || (i < na && a[i] < b[j]))
+            next = a[i++];
+        else if(i == na || b[j] < a[i])
+            next = b[j++];
+        else {
+            next = a[i++];
+            j++;
+        }
+        out[n++] = next;
+    }
+    return n;
+}
+
+// Slow path of an add: the id is not greater than the last id of the list. Decodes the one block
+// that may hold id and rebuilds it, splitting it in two if it overflows.
+static int pupdate(postings *list, uint32_t id, const uint32_t *positions, uint32_t npos) {
+    uint32_t index = pfind_block(list, 0, id);
+    struct pblock *block = &list->blocks[index];
+    struct pentry entries[POSTINGS_BLOCK + 1];
+    uint32_t count = pblock_entries(list, block, entries);
+
+    uint32_t at = 0;
+    while(at < count && entries[at].id < id)
+        at++;
+    int exists = at < count && entries[at].id == id;
+    if(exists && list->payload != POSTINGS_POSITIONS)
+        return 0;
+
+    unsigned char *payload = NULL;
+    if(list->payload == POSTINGS_POSITIONS) {
+        uint32_t old_npos = 0;
+        uint32_t *old_positions = NULL;
+        if(exists) {
+            varint_get(entries[at].payload, &old_npos);
+            old_positions = malloc(sizeof(uint32_t) * old_npos);
+            pdecode_positions(entries[at].payload, old_positions);
+        }
+        uint32_t *merged = malloc(sizeof(uint32_t) * (old_npos + npos));
+        uint32_t merged_npos = pmerge_positions(old_positions, old_npos, positions, npos, merged);
+        payload = malloc(VARINT_MAX * (merged_npos + 1));
+        unsigned char *end = pencode_positions(payload, merged, merged_npos);
+        free(old_positions);
+        free(merged);
+
+        if(!exists) {
+            memmove(&entries[at + 1], &entries[at], sizeof(struct pentry) * (count - at));
+            entries[at].id = id;
+            count++;
+        }
+        entries[at].payload = payload;
+        entries[at].size = end - payload;
+    } else {
+        memmove(&entries[at + 1], &entries[at], sizeof(struct pentry) * (count - at));
+        entries[at].id = id;
+        entries[at].payload = NULL;
+        entries[at].size = 0;
+        count++;
+    }
+
+    struct pblock old = *block;
+    if(count <= POSTINGS_BLOCK) {
+        *block = pblock_build(list->slab, entries, count);
+    } else {
+        uint32_t half = count / 2;
+        struct pblock low = pblock_build(list->slab, entries, half);
+        struct pblock high = pblock_build(list->slab, &entries[half], count - half);
+        list->blocks[index] = low;
+        *pinsert_block(list, index + 1) = high;
+    }
+    slab_free(list->slab, old.data, old.capacity);
+    free(payload);
+
+    if(!exists)
+        list->length++;
+    return !exists;
+}
+
+// The block a new id greater than every id in the list goes to
+static struct pblock *ptail(postings *list) {
+    if(list->nblocks && list->blocks[list->nblocks - 1].count < POSTINGS_BLOCK)
+        return &list->blocks[list->nblocks - 1];
+    return pinsert_block(list, list->nblocks);
+}
+
+postings pcreate() {
+    postings list = {0, 0, 0, POSTINGS_IDS, NULL, NULL};
+    return list;
+}
+
+postings pstored(const struct pblock_stored *blocks, uint32_t nblocks, uint32_t length,
+                 uint32_t payload) {
+    postings list = {length, nblocks, 1, payload, (struct pblock *)(void *)blocks, NULL};
+    return list;
+}
+
+struct pblock pblock_get(const postings *list, uint32_t index) {
+    if(!list->stored)
+        return list->blocks[index];
+    const struct pblock_stored *stored = pstored_blocks(list);
+    uint32_t start = index ? stored[index - 1].end : 0;
+    const unsigned char *data = (const unsigned char *)(stored + list->nblocks) + start;
+    struct pblock block = {stored[index].first, stored[index].last, stored[index].count,
+                           stored[index].end - start, 0, (unsigned char *)data};
+    return block;
+}
+
+// Bytes of the blocks array of a list with nblocks blocks
+static uint32_t pblocks_size(uint32_t nblocks) {
+    uint32_t capacity = 1;
+    while(capacity < nblocks)
+        capacity *= 2;
+    return nblocks ? sizeof(struct pblock) * capacity : 0;
+}
+
+void pfree(postings *list) {
+    struct slab *slab = list->slab;
+    for(uint32_t i = 0; i < list->nblocks; i++) {
+        slab_free(slab, list->blocks[i].data, list->blocks[i].capacity);
+    }
+    slab_free(slab, list->blocks, pblocks_size(list->nblocks));
+    *list = pcreate();
+    list->slab = slab;
+}
+
+int padd(postings *list, uint32_t id) {
+    if(list->nblocks && id <= list->blocks[list->nblocks - 1].last)
+        return pupdate(list, id, NULL, 0);
+
+    pblock_append(list->slab, ptail(list), id, 0);
+    list->length++;
+    return 1;
+}
+
+int padd_positions(postings *list, uint32_t id, const uint32_t *positions, uint32_t npos) {
+    if(!list->length)
+        list->payload = POSTINGS_POSITIONS;
+    if(list->nblocks && id <= list->blocks[list->nblocks - 1].last)
+        return pupdate(list, id, positions, npos);
+
+    pblock_append_positions(list->slab, ptail(list), id, positions, npos);
+    list->length++;
+    return 1;
+}
+
+void pmerge(postings *list, const postings *from) {
+    if(from->length == 0)
+        return;
+
+    // Into an empty list the blocks are copied as they are
+    if(list->length == 0) {
+        pfree(list);
+        list->length = from->length;
+        list->payload = from->payload;
+        for(uint32_t i = 0; i < from->nblocks; i++) {
+            struct pblock block = pblock_get(from, i);
+            *pinsert_block(list, i) = pblock_copy(list->slab, &block);
+        }
+        return;
+    }
+
+    struct pcursor cursor;
+    uint32_t id;
+    uint32_t *positions = NULL;
+    uint32_t capacity = 0;
+    pcursor_init(&cursor, from);
+    while(pcursor_next(&cursor, &id)) {
+        if(from->payload != POSTINGS_POSITIONS) {
+            padd(list, id);
+            continue;
+        }
+        uint32_t npos = pcursor_npos(&cursor);
+        if(npos > capacity) {
+            capacity = npos;
+            positions = realloc(positions, sizeof(uint32_t) * npos);
+        }
+        pcursor_positions(&cursor, positions);
+        padd_positions(list, id, positions, npos);
+    }
+    free(positions);
+}
+
+int premove(postings *list, uint32_t id) {
+    uint32_t index = pfind_block(list, 0, id);
+    if(index == list->nblocks || list->blocks[index].first > id)
+        return 0;
+    struct pblock *block = &list->blocks[index];
+    struct pentry entries[POSTINGS_BLOCK];
+    uint32_t count = pblock_entries(list, block, entries);
+    uint32_t at = 0;
+    while(at < count && entries[at].id < id)
+        at++;
+    if(at == count || entries[at].id != id)
+        return 0;
+
+    memmove(&entries[at], &entries[at + 1], sizeof(struct pentry) * (count - at - 1));
+    struct pblock old = *block;
+    if(count > 1) {
+        *block = pblock_build(list->slab, entries, count - 1);
+    } else {
+        memmove(block, block + 1, sizeof(struct pblock) * (list->nblocks - index - 1));
+        list->nblocks--;
+        // Shrink along with the blocks so the array keeps the size pblocks_size() expects
+        if(!(list->nblocks & (list->nblocks - 1)))
+            list->blocks = slab_realloc(list->slab, list->blocks,
+                                        pblocks_size(list->nblocks + 1),
+                                        pblocks_size(list->nblocks));
+    }
+    slab_free(list->slab, old.data, old.capacity);
+    list->length--;
+    return 1;
+}
+
+// Index of the first of the n sorted ids that is >= id
+static uint32_t plower_bound(const uint32_t *ids, uint32_t n, uint32_t id) {
+    uint32_t low = 0;
+    uint32_t high = n;
+    while(low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if(ids[mid] < id)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+// Returns 1 if one of the n sorted ids falls between the first and last id of block
+static int poverlaps(const struct pblock *block, const uint32_t *ids, uint32_t n) {
+    uint32_t at = plower_bound(ids, n, block->first);
+    return at < n && ids[at] <= block->last;
+}
+
+// Returns 1 if one of the n sorted ids is in block
+static int pholds_any(const postings *list, const struct pblock *block, const uint32_t *ids,
+                      uint32_t n) {
+    if(!poverlaps(block, ids, n))
+        return 0;
+    struct pentry entries[POSTINGS_BLOCK];
+    uint32_t count = pblock_entries(list, block, entries);
+    for(uint32_t i = 0; i < count; i++) {
+        uint32_t at = plower_bound(ids, n, entries[i].id);
+        if(at < n && ids[at] == entries[i].id)
+            return 1;
+    }
+    return 0;
+}
+
+int pwithout(postings *out, const postings *list, const uint32_t *drop, uint32_t ndrop) {
+    uint32_t i = 0;
+    struct pblock block;
+    for(; i < list->nblocks; i++) {
+        block = pblock_get(list, i);
+        if(pholds_any(list, &block, drop, ndrop))
+            break;
+    }
+    if(i == list->nblocks)
+        return 0;
+
+    // Blocks none of the ids fall into are copied without decoding them
+    *out = pcreate();
+    out->payload = list->payload;
+    for(i = 0; i < list->nblocks; i++) {
+        block = pblock_get(list, i);
+        if(!poverlaps(&block, drop, ndrop)) {
+            *pinsert_block(out, out->nblocks) = pblock_copy(NULL, &block);
+            out->length += block.count;
+            continue;
+        }
+        struct pentry entries[POSTINGS_BLOCK];
+        uint32_t count = pblock_entries(list, &block, entries);
+        uint32_t kept = 0;
+        for(uint32_t j = 0; j < count; j++) {
+            uint32_t at = plower_bound(drop, ndrop, entries[j].id);
+            if(at == ndrop || drop[at] != entries[j].id)
+                entries[kept++] = entries[j];
+        }
+        if(kept) {
+            *pinsert_block(out, out->nblocks) = pblock_build(NULL, entries, kept);
+            out->length += kept;
+        }
+    }
+    return 1;
+}
+
+int pcontains(const postings *list, uint32_t id) {
+    struct pcursor cursor;
+    uint32_t found;
+    pcursor_init(&cursor, list);
+    return pcursor_seek(&cursor, id, &found) && found == id;
+}
+
+uint32_t pdecode(const postings *list, uint32_t *ids) {
+    struct pcursor cursor;
+    uint32_t count = 0;
+    pcursor_init(&cursor, list);
+    while(pcursor_next(&cursor, &ids[count]))
+        count++;
+    return count;
+}
+
+void pcursor_init(struct pcursor *cursor, const postings *list) {
+    cursor->list = list;
+    cursor->block = 0;
+    cursor->index = 0;
+    cursor->count = 0;
+    cursor->id = 0;
+    cursor->pos = NULL;
+    cursor->payload = NULL;
+}
+
+int pcursor_next(struct pcursor *cursor, uint32_t *id) {
+    while(cursor->block < cursor->list->nblocks) {
+        if(cursor->index == 0) {
+            struct pblock block = pblock_get(cursor->list, cursor->block);
+            cursor->id = block.first;
+            cursor->pos = block.data;
+            cursor->count = block.count;
+        } else if(cursor->index < cursor->count) {
+            uint32_t delta;
+            cursor->pos = varint_get(cursor->pos, &delta);
+            cursor->id += delta;
+        } else {
+            cursor->block++;
+            cursor->index = 0;
+            continue;
+        }
+        cursor->index++;
+        cursor->payload = cursor->pos;
+        cursor->pos = pskip_payload(cursor->list, cursor->pos);
+        *id = cursor->id;
+        return 1;
+    }
+    return 0;
+}
+
+// Like pfind_block(), but looks at the blocks 1, 2, 4... after from first and only searches the
+// last step, so finding a block close by is cheaper than searching the rest of the list
+static uint32_t pgallop_block(const postings *list, uint32_t from, uint32_t id) {
+    uint32_t nblocks = list->nblocks;
+    uint32_t low = from;
+    uint32_t high = from;
+    uint32_t step = 1;
+    while(high < nblocks && pblock_last(list, high) < id) {
+        low = high + 1;
+        high += step;
+        step *= 2;
+    }
+    high = MIN(high, nblocks);
+    while(low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if(pblock_last(list, mid) < id)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+int pcursor_seek(struct pcursor *cursor, uint32_t target, uint32_t *id) {
+    if(cursor->index > 0 && cursor->id >= target) {
+        *id = cursor->id;
+        return 1;
+    }
+
+    // Skip whole blocks without decoding them, the first and last id of a block are its skip
+    // pointers
+    const postings *list = cursor->list;
+    if(cursor->block < list->nblocks && pblock_last(list, cursor->block) < target) {
+        cursor->block = pgallop_block(list, cursor->block + 1, target);
+        cursor->index = 0;
+    }
+
+    while(pcursor_next(cursor, id)) {
+        if(*id >= target)
+            return 1;
+    }
+    return 0;
+}
+
+uint32_t pcursor_npos(const struct pcursor *cursor) {
+    uint32_t npos = 0;
+    if(cursor->list->payload == POSTINGS_POSITIONS)
+        varint_get(cursor->payload, &npos);
+    return npos;
+}
+
+void pcursor_positions(const struct pcursor *cursor, uint32_t *positions) {
+    if(cursor->list->payload == POSTINGS_POSITIONS)
+        pdecode_positions(cursor->payload, positions);
+}
+
+uint32_t pfilter(const postings *list, uint32_t *ids, uint32_t count, int keep) {
+    struct pcursor cursor;
+    uint32_t kept = 0;
+    uint32_t found = 0;
+    int more = 1;
+    pcursor_init(&cursor, list);
+    for(uint32_t i = 0; i < count; i++) {
+        if(more && (i == 0 || found < ids[i]))
+            more = pcursor_seek(&cursor, ids[i], &found);
+        if((more && found == ids[i]) == keep)
+            ids[kept++] = ids[i];
+    }
+    return kept;
+}
+
+// Index of the first of the n sorted ids from from on that is >= id. Looks 1, 2, 4... ids ahead
+// and searches only the last step, so walking the whole array costs O(log) per id found in it.
+static uint32_t pgallop(const uint32_t *ids, uint32_t from, uint32_t n, uint32_t id) {
+    uint32_t low = from;
+    uint32_t high = from;
+    uint32_t step = 1;
+    while(high < n && ids[high] < id) {
+        low = high + 1;
+        high += step;
+        step *= 2;
+    }
+    high = MIN(high, n);
+    return low + plower_bound(ids + low, high - low, id);
+}
+
+// Looks every id of the short array up in the long one
+static uint32_t pintersect_gallop(uint32_t *out, const uint32_t *small, uint32_t nsmall,
+                                  const uint32_t *large, uint32_t nlarge) {
+    uint32_t count = 0;
+    uint32_t j = 0;
+    for(uint32_t i = 0; i < nsmall && j < nlarge; i++) {
+        j = pgallop(large, j, nlarge, small[i]);
+        if(j < nlarge && large[j] == small[i])
+            out[count++] = small[i];
+    }
+    return count;
+}
+
+static uint32_t pintersect_merge(uint32_t *out, const uint32_t *a, uint32_t na, const uint32_t *b,
+                                 uint32_t nb) {
+    uint32_t i = 0, j = 0, count = 0;
+#ifdef __SSE2__
+    // Compares 4 ids of a with 4 of b at once, each of a against every rotation of b's, then
+    // moves on in the array whose 4th id is lower. Every id of a is stored and only the hits are
+    // kept, nothing in the loop depends on a hard to predict branch.
+    while(i + 4 <= na && j + 4 <= nb) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + j));
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi32(va, vb),
+                         _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)))),
+            _mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))),
+                         _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)))));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(hits));
+        for(int k = 0; mask; k++, mask >>= 1) {
+            if(mask & 1)
+                out[count++] = a[i + k];
+        }
+        uint32_t a3 = a[i + 3];
+        uint32_t b3 = b[j + 3];
+        if(a3 <= b3)
+            i += 4;
+        if(b3 <= a3)
+            j += 4;
+    }
+#endif
+    while(i < na && j < nb) {
+        if(a[i] < b[j]) {
+            i++;
+        } else if(a[i] > b[j]) {
+            j++;
+        } else {
+            out[count++] = a[i];
+            i++;
+            j++;
+        }
+    }
+    return count;
+}
+
+uint32_t pintersect(uint32_t *out, const uint32_t *a, uint32_t na, const uint32_t *b, uint32_t nb) {
+    if(na == 0 || nb == 0)
+        return 0;
+    if(nb / PGALLOP_RATIO > na)
+        return pintersect_gallop(out, a, na, b, nb);
+    if(na / PGALLOP_RATIO > nb)
+        return pintersect_gallop(out, b, nb, a, na);
+    return pintersect_merge(out, a, na, b, nb);
+}
+
+uint32_t punion(uint32_t *out, const uint32_t *a, uint32_t na, const uint32_t *b, uint32_t nb) {
+    uint32_t i = 0, j = 0, count = 0;
+    while(i < na && j < nb) {
+        if(a[i] < b[j]) {
+            out[count++] = a[i++];
+        } else if(a[i] > b[j]) {
+            out[count++] = b[j++];
+        } else {
+            out[count++] = a[i++];
+            j++;
+        }
+    }
+    memcpy(out + count, a + i, sizeof(uint32_t) * (na - i));
+    count += na - i;
+    memcpy(out + count, b + j, sizeof(uint32_t) * (nb - j));
+    return count + nb - j;
+}
+
+uint32_t psubtract(uint32_t *out, const uint32_t *a, uint32_t na, const uint32_t *b, uint32_t nb) {
+    uint32_t count = 0;
+    uint32_t j = 0;
+    int gallop = nb / PGALLOP_RATIO > na;
+    for(uint32_t i = 0; i < na; i++) {
+        if(gallop)
+            j = pgallop(b, j, nb, a[i]);
+        else
+            while(j < nb && b[j] < a[i])
+                j++;
+        if(j == nb || b[j] != a[i])
+            out[count++] = a[i];
+    }
+    return count;
+}
@@ -0,0 +1,107 @@
+#ifndef H_POSTINGS
+#define H_POSTINGS
+
+#include <stdint.h>
+
+#include "alloc.h"
+
+// Maximum number of ids in a block. Ids are only decoded one block at a time, so this bounds the
+// cost of a lookup or an out of order insert.
+#define POSTINGS_BLOCK 128
+
+// What is stored next to every id
+enum postings_payload
+{
+    POSTINGS_IDS = 0,       // Nothing, the list is a plain set of ids
+    POSTINGS_POSITIONS = 1, // The word positions of the key in the document
+};
+
+// A run of sorted ids. The first id is kept as is, every following id is stored as a varint of
+// its difference to the previous one. Each id is followed by its payload, positions are stored as
+// a varint count followed by varints of the difference to the previous position.
+struct pblock
+{
+    uint32_t first;
+    uint32_t last;
+    uint32_t count;
+    uint32_t size; // Bytes used in data
+    uint32_t capacity;
+    unsigned char *data;
+};
+
+// A block as a segment stores it, see pstored(). The data of the blocks follows them in order, the
+// data of a block starts where the one before it ends.
+struct pblock_stored
+{
+    uint32_t first;
+    uint32_t last;
+    uint32_t count;
+    uint32_t end; // Offset just past the data of the block
+};
+
+// Sorted, duplicate free list of document ids made of compressed blocks. New documents get the
+// highest id so they are appended to the last block without decoding anything. Blocks are full
+// once they hold POSTINGS_BLOCK ids and are never modified again unless an older id is inserted.
+// The blocks array holds nblocks rounded up to a power of two.
+typedef struct postings
+{
+    uint32_t length; // Total number of ids
+    unsigned int nblocks : 29;
+    unsigned int stored : 1;  // blocks points to struct pblock_stored, see pstored()
+    unsigned int payload : 2; // One of postings_payload, set by the first add
+    struct pblock *blocks;
+    struct slab *slab; // Where blocks and their data are allocated, NULL for malloc()
+} postings;
+
+// Iterates over the ids of a postings list in ascending order
+struct pcursor
+{
+    const postings *list;
+    uint32_t block;
+    uint32_t index; // Index of the next id in the current block
+    uint32_t count; // Ids in the current block
+    uint32_t id;    // Last id returned
+    const unsigned char *pos;
+    const unsigned char *payload; // Payload of the last id returned
+};
+
+postings pcreate();
+// A read only list over nblocks stored blocks and the data after them, such as the postings of a
+// key in a mapped segment. Nothing is copied, the list owns nothing and is never freed.
+postings pstored(const struct pblock_stored *blocks, uint32_t nblocks, uint32_t length,
+                 uint32_t payload);
+struct pblock pblock_get(const postings *list, uint32_t index); // Block of a list, stored or not
+void pfree(postings *list); // Frees the blocks, the list stays with its slab
+int padd(postings *list, uint32_t id); // Returns 1 if id was not in the list yet
+// Adds id with the sorted positions of the key in it, merging them with any positions already
+// stored for id. Returns 1 if id was not in the list yet.
+int padd_positions(postings *list, uint32_t id, const uint32_t *positions, uint32_t npos);
+// Adds every id of from to list, merging the positions of ids that are in both
+void pmerge(postings *list, const postings *from);
+int premove(postings *list, uint32_t id); // Returns 1 if id was in the list
+// Copies list to out without the ndrop sorted ids in drop. Returns 0 without touching out if
+// the list holds none of them.
+int pwithout(postings *out, const postings *list, const uint32_t *drop, uint32_t ndrop);
+int pcontains(const postings *list, uint32_t id);      // Returns 1 if id is in the list
+uint32_t pdecode(const postings *list, uint32_t *ids); // Writes all ids to ids, returns count
+// Keeps the count sorted ids that are in the list, or with keep = 0 the ones that are not, and
+// returns how many were kept. The list is only decoded in the blocks the ids fall into, so this
+// is the way to intersect with a list much longer than ids.
+uint32_t pfilter(const postings *list, uint32_t *ids, uint32_t count, int keep);
+
+// Set operations on sorted, duplicate free id arrays. They write to out and return its length.
+// out needs room for the result, it may be a for psubtract() but must not overlap the arrays
+// otherwise.
+uint32_t pintersect(uint32_t *out, const uint32_t *a, uint32_t na, const uint32_t *b, uint32_t nb);
+uint32_t punion(uint32_t *out, const uint32_t *a, uint32_t na, const uint32_t *b, uint32_t nb);
+uint32_t psubtract(uint32_t *out, const uint32_t *a, uint32_t na, const uint32_t *b, uint32_t nb);
+
+void pcursor_init(struct pcursor *cursor, const postings *list);
+int pcursor_next(struct pcursor *cursor, uint32_t *id); // Returns 0 once all ids were read
+// Moves to the first id >= target, which may be the current one. Returns 0 if there is none.
+int pcursor_seek(struct pcursor *cursor, uint32_t target, uint32_t *id);
+uint32_t pcursor_npos(const struct pcursor *cursor); // Number of positions of the current id
+// Writes the positions of the current id to positions, which must hold pcursor_npos() values
+void pcursor_positions(const struct pcursor *cursor, uint32_t *positions);
+
+#endif
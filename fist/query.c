@@ -0,0 +1,363 @@
+#include "query.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "database.h"
+#include "docdict.h"
+#include "indexer.h"
+#include "postings.h"
+#include "utils.h"
+
+enum query_token
+{
+    TOKEN_END,
+    TOKEN_WORD,
+    TOKEN_PHRASE,
+    TOKEN_OPEN,
+    TOKEN_CLOSE,
+    TOKEN_AND,
+    TOKEN_OR,
+    TOKEN_NOT,
+    TOKEN_INVALID,
+};
+
+struct parser
+{
+    struct query *query;
+    const char *text;
+    uint32_t length;
+    uint32_t offset;  // Just past the current token
+    int token;        // The current token, one of query_token
+    struct span span; // Of the current word or phrase
+    int depth;
+};
+
+// An operand of an AND, looked up or evaluated before the AND decides the order to take them in
+struct operand
+{
+    struct lookup lookup; // Postings of a single key, which are searched in place
+    int is_lookup;
+    uint32_t *ids; // What the operand evaluated to otherwise
+    uint32_t count;
+    int negated;
+};
+
+static int query_delimiter(char c) {
+    return c == ' ' || c == '(' || c == ')' || c == '"';
+}
+
+static int span_is(const struct span *span, const char *word) {
+    return span->length == strlen(word) && !memcmp(span->text, word, span->length);
+}
+
+static void parser_advance(struct parser *p) {
+    while(p->offset < p->length && p->text[p->offset] == ' ')
+        p->offset++;
+    if(p->offset == p->length) {
+        p->token = TOKEN_END;
+        return;
+    }
+
+    char c = p->text[p->offset];
+    if(c == '(' || c == ')') {
+        p->token = c == '(' ? TOKEN_OPEN : TOKEN_CLOSE;
+        p->offset++;
+        return;
+    }
+    if(c == '"') {
+        uint32_t start = p->offset + 1;
+        const char *quote = memchr(p->text + start, '"', p->length - start);
+        if(!quote) {
+            p->token = TOKEN_INVALID;
+            return;
+        }
+        uint32_t end = quote - p->text;
+        p->offset = end + 1;
+        // Spaces inside the quotes are already collapsed, only the ends need trimming
+        if(start < end && p->text[start] == ' ')
+            start++;
+        if(start < end && p->text[end - 1] == ' ')
+            end--;
+        p->span.text = p->text + start;
+        p->span.length = end - start;
+        p->token = end > start ? TOKEN_PHRASE : TOKEN_INVALID;
+        return;
+    }
+
+    uint32_t start = p->offset;
+    while(p->offset < p->length && !query_delimiter(p->text[p->offset]))
+        p->offset++;
+    p->span.text = p->text + start;
+    p->span.length = p->offset - start;
+    if(span_is(&p->span, "AND"))
+        p->token = TOKEN_AND;
+    else if(span_is(&p->span, "OR"))
+        p->token = TOKEN_OR;
+    else if(span_is(&p->span, "NOT"))
+        p->token = TOKEN_NOT;
+    else
+        p->token = TOKEN_WORD;
+}
+
+static int query_node(struct query *query, int op) {
+    if(query->nnodes == query->capacity) {
+        query->capacity = query->capacity ? query->capacity * 2 : 8;
+        query->nodes = realloc(query->nodes, sizeof(struct query_node) * query->capacity);
+    }
+    struct query_node *node = &query->nodes[query->nnodes];
+    memset(node, 0, sizeof(struct query_node));
+    node->op = op;
+    node->child = node->next = -1;
+    return query->nnodes++;
+}
+
+// Adds child as the last operand of parent. The operands of an AND in an AND, or an OR in an OR,
+// are added instead, so the whole run can be ordered together.
+static void query_append(struct query *query, int parent, int child) {
+    struct query_node *nodes = query->nodes;
+    if(nodes[child].op == nodes[parent].op)
+        child = nodes[child].child;
+    if(nodes[parent].child == -1) {
+        nodes[parent].child = child;
+        return;
+    }
+    int last = nodes[parent].child;
+    while(nodes[last].next != -1)
+        last = nodes[last].next;
+    nodes[last].next = child;
+}
+
+static int parse_or(struct parser *p);
+
+static int parse_unary(struct parser *p) {
+    if(++p->depth > QUERY_DEPTH_MAX)
+        return -1;
+    int node = -1;
+    if(p->token == TOKEN_NOT) {
+        parser_advance(p);
+        int operand = parse_unary(p);
+        if(operand != -1) {
+            node = query_node(p->query, QUERY_NOT);
+            p->query->nodes[node].child = operand;
+        }
+    } else if(p->token == TOKEN_WORD || p->token == TOKEN_PHRASE) {
+        node = query_node(p->query, QUERY_PHRASE);
+        p->query->nodes[node].phrase = p->span;
+        parser_advance(p);
+    } else if(p->token == TOKEN_OPEN) {
+        parser_advance(p);
+        node = parse_or(p);
+        if(node != -1 && p->token != TOKEN_CLOSE)
+            node = -1;
+        parser_advance(p);
+    }
+    p->depth--;
+    return node;
+}
+
+static int parse_and(struct parser *p) {
+    int node = parse_unary(p);
+    int and_node = -1;
+    while(node != -1 && p->token != TOKEN_END && p->token != TOKEN_OR && p->token != TOKEN_CLOSE) {
+        if(p->token == TOKEN_AND)
+            parser_advance(p);
+        int operand = parse_unary(p);
+        if(operand == -1)
+            return -1;
+        if(and_node == -1) {
+            and_node = query_node(p->query, QUERY_AND);
+            query_append(p->query, and_node, node);
+        }
+        query_append(p->query, and_node, operand);
+    }
+    return and_node == -1 ? node : and_node;
+}
+
+static int parse_or(struct parser *p) {
+    int node = parse_and(p);
+    int or_node = -1;
+    while(node != -1 && p->token == TOKEN_OR) {
+        parser_advance(p);
+        int operand = parse_and(p);
+        if(operand == -1)
+            return -1;
+        if(or_node == -1) {
+            or_node = query_node(p->query, QUERY_OR);
+            query_append(p->query, or_node, node);
+        }
+        query_append(p->query, or_node, operand);
+    }
+    return or_node == -1 ? node : or_node;
+}
+
+int query_parse(struct query *query, const char *text, uint32_t length) {
+    memset(query, 0, sizeof(struct query));
+    struct parser p = {query, text, length, 0, TOKEN_END, {NULL, 0}, 0};
+    parser_advance(&p);
+    query->root = parse_or(&p);
+    if(query->root == -1 || p.token != TOKEN_END) {
+        query_free(query);
+        return -1;
+    }
+    return 0;
+}
+
+void query_free(struct query *query) {
+    free(query->nodes);
+    query->nodes = NULL;
+    query->nnodes = query->capacity = 0;
+}
+
+// Every document id, removed ones are dropped once the query is done
+static uint32_t query_all(struct database *db, uint32_t **ids) {
+    *ids = malloc(sizeof(uint32_t) * db->docs->length);
+    for(uint32_t id = 0; id < db->docs->length; id++) {
+        (*ids)[id] = id;
+    }
+    return db->docs->length;
+}
+
+// Phrases that are a single key can be searched in their postings without decoding them
+static int query_single_key(struct database *db, const struct span *phrase) {
+    return db->mode != INDEX_MODE_POSITIONAL || !memchr(phrase->text, ' ', phrase->length);
+}
+
+// Positive operands first, each with fewer ids than the next
+static int cmpoperand(const void *pa, const void *pb) {
+    const struct operand *a = pa;
+    const struct operand *b = pb;
+    if(a->negated != b->negated)
+        return a->negated - b->negated;
+    return (a->count > b->count) - (a->count < b->count);
+}
+
+static uint32_t query_eval(const struct query *query, int node, struct database *db,
+                           uint32_t **ids);
+
+// Replaces the count ids with the ones that are also in other
+static uint32_t query_intersect(uint32_t **ids, uint32_t count, const uint32_t *other,
+                                uint32_t nother) {
+    uint32_t *both = malloc(sizeof(uint32_t) * MIN(count, nother));
+    count = pintersect(both, *ids, count, other, nother);
+    free(*ids);
+    *ids = both;
+    return count;
+}
+
+static uint32_t query_and(const struct query *query, int node, struct database *db,
+                          uint32_t **ids) {
+    const struct query_node *nodes = query->nodes;
+    uint32_t noperands = 0;
+    for(int on = nodes[node].child; on != -1; on = nodes[on].next) {
+        noperands++;
+    }
+
+    // An operand without ids makes the whole AND empty, the rest is not evaluated then
+    struct operand *operands = calloc(noperands, sizeof(struct operand));
+    int empty = 0;
+    uint32_t n = 0;
+    for(int on = nodes[node].child; on != -1 && !empty; on = nodes[on].next) {
+        struct operand *operand = &operands[n++];
+        int target = on;
+        if(nodes[on].op == QUERY_NOT) {
+            operand->negated = 1;
+            target = nodes[on].child;
+        }
+        const struct span *phrase = &nodes[target].phrase;
+        if(nodes[target].op == QUERY_PHRASE && query_single_key(db, phrase)) {
+            database_lookup(db, phrase->text, phrase->length, &operand->lookup);
+            operand->is_lookup = 1;
+            operand->count = operand->lookup.list.length;
+        } else {
+            operand->count = query_eval(query, target, db, &operand->ids);
+        }
+        empty = !operand->negated && operand->count == 0;
+    }
+
+    uint32_t count = 0;
+    *ids = NULL;
+    if(!empty) {
+        qsort(operands, n, sizeof(struct operand), cmpoperand);
+        uint32_t i = 0;
+        if(operands[0].negated) {
+            count = query_all(db, ids);
+        } else if(operands[0].is_lookup) {
+            *ids = malloc(sizeof(uint32_t) * operands[0].count);
+            count = pdecode(&operands[0].lookup.list, *ids);
+            i = 1;
+        } else {
+            *ids = operands[0].ids;
+            count = operands[0].count;
+            operands[0].ids = NULL;
+            i = 1;
+        }
+        // The ids so far are looked up in the postings of an operand, which skips the blocks
+        // between them, or intersected with the ids it evaluated to
+        for(; i < n && count > 0; i++) {
+            struct operand *operand = &operands[i];
+            if(operand->is_lookup)
+                count = pfilter(&operand->lookup.list, *ids, count, !operand->negated);
+            else if(operand->negated)
+                count = psubtract(*ids, *ids, count, operand->ids, operand->count);
+            else
+                count = query_intersect(ids, count, operand->ids, operand->count);
+        }
+    }
+
+    for(uint32_t i = 0; i < n; i++) {
+        if(operands[i].is_lookup)
+            lookup_release(&operands[i].lookup);
+        free(operands[i].ids);
+    }
+    free(operands);
+    return count;
+}
+
+static uint32_t query_or(const struct query *query, int node, struct database *db,
+                         uint32_t **ids) {
+    const struct query_node *nodes = query->nodes;
+    int on = nodes[node].child;
+    uint32_t count = query_eval(query, on, db, ids);
+    for(on = nodes[on].next; on != -1; on = nodes[on].next) {
+        uint32_t *more;
+        uint32_t nmore = query_eval(query, on, db, &more);
+        uint32_t *merged = malloc(sizeof(uint32_t) * (count + nmore));
+        count = punion(merged, *ids, count, more, nmore);
+        free(*ids);
+        free(more);
+        *ids = merged;
+    }
+    return count;
+}
+
+static uint32_t query_eval(const struct query *query, int node, struct database *db,
+                           uint32_t **ids) {
+    const struct query_node *on = &query->nodes[node];
+    if(on->op == QUERY_AND)
+        return query_and(query, node, db, ids);
+    if(on->op == QUERY_OR)
+        return query_or(query, node, db, ids);
+    if(on->op == QUERY_PHRASE)
+        return database_search(db, on->phrase.text, on->phrase.length, ids);
+
+    // A NOT on its own matches every document the operand does not
+    uint32_t *excluded;
+    uint32_t nexcluded = query_eval(query, on->child, db, &excluded);
+    uint32_t count = query_all(db, ids);
+    count = psubtract(*ids, *ids, count, excluded, nexcluded);
+    free(excluded);
+    return count;
+}
+
+uint32_t query_run(const struct query *query, struct database *db, uint32_t **ids) {
+    uint32_t count = query_eval(query, query->root, db, ids);
+    if(!db->docs->nremoved)
+        return count;
+    uint32_t kept = 0;
+    for(uint32_t i = 0; i < count; i++) {
+        if(!docdict_removed(db->docs, (*ids)[i]))
+            (*ids)[kept++] = (*ids)[i];
+    }
+    return kept;
+}
@@ -0,0 +1,54 @@
+#ifndef H_QUERY
+#define H_QUERY
+
+#include <stdint.h>
+
+#include "database.h"
+#include "indexer.h"
+
+// Boolean queries over phrases, run on the server so only the final ids are sent back:
+//
+//   query   = and ("OR" and)*
+//   and     = unary (["AND"] unary)*
+//   unary   = "NOT" unary | operand
+//   operand = word | '"' phrase '"' | "(" query ")"
+//
+// A word or quoted phrase matches what SEARCH finds for it. Operators are only recognized in upper
+// case, quote them to search for the words themselves.
+#define QUERY_DEPTH_MAX 64 // Nested parentheses and NOTs allowed, bounds the recursion
+
+enum query_op
+{
+    QUERY_PHRASE = 0,
+    QUERY_AND = 1,
+    QUERY_OR = 2,
+    QUERY_NOT = 3,
+};
+
+// Nodes are kept in one array and refer to each other by index, -1 is none
+struct query_node
+{
+    int op;             // One of query_op
+    struct span phrase; // Points into the query text
+    int child;          // First operand, NOT has exactly one
+    int next;           // Next operand of the same AND or OR
+};
+
+struct query
+{
+    struct query_node *nodes;
+    uint32_t nnodes;
+    uint32_t capacity;
+    int root;
+};
+
+// Parses the normalized text, which must stay unchanged while the query is used. Returns -1 if it
+// is malformed.
+int query_parse(struct query *query, const char *text, uint32_t length);
+void query_free(struct query *query);
+// Ids of the documents matching the query in ascending order, the caller frees *ids. ANDs start
+// from the operand with the fewest ids and look the others up in that order, so each step
+// narrows down what the next has to look at.
+uint32_t query_run(const struct query *query, struct database *db, uint32_t **ids);
+
+#endif
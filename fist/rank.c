@@ -0,0 +1,232 @@
+#include "rank.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "database.h"
+#include "docdict.h"
+#include "indexer.h"
+#include "postings.h"
+#include "utils.h"
+
+// A word of the ranking and where its cursor is
+struct term
+{
+    struct span word;
+    struct lookup lookup;
+    struct pcursor cursor;
+    uint32_t id; // Document under the cursor
+    int more;    // 0 once the cursor went past the last document
+    double idf;
+    double bound; // Most the word can add to the score of a document
+};
+
+struct hit
+{
+    double score;
+    uint32_t id;
+};
+
+// Holds the k best documents found so far, the worst of them at the top
+struct heap
+{
+    struct hit *hits;
+    uint32_t length;
+    uint32_t k;
+};
+
+static int cmpword(const void *pa, const void *pb) {
+    const struct term *a = pa;
+    const struct term *b = pb;
+    int cmp = memcmp(a->word.text, b->word.text, MIN(a->word.length, b->word.length));
+    return cmp ? cmp : (a->word.length > b->word.length) - (a->word.length < b->word.length);
+}
+
+static int cmpbound(const void *pa, const void *pb) {
+    const struct term *a = pa;
+    const struct term *b = pb;
+    return (a->bound > b->bound) - (a->bound < b->bound);
+}
+
+// Lower scores are worse, of equal ones the higher id
+static int hit_worse(const struct hit *a, const struct hit *b) {
+    return a->score < b->score || (a->score == b->score && a->id > b->id);
+}
+
+static int cmphit(const void *pa, const void *pb) {
+    return hit_worse(pa, pb) - hit_worse(pb, pa);
+}
+
+static void heap_sift_down(struct heap *heap, uint32_t i) {
+    for(;;) {
+        uint32_t worst = i;
+        uint32_t left = 2 * i + 1;
+        uint32_t right = left + 1;
+        if(left < heap->length && hit_worse(&heap->hits[left], &heap->hits[worst]))
+            worst = left;
+        if(right < heap->length && hit_worse(&heap->hits[right], &heap->hits[worst]))
+            worst = right;
+        if(worst == i)
+            return;
+        struct hit swap = heap->hits[i];
+        heap->hits[i] = heap->hits[worst];
+        heap->hits[worst] = swap;
+        i = worst;
+    }
+}
+
+// Returns 1 if the hit made it into the k best
+static int heap_offer(struct heap *heap, double score, uint32_t id) {
+    struct hit hit = {score, id};
+    if(heap->length < heap->k) {
+        uint32_t i = heap->length++;
+        while(i > 0 && hit_worse(&hit, &heap->hits[(i - 1) / 2])) {
+            heap->hits[i] = heap->hits[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap->hits[i] = hit;
+        return 1;
+    }
+    if(!hit_worse(&heap->hits[0], &hit))
+        return 0;
+    heap->hits[0] = hit;
+    heap_sift_down(heap, 0);
+    return 1;
+}
+
+static double term_score(struct database *db, const struct term *term, double avgdl) {
+    double tf = db->mode == INDEX_MODE_POSITIONAL ? pcursor_npos(&term->cursor) : 1;
+    double norm = RANK_K1 * (1 - RANK_B + RANK_B * db->docs->lengths[term->id] / avgdl);
+    return term->idf * tf * (RANK_K1 + 1) / (tf + norm);
+}
+
+// Documents of the list that were not removed. Segments keep the postings of removed documents
+// until a merge drops them, they must not count against ndocs, which leaves them out.
+static uint32_t rank_df(struct database *db, const postings *list) {
+    uint32_t df = list->length;
+    uint32_t removed = 0;
+    uint32_t id;
+    struct pcursor cursor;
+    pcursor_init(&cursor, list);
+    while(df && idset_next(&db->docs->removed, &removed)) {
+        if(!pcursor_seek(&cursor, removed, &id))
+            break;
+        if(id == removed) {
+            df--;
+            id++;
+        }
+        removed = id;
+    }
+    return df;
+}
+
+// The distinct words of text, looked up
+static uint32_t rank_terms(struct database *db, const char *text, uint32_t length,
+                           struct term **terms) {
+    uint32_t nwords = 0;
+    uint32_t offset = 0;
+    struct span word;
+    while(tnext(text, length, &offset, &word))
+        nwords++;
+    *terms = calloc(nwords ? nwords : 1, sizeof(struct term));
+    offset = 0;
+    for(uint32_t i = 0; tnext(text, length, &offset, &word); i++) {
+        (*terms)[i].word = word;
+    }
+    qsort(*terms, nwords, sizeof(struct term), cmpword);
+
+    double ndocs = db->docs->length - db->docs->nremoved;
+    uint32_t count = 0;
+    for(uint32_t i = 0; i < nwords; i++) {
+        if(count > 0 && !cmpword(&(*terms)[count - 1], &(*terms)[i]))
+            continue;
+        struct term *term = &(*terms)[count++];
+        term->word = (*terms)[i].word;
+        database_lookup(db, term->word.text, term->word.length, &term->lookup);
+        double df = rank_df(db, &term->lookup.list);
+        term->idf = log(1 + (ndocs - df + 0.5) / (df + 0.5));
+        if(term->idf < 0)
+            term->idf = 0;
+        // Scores grow with the count of the word and the shortness of the document, a document
+        // holding it at most once in phrase mode can get no more than with length 0
+        term->bound = term->idf * (RANK_K1 + 1);
+        if(db->mode != INDEX_MODE_POSITIONAL)
+            term->bound /= 1 + RANK_K1 * (1 - RANK_B);
+    }
+    return count;
+}
+
+uint32_t rank_search(struct database *db, const char *text, uint32_t length, uint32_t k,
+                     uint32_t **ids) {
+    struct term *terms;
+    uint32_t nterms = rank_terms(db, text, length, &terms);
+    uint32_t live = db->docs->length - db->docs->nremoved;
+    double avgdl = live ? (double)db->docs->total_length / live : 0;
+    if(avgdl <= 0)
+        avgdl = 1;
+
+    // Terms are kept in ascending order of their bounds. The ones before essential can not get a
+    // document into the heap on their own, so only the others decide which documents are scored.
+    qsort(terms, nterms, sizeof(struct term), cmpbound);
+    double *below = malloc(sizeof(double) * (nterms + 1)); // Sum of the bounds of terms before i
+    below[0] = 0;
+    for(uint32_t i = 0; i < nterms; i++) {
+        below[i + 1] = below[i] + terms[i].bound;
+        pcursor_init(&terms[i].cursor, &terms[i].lookup.list);
+        terms[i].more = pcursor_next(&terms[i].cursor, &terms[i].id);
+    }
+    struct heap heap = {malloc(sizeof(struct hit) * (k ? k : 1)), 0, k};
+    uint32_t essential = 0;
+    double threshold = -1;
+
+    while(k > 0) {
+        uint32_t candidate = UINT32_MAX;
+        int found = 0;
+        for(uint32_t i = essential; i < nterms; i++) {
+            if(terms[i].more && terms[i].id <= candidate) {
+                candidate = terms[i].id;
+                found = 1;
+            }
+        }
+        if(!found)
+            break;
+
+        double score = 0;
+        for(uint32_t i = essential; i < nterms; i++) {
+            if(terms[i].more && terms[i].id == candidate) {
+                score += term_score(db, &terms[i], avgdl);
+                terms[i].more = pcursor_next(&terms[i].cursor, &terms[i].id);
+            }
+        }
+        if(docdict_removed(db->docs, candidate))
+            continue;
+        // The rest is only looked up while it could still lift the document past the threshold
+        for(uint32_t i = essential; i-- > 0 && score + below[i + 1] >= threshold;) {
+            struct term *term = &terms[i];
+            if(term->more && term->id < candidate)
+                term->more = pcursor_seek(&term->cursor, candidate, &term->id);
+            if(term->more && term->id == candidate)
+                score += term_score(db, term, avgdl);
+        }
+
+        if(heap_offer(&heap, score, candidate) && heap.length == k) {
+            threshold = heap.hits[0].score;
+            while(essential < nterms && below[essential + 1] < threshold)
+                essential++;
+        }
+    }
+
+    qsort(heap.hits, heap.length, sizeof(struct hit), cmphit);
+    *ids = malloc(sizeof(uint32_t) * (heap.length ? heap.length : 1));
+    for(uint32_t i = 0; i < heap.length; i++) {
+        (*ids)[i] = heap.hits[i].id;
+    }
+    for(uint32_t i = 0; i < nterms; i++) {
+        lookup_release(&terms[i].lookup);
+    }
+    free(terms);
+    free(below);
+    free(heap.hits);
+    return heap.length;
+}
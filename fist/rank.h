@@ -0,0 +1,22 @@
+#ifndef H_RANK
+#define H_RANK
+
+#include <stdint.h>
+
+#include "database.h"
+
+// BM25 parameters: how quickly repeating a word stops adding to the score, and how much longer
+// documents are held against it
+#define RANK_K1 1.2
+#define RANK_B 0.75
+#define RANK_MAX 10000 // Most results one ranking returns
+
+// Ids of the k documents that score highest by BM25 for the words of text, best first, ties in
+// ascending order. How often a document holds a word is counted in positional mode, phrase mode
+// only records that it does. Scoring is pruned MaxScore style: once k documents were found, the
+// words that together could not lift a document past the k best are only looked up for the
+// documents the other words lead to. The caller frees *ids.
+uint32_t rank_search(struct database *db, const char *text, uint32_t length, uint32_t k,
+                     uint32_t **ids);
+
+#endif
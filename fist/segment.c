@@ -0,0 +1,332 @@
+#include "segment.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "docdict.h"
+#include "dstring.h"
+#include "hashmap.h"
+#include "utils.h"
+
+#define SEGMENT_OFFSET_MASK ((1ULL << (64 - SEGMENT_TAG_BITS)) - 1)
+
+static inline uint64_t segment_hash(const char *key, uint32_t length) {
+    uint64_t hash = hhash(key, length);
+    return hash ? hash : 1;
+}
+
+static inline uint64_t align8(uint64_t offset) {
+    return (offset + 7) & ~7ULL;
+}
+
+// The blocks of an entry follow its key on the next 8 byte boundary
+static inline const struct pblock_stored *segment_blocks(const struct segment_entry *entry) {
+    return (const struct pblock_stored *)((const unsigned char *)entry +
+                                          align8(sizeof(*entry) + entry->key_length));
+}
+
+static void segment_view(const struct segment *seg, uint64_t offset, const char **key,
+                         uint32_t *key_length, postings *list) {
+    const struct segment_entry *entry = (const struct segment_entry *)(seg->data + offset);
+    *key = (const char *)(entry + 1);
+    *key_length = entry->key_length;
+    *list = pstored(segment_blocks(entry), entry->nblocks, entry->length, entry->payload);
+}
+
+#define SEGMENT_RANGE_SIZE (sizeof(uint32_t) * (1 + DOCDICT_RANGE)) // The number and the counts
+
+struct segment *segment_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if(fd == -1)
+        return NULL;
+    struct stat st;
+    if(fstat(fd, &st) == -1 || (uint64_t)st.st_size < sizeof(struct segment_header)) {
+        close(fd);
+        return NULL;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        perror("segment: mmap");
+        return NULL;
+    }
+
+    const struct segment_header *header = data;
+    int valid = !memcmp(header->magic, SEGMENT_MAGIC, 8) && header->version == SEGMENT_VERSION &&
+                header->size == (uint64_t)st.st_size && header->docs_offset <= header->size &&
+                header->slots_offset + header->nslots * sizeof(uint64_t) <= header->size &&
+                !(header->nslots & (header->nslots - 1)) &&
+                header->docs_first <= header->ndocs && header->docs_end <= header->size &&
+                header->range_size == DOCDICT_RANGE &&
+                header->lengths_offset + header->nranges * SEGMENT_RANGE_SIZE <= header->size &&
+                header->removed_offset + header->nremoved * sizeof(uint32_t) <= header->size;
+    if(!valid) {
+        fprintf(stderr, "segment: %s is truncated or damaged\n", path);
+        munmap(data, st.st_size);
+        return NULL;
+    }
+
+    struct segment *seg = malloc(sizeof(struct segment));
+    seg->data = data;
+    seg->size = st.st_size;
+    seg->header = header;
+    seg->slots = (const uint64_t *)(seg->data + header->slots_offset);
+    seg->lengths = (const uint32_t *)(seg->data + header->lengths_offset);
+    seg->number = 0;
+    return seg;
+}
+
+void segment_close(struct segment *seg) {
+    if(!seg)
+        return;
+    munmap((void *)seg->data, seg->size);
+    free(seg);
+}
+
+uint32_t segment_keys(const struct segment *seg) {
+    return seg ? seg->header->nkeys : 0;
+}
+
+uint64_t segment_docs_size(const struct segment *seg) {
+    const struct segment_header *header = seg->header;
+    return header->docs_end - header->docs_offset + header->nranges * SEGMENT_RANGE_SIZE +
+           header->nremoved * sizeof(uint32_t);
+}
+
+int segment_load_docs(const struct segment *seg, struct docdict *docs) {
+    if(docs->length != seg->header->docs_first)
+        return -1;
+
+    // Names repeat once a document was indexed again after it was removed, each gets its own id
+    uint64_t offset = 0;
+    const char *text;
+    uint32_t length;
+    while(segment_next_doc(seg, &offset, &text, &length)) {
+        dstring name = dcreaten(text, length);
+        docdict_renew(docs, name);
+        dfree(name);
+    }
+    uint64_t nremoved;
+    const uint32_t *removed = segment_removed(seg, &nremoved);
+    for(uint64_t i = 0; i < nremoved; i++) {
+        if(removed[i] < docs->length && !idset_has(&docs->removed, removed[i])) {
+            idset_add(&docs->removed, removed[i]);
+            docs->nremoved++;
+        }
+    }
+    for(uint32_t range = 0; (uint64_t)range * DOCDICT_RANGE < docs->length; range++) {
+        const uint32_t *lengths = segment_range(seg, range);
+        uint32_t first = range * DOCDICT_RANGE;
+        for(uint32_t i = 0; lengths && i < DOCDICT_RANGE && first + i < docs->length; i++) {
+            docs->total_length += (uint64_t)lengths[i] - docs->lengths[first + i];
+            docs->lengths[first + i] = lengths[i];
+        }
+    }
+    return 0;
+}
+
+const uint32_t *segment_removed(const struct segment *seg, uint64_t *count) {
+    *count = seg->header->nremoved;
+    return *count ? (const uint32_t *)(seg->data + seg->header->removed_offset) : NULL;
+}
+
+const uint32_t *segment_range(const struct segment *seg, uint32_t range) {
+    if((uint64_t)range * DOCDICT_RANGE >= seg->header->ndocs)
+        return NULL;
+
+    uint32_t low = 0;
+    uint32_t high = seg->header->nranges;
+    while(low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        const uint32_t *stored = seg->lengths + (uint64_t)middle * (1 + DOCDICT_RANGE);
+        if(stored[0] == range)
+            return stored + 1;
+        if(stored[0] < range)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return NULL;
+}
+
+int segment_next_doc(const struct segment *seg, uint64_t *offset, const char **name,
+                     uint32_t *length) {
+    if(*offset == 0)
+        *offset = seg->header->docs_offset;
+    if(*offset + sizeof(uint32_t) > seg->header->docs_end)
+        return 0;
+    memcpy(length, seg->data + *offset, sizeof(uint32_t));
+    *name = (const char *)seg->data + *offset + sizeof(uint32_t);
+    *offset += sizeof(uint32_t) + *length;
+    return 1;
+}
+
+int segment_find(const struct segment *seg, const char *key, uint32_t length, postings *list,
+                 uint32_t *flags) {
+    uint64_t hash = segment_hash(key, length);
+    uint64_t tag = hash >> (64 - SEGMENT_TAG_BITS);
+    uint64_t mask = seg->header->nslots - 1;
+    for(uint64_t i = hash & mask; seg->slots[i]; i = (i + 1) & mask) {
+        if(seg->slots[i] >> (64 - SEGMENT_TAG_BITS) != tag)
+            continue;
+        uint64_t offset = seg->slots[i] & SEGMENT_OFFSET_MASK;
+        const struct segment_entry *entry = (const struct segment_entry *)(seg->data + offset);
+        const char *found = (const char *)(entry + 1);
+        if(entry->key_length == length && !memcmp(found, key, length)) {
+            *flags = entry->flags;
+            segment_view(seg, offset, &found, &length, list);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int segment_next(const struct segment *seg, uint64_t *offset, const char **key, uint32_t *length,
+                 postings *list, uint32_t *flags) {
+    if(*offset == 0)
+        *offset = sizeof(struct segment_header);
+    if(*offset >= seg->header->docs_offset)
+        return 0;
+
+    const struct segment_entry *entry = (const struct segment_entry *)(seg->data + *offset);
+    const struct pblock_stored *blocks = segment_blocks(entry);
+    *flags = entry->flags;
+    segment_view(seg, *offset, key, length, list);
+    uint32_t data = entry->nblocks ? blocks[entry->nblocks - 1].end : 0;
+    *offset = align8((const unsigned char *)(blocks + entry->nblocks) + data - seg->data);
+    return 1;
+}
+
+static void segment_pad(struct segment_writer *w) {
+    static const char zeros[8] = {0};
+    uint64_t padded = align8(w->offset);
+    fwrite(zeros, padded - w->offset, 1, w->file);
+    w->offset = padded;
+}
+
+int segment_writer_open(struct segment_writer *w, const char *path, uint32_t mode,
+                        uint64_t max_keys, uint32_t docs_first) {
+    if(!(w->file = fopen(path, "wb")))
+        return -1;
+    memset(&w->header, 0, sizeof(w->header));
+    memcpy(w->header.magic, SEGMENT_MAGIC, 8);
+    w->header.version = SEGMENT_VERSION;
+    w->header.mode = mode;
+    w->header.docs_first = docs_first;
+    w->header.range_size = DOCDICT_RANGE;
+    fwrite(&w->header, sizeof(w->header), 1, w->file);
+    w->offset = sizeof(w->header);
+
+    w->nslots = HMAP_INITIAL_CAPACITY;
+    while(max_keys * 100 > w->nslots * SEGMENT_MAX_LOAD)
+        w->nslots *= 2;
+    w->slots = calloc(w->nslots, sizeof(uint64_t));
+    return 0;
+}
+
+void segment_writer_add(struct segment_writer *w, const char *key, uint32_t length,
+                        const postings *list, uint32_t flags) {
+    if(list->length == 0 && !(flags & SEGMENT_ENTRY_TOMBSTONE))
+        return;
+
+    uint64_t offset = w->offset;
+    struct segment_entry entry = {length, list->length, list->nblocks, list->payload, flags};
+    fwrite(&entry, sizeof(entry), 1, w->file);
+    fwrite(key, length, 1, w->file);
+    w->offset += sizeof(entry) + length;
+    segment_pad(w);
+    uint32_t end = 0;
+    for(uint32_t i = 0; i < list->nblocks; i++) {
+        struct pblock from = pblock_get(list, i);
+        end += from.size;
+        struct pblock_stored block = {from.first, from.last, from.count, end};
+        fwrite(&block, sizeof(block), 1, w->file);
+    }
+    for(uint32_t i = 0; i < list->nblocks; i++) {
+        struct pblock from = pblock_get(list, i);
+        if(from.size)
+            fwrite(from.data, from.size, 1, w->file);
+    }
+    w->offset += sizeof(struct pblock_stored) * list->nblocks + end;
+    segment_pad(w);
+
+    uint64_t hash = segment_hash(key, length);
+    uint64_t mask = w->nslots - 1;
+    uint64_t i = hash & mask;
+    while(w->slots[i])
+        i = (i + 1) & mask;
+    w->slots[i] = (hash & ~SEGMENT_OFFSET_MASK) | offset;
+    w->header.nkeys++;
+    if(flags & SEGMENT_ENTRY_TOMBSTONE)
+        w->header.ntombstones++;
+}
+
+void segment_writer_add_doc(struct segment_writer *w, const char *name, uint32_t length) {
+    if(!w->header.docs_offset)
+        w->header.docs_offset = w->offset;
+    fwrite(&length, sizeof(length), 1, w->file);
+    fwrite(name, length, 1, w->file);
+    w->offset += sizeof(length) + length;
+}
+
+// Ends the names of the documents, the word counts come next
+static void segment_writer_end_docs(struct segment_writer *w) {
+    if(w->header.lengths_offset)
+        return;
+    if(!w->header.docs_offset)
+        w->header.docs_offset = w->offset;
+    w->header.docs_end = w->offset;
+    segment_pad(w);
+    w->header.lengths_offset = w->offset;
+}
+
+void segment_writer_add_range(struct segment_writer *w, uint32_t range, const uint32_t *lengths,
+                              uint32_t count) {
+    static const uint32_t zeros[DOCDICT_RANGE] = {0};
+    segment_writer_end_docs(w);
+    fwrite(&range, sizeof(range), 1, w->file);
+    fwrite(lengths, sizeof(uint32_t), count, w->file);
+    fwrite(zeros, sizeof(uint32_t), DOCDICT_RANGE - count, w->file);
+    w->offset += SEGMENT_RANGE_SIZE;
+    w->header.nranges++;
+}
+
+void segment_writer_add_removed(struct segment_writer *w, uint32_t id) {
+    segment_writer_end_docs(w);
+    if(!w->header.removed_offset)
+        w->header.removed_offset = w->offset;
+    fwrite(&id, sizeof(id), 1, w->file);
+    w->offset += sizeof(id);
+    w->header.nremoved++;
+}
+
+int segment_writer_close(struct segment_writer *w, uint32_t ndocs, uint64_t log_id,
+                         uint64_t log_offset) {
+    segment_writer_end_docs(w);
+    if(!w->header.removed_offset)
+        w->header.removed_offset = w->offset;
+    w->header.ndocs = ndocs;
+    segment_pad(w);
+
+    w->header.nslots = w->nslots;
+    w->header.slots_offset = w->offset;
+    fwrite(w->slots, sizeof(uint64_t), w->nslots, w->file);
+    w->offset += sizeof(uint64_t) * w->nslots;
+    free(w->slots);
+
+    w->header.log_id = log_id;
+    w->header.log_offset = log_offset;
+    w->header.size = w->offset;
+    fseek(w->file, 0, SEEK_SET);
+    fwrite(&w->header, sizeof(w->header), 1, w->file);
+
+    int rc = ferror(w->file) || fflush(w->file) || fdatasync(fileno(w->file)) ? -1 : 0;
+    if(fclose(w->file))
+        rc = -1;
+    return rc;
+}
@@ -0,0 +1,138 @@
+#ifndef H_SEGMENT
+#define H_SEGMENT
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "docdict.h"
+#include "postings.h"
+
+// Part of a saved database laid out to be mmap()ed and searched in place, so opening it costs the
+// same no matter how many keys it holds and its pages are only read in when a key is looked up.
+// Segments are never changed once written, a database is a list of them, see struct database.
+//
+// The file starts with a struct segment_header, followed by one entry per key. Entries start on an
+// 8 byte boundary with a struct segment_entry and the key. The postings follow on the next 8 byte
+// boundary as struct pblock_stored blocks and their data, read in place, see pstored(). The names
+// of the documents from docs_first on come after the entries at docs_offset, each as a uint32
+// length and the name, up to docs_end. The word counts follow at lengths_offset in nranges
+// ranges sorted by number, each the uint32 number of the range and the uint32 counts of the
+// range_size documents from number * range_size on. Only the ranges that changed since the
+// segment below are stored, see docdict->changed. The ids of the documents removed since the
+// segment below follow at removed_offset as nremoved sorted uint32. Keys are found through a table
+// of nslots uint64 slots at slots_offset, probed linearly. A slot holds the top SEGMENT_TAG_BITS
+// bits of the hash of a key above the offset of its entry, 0 marks an empty slot.
+#define SEGMENT_MAGIC "FISTSEG1"
+#define SEGMENT_VERSION 1
+#define SEGMENT_TAG_BITS 24
+#define SEGMENT_MAX_LOAD 75 // Percent of slots in use at most
+
+struct segment_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t mode;
+    uint64_t log_id; // Command log mark, see struct database
+    uint64_t log_offset;
+    uint32_t ndocs;
+    uint32_t nkeys;
+    uint64_t docs_offset;
+    uint64_t nslots;
+    uint64_t slots_offset;
+    uint64_t size; // Of the whole file
+    uint32_t docs_first;
+    uint32_t ntombstones; // Entries with SEGMENT_ENTRY_TOMBSTONE
+    uint64_t docs_end;
+    uint64_t lengths_offset;
+    uint32_t nranges;
+    uint32_t range_size; // DOCDICT_RANGE
+    uint64_t removed_offset;
+    uint64_t nremoved;
+};
+
+// Flags of an entry
+enum segment_entry_flags
+{
+    // The key was deleted after everything in older segments was written, they no longer count
+    // for it. The entry may still hold postings added after the delete.
+    SEGMENT_ENTRY_TOMBSTONE = 1,
+};
+
+struct segment_entry
+{
+    uint32_t key_length;
+    uint32_t length; // Ids in the postings
+    uint32_t nblocks;
+    uint16_t payload;
+    uint16_t flags; // segment_entry_flags
+};
+
+struct segment
+{
+    const unsigned char *data;
+    uint64_t size;
+    const struct segment_header *header;
+    const uint64_t *slots;
+    const uint32_t *lengths; // The stored ranges, see segment_range()
+    uint64_t number;         // Set by whoever opened it, names the file in a database
+};
+
+// Builds a segment file, the entries are written as they are added, then the documents and word
+// counts, then the slot table at the end
+struct segment_writer
+{
+    FILE *file;
+    uint64_t offset;
+    uint64_t *slots;
+    uint64_t nslots;
+    struct segment_header header;
+};
+
+// Maps the segment at path, returns NULL if it is not a valid segment
+struct segment *segment_open(const char *path);
+void segment_close(struct segment *seg);
+uint32_t segment_keys(const struct segment *seg);
+// Bytes of the names, word counts and removed ids that segment_load_docs() reads
+uint64_t segment_docs_size(const struct segment *seg);
+// Adds the documents of the segment to docs, which must hold the documents before docs_first,
+// sets the word counts the segment holds and removes the documents it removed. Returns -1 if
+// docs does not end at docs_first.
+int segment_load_docs(const struct segment *seg, struct docdict *docs);
+// Iterates over the names of the documents from docs_first on, start with *offset = 0. Returns 0
+// once all names were read.
+int segment_next_doc(const struct segment *seg, uint64_t *offset, const char **name,
+                     uint32_t *length);
+// The ids of the documents removed since the segment below, sorted, sets *count
+const uint32_t *segment_removed(const struct segment *seg, uint64_t *count);
+// The DOCDICT_RANGE word counts of range, or NULL if the segment does not hold them
+const uint32_t *segment_range(const struct segment *seg, uint32_t range);
+// Looks up key and points list at its postings inside the mapping, nothing is allocated. Returns 0
+// if the key is not in the segment.
+int segment_find(const struct segment *seg, const char *key, uint32_t length, postings *list,
+                 uint32_t *flags);
+// Iterates over the keys in the order they are stored, start with *offset = 0. The key points into
+// the mapping, list is as for segment_find(). Returns 0 once all keys were read.
+int segment_next(const struct segment *seg, uint64_t *offset, const char **key, uint32_t *length,
+                 postings *list, uint32_t *flags);
+
+// max_keys bounds the number of keys that will be added, documents start at docs_first. Returns
+// -1 if path cannot be written.
+int segment_writer_open(struct segment_writer *w, const char *path, uint32_t mode,
+                        uint64_t max_keys, uint32_t docs_first);
+// Entries without postings are only written when they carry SEGMENT_ENTRY_TOMBSTONE
+void segment_writer_add(struct segment_writer *w, const char *key, uint32_t length,
+                        const postings *list, uint32_t flags);
+// Adds the next document name, after all keys were added
+void segment_writer_add_doc(struct segment_writer *w, const char *name, uint32_t length);
+// Adds the word counts of a range after all documents, ranges in ascending order. count of them
+// are taken from lengths, the rest of the range is 0.
+void segment_writer_add_range(struct segment_writer *w, uint32_t range, const uint32_t *lengths,
+                              uint32_t count);
+// Adds the id of a removed document after all ranges, ids in ascending order
+void segment_writer_add_removed(struct segment_writer *w, uint32_t id);
+// Writes the slot table for ndocs documents, then flushes the file to disk and closes it. Returns
+// -1 if writing failed.
+int segment_writer_close(struct segment_writer *w, uint32_t ndocs, uint64_t log_id,
+                         uint64_t log_offset);
+
+#endif
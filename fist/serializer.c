@@ -1,186 +1,487 @@
 #include "serializer.h"
+#include "database.h"
+#include "docdict.h"
 #include "dstring.h"
 #include "hashmap.h"
 #include "lzf.h"
+#include "postings.h"
+#include "segment.h"
 #include "stdint.h"
 #include "stdio.h"
 #include "stdlib.h"
+#include "utils.h"
+#include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-static void sdump_compress(const char *path, unsigned char *data, uint64_t original_size) {
-    FILE *compressed = fopen(path, "wb");
-    fwrite(&original_size, sizeof(original_size), 1, compressed);
+// Reads the payload of a database file from before segments, which is decompressed into memory
+// as a whole
+struct sreader
+{
+    const unsigned char *raw;
+    uint64_t length;
+    uint64_t offset;
+    int failed;
+};
 
-    char *buffer;
-    if((buffer = malloc(original_size * 3)) == NULL) {
-        perror("Could not allocate memory durring compression. DB file will not be saved.");
-        fclose(compressed);
-        return;
+// Returns the next length bytes of the payload, or NULL if there are not that many left
+static const char *sread_bytes(struct sreader *r, uint32_t length) {
+    if(r->length - r->offset < length) {
+        r->failed = 1;
+        return NULL;
     }
-    long size;
-    if(!(size = lzf_compress(data, original_size, buffer, original_size * 3))) {
-        printf("Compression error\n");
+    r->offset += length;
+    return (const char *)r->raw + r->offset - length;
+}
+
+static uint32_t sread_u32(struct sreader *r) {
+    uint32_t value = 0;
+    const char *bytes = sread_bytes(r, sizeof(value));
+    if(bytes)
+        memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+dstring ssegment_path(const char *path, uint64_t number) {
+    char suffix[24];
+    snprintf(suffix, sizeof(suffix), ".%llu", (unsigned long long)number);
+    return dappend(dcreate((char *)path), suffix);
+}
+
+struct segment *ssegment_open(const char *path, uint64_t number) {
+    dstring segment_path = ssegment_path(path, number);
+    struct segment *seg = segment_open(dtext(segment_path));
+    dfree(segment_path);
+    if(seg)
+        seg->number = number;
+    return seg;
+}
+
+// Writes the file to a temporary path and moves it over path once it is complete
+// Moves the written file to path, or deletes it if writing failed. Prints nothing, errno is kept
+// for the caller.
+static int sreplace(const char *path, dstring tmp_path, int rc) {
+    if(rc == 0 && rename(dtext(tmp_path), path) == -1)
+        rc = -1;
+    int error = errno;
+    if(rc == -1)
+        unlink(dtext(tmp_path));
+    dfree(tmp_path);
+    errno = error;
+    return rc;
+}
+
+static int sfinish(const char *path, dstring tmp_path, int rc) {
+    if(sreplace(path, tmp_path, rc) == -1) {
+        fprintf(stderr, "Could not write %s: %s. DB file will not be saved.\n", path,
+                strerror(errno));
+        return -1;
     }
-    fwrite(buffer, size, 1, compressed);
-    fclose(compressed);
-    free(buffer);
+    return 0;
 }
 
-void sdump(const char *path, hashmap *hmap) {
-    // Write binary data to a temporary file, load the temp file into memory, compress it, save it
-    // to disk.
+int sflush(const char *path, struct database *db, uint64_t number, uint64_t log_id,
+           uint64_t log_offset) {
+    hashmap *hm = db->frozen ? db->frozen : db->hm;
+    hashmap *deleted = db->frozen ? db->frozen_deleted : db->deleted;
+    struct idset *ranges = db->frozen ? &db->frozen_ranges : &db->docs->changed;
+    struct idset *removed = db->frozen ? &db->frozen_removed : &db->docs->removed_changed;
+    uint32_t ndocs = db->frozen ? db->frozen_ndocs : db->docs->length;
+    uint32_t docs_first = db->nsegments ? db->segments[db->nsegments - 1]->header->ndocs : 0;
 
-    FILE *dump = tmpfile();
+    dstring segment_path = ssegment_path(path, number);
+    dstring tmp_path = dappend(dcreate(dtext(segment_path)), ".tmp");
+    struct segment_writer w;
+    if(segment_writer_open(&w, dtext(tmp_path), db->mode, hm->length + deleted->length,
+                           docs_first) == -1) {
+        int error = errno;
+        dfree(tmp_path);
+        dfree(segment_path);
+        errno = error;
+        return -1;
+    }
 
-    if(dump == NULL) {
-        perror("Could not create tmpfile during sdump. DB file will not be saved.");
-        return;
+    // Tombstones only matter to the segments below
+    uint32_t slot = 0;
+    keyval *object;
+    while((object = hnext(hm, &slot))) {
+        const char *key = itext(&object->key);
+        int tombstone = db->nsegments && hcontainsn(deleted, key, object->key.length);
+        segment_writer_add(&w, key, object->key.length, &object->values,
+                           tombstone ? SEGMENT_ENTRY_TOMBSTONE : 0);
+    }
+    slot = 0;
+    while(db->nsegments && (object = hnext(deleted, &slot))) {
+        const char *key = itext(&object->key);
+        if(!hcontainsn(hm, key, object->key.length))
+            segment_writer_add(&w, key, object->key.length, &object->values,
+                               SEGMENT_ENTRY_TOMBSTONE);
     }
 
-    uint32_t num_indices = 0;
+    // Names never change, so the ones of documents added before the freeze are still the same
+    for(uint32_t id = docs_first; id < ndocs; id++) {
+        const istring *name = docdict_name(db->docs, id);
+        segment_writer_add_doc(&w, itext(name), name->length);
+    }
+    // The counts changed since the segment below, the counts of the other ranges are there
+    const uint32_t *lengths = db->frozen ? db->frozen_lengths : NULL;
+    for(uint32_t range = 0; idset_next(ranges, &range); range++) {
+        uint32_t first = range * DOCDICT_RANGE;
+        if(first >= ndocs)
+            break;
+        segment_writer_add_range(&w, range, lengths ? lengths : db->docs->lengths + first,
+                                 MIN(ndocs - first, DOCDICT_RANGE));
+        if(lengths)
+            lengths += DOCDICT_RANGE;
+    }
+    for(uint32_t id = 0; idset_next(removed, &id); id++) {
+        segment_writer_add_removed(&w, id);
+    }
+    int rc = segment_writer_close(&w, ndocs, log_id, log_offset);
+    rc = sreplace(dtext(segment_path), tmp_path, rc);
+    int error = errno;
+    dfree(segment_path);
+    errno = error;
+    return rc;
+}
 
-    for(int i = 0; i < HMAP_SIZE; i++) {
-        // Get number of indices that have values
-        hashmap on = hmap[i];
-        if(on.length > 0)
-            num_indices++;
+// Returns 1 if a segment newer than segments[i] in the run holds key, it was written from there
+static int smerge_seen(struct segment **segments, uint32_t i, uint32_t count, const char *key,
+                       uint32_t length) {
+    for(uint32_t j = i + 1; j < count; j++) {
+        postings list;
+        uint32_t flags;
+        if(segment_find(segments[j], key, length, &list, &flags))
+            return 1;
     }
+    return 0;
+}
+
+static int cmpid(const void *pa, const void *pb) {
+    uint32_t a = *(const uint32_t *)pa;
+    uint32_t b = *(const uint32_t *)pb;
+    return (a > b) - (a < b);
+}
 
-    fwrite(&num_indices, sizeof(num_indices), 1, dump);
-    // Iterate through hashmap and write key and array of values to file
+int smerge(const char *path, struct segment **segments, uint32_t count, int oldest,
+           uint64_t number) {
+    uint64_t max_keys = 0;
+    uint64_t nremoved = 0;
+    for(uint32_t i = 0; i < count; i++) {
+        uint64_t n;
+        max_keys += segment_keys(segments[i]);
+        segment_removed(segments[i], &n);
+        nremoved += n;
+    }
 
-    for(int i = 0; i < HMAP_SIZE; i++) {
-        hashmap on = hmap[i];
-        if(on.length > 0) {
-            for(int key = 0; key < on.length; key++) {
-                keyval object = on.maps[key];
-                uint32_t length = object.key.length;
-                // Writes key length and key name to db file
+    // Documents removed in the run are dropped from its postings. Documents removed in newer
+    // segments are still skipped by searches until a later merge takes in both.
+    uint32_t *removed = malloc(sizeof(uint32_t) * (nremoved ? nremoved : 1));
+    nremoved = 0;
+    for(uint32_t i = 0; i < count; i++) {
+        uint64_t n;
+        const uint32_t *ids = segment_removed(segments[i], &n);
+        if(n)
+            memcpy(removed + nremoved, ids, sizeof(uint32_t) * n);
+        nremoved += n;
+    }
+    qsort(removed, nremoved, sizeof(uint32_t), cmpid);
+    const struct segment_header *newest = segments[count - 1]->header;
 
-                fwrite(&length, sizeof(length), 1, dump);
-                fwrite(dtext(object.key), object.key.length, 1, dump);
+    dstring segment_path = ssegment_path(path, number);
+    dstring tmp_path = dappend(dcreate(dtext(segment_path)), ".tmp");
+    struct segment_writer w;
+    if(segment_writer_open(&w, dtext(tmp_path), newest->mode, max_keys,
+                           segments[0]->header->docs_first) == -1) {
+        perror("Could not open the segment file during smerge");
+        free(removed);
+        dfree(tmp_path);
+        dfree(segment_path);
+        return -1;
+    }
 
-                uint32_t num_values = object.values.length;
-                // Writes number of values associated with key to db file
-                fwrite(&num_values, sizeof(num_values), 1, dump);
-                for(int value = 0; value < object.values.length; value++) {
-                    // Writes value to db file
-                    dstring value_on = object.values.values[value];
-                    uint32_t val_length = value_on.length;
+    // Every key is written from the newest segment of the run that holds it, merged with the
+    // older ones. A tombstone is dropped once no segment is left below it.
+    for(uint32_t i = count; i-- > 0;) {
+        const char *key;
+        uint32_t length;
+        postings list;
+        uint32_t flags;
+        uint64_t offset = 0;
+        while(segment_next(segments[i], &offset, &key, &length, &list, &flags)) {
+            if(smerge_seen(segments, i, count, key, length))
+                continue;
+            struct lookup values;
+            int deleted;
+            segments_lookup(segments, i + 1, key, length, &values, &deleted);
+            postings kept;
+            int filtered = nremoved && pwithout(&kept, &values.list, removed, nremoved);
+            segment_writer_add(&w, key, length, filtered ? &kept : &values.list,
+                               deleted && !oldest ? SEGMENT_ENTRY_TOMBSTONE : 0);
+            if(filtered)
+                pfree(&kept);
+            lookup_release(&values);
+        }
+    }
 
-                    fwrite(&val_length, sizeof(val_length), 1, dump);
-                    fwrite(dtext(value_on), value_on.length, 1, dump);
-                }
+    for(uint32_t i = 0; i < count; i++) {
+        const char *name;
+        uint32_t length;
+        uint64_t offset = 0;
+        while(segment_next_doc(segments[i], &offset, &name, &length))
+            segment_writer_add_doc(&w, name, length);
+    }
+    // Like the keys, each range of word counts comes from the newest segment that holds it
+    for(uint32_t range = 0; (uint64_t)range * DOCDICT_RANGE < newest->ndocs; range++) {
+        for(uint32_t i = count; i-- > 0;) {
+            const uint32_t *lengths = segment_range(segments[i], range);
+            if(lengths) {
+                segment_writer_add_range(&w, range, lengths, DOCDICT_RANGE);
+                break;
             }
         }
     }
+    // The removed ids are kept, segments below the run may still hold postings of them and the
+    // names must not count as documents again
+    for(uint64_t i = 0; i < nremoved; i++) {
+        segment_writer_add_removed(&w, removed[i]);
+    }
+    free(removed);
+    int rc = segment_writer_close(&w, newest->ndocs, newest->log_id, newest->log_offset);
+    rc = sfinish(dtext(segment_path), tmp_path, rc);
+    dfree(segment_path);
+    return rc;
+}
 
-    fseek(dump, 0, SEEK_END);
-    uint64_t len = ftell(dump);
-    fseek(dump, 0, SEEK_SET);
-    unsigned char *buffer;
-    if((buffer = malloc(len)) == NULL) {
-        perror("Could not allocate memory during sdump. DB file will not be saved.");
-        fclose(dump);
-        return;
+int smanifest(const char *path, struct database *db) {
+    dstring tmp_path = dappend(dcreate((char *)path), ".tmp");
+    FILE *file = fopen(dtext(tmp_path), "wb");
+    if(!file) {
+        perror("Could not open the DB file during smanifest. DB file will not be saved.");
+        dfree(tmp_path);
+        return -1;
+    }
+    uint32_t header[2] = {SERIALIZER_MANIFEST_VERSION, db->mode};
+    fwrite(SERIALIZER_MANIFEST_MAGIC, 8, 1, file);
+    fwrite(header, sizeof(header), 1, file);
+    fwrite(&db->log_id, sizeof(db->log_id), 1, file);
+    fwrite(&db->log_offset, sizeof(db->log_offset), 1, file);
+    fwrite(&db->next_segment, sizeof(db->next_segment), 1, file);
+    fwrite(&db->nsegments, sizeof(db->nsegments), 1, file);
+    for(uint32_t i = 0; i < db->nsegments; i++) {
+        fwrite(&db->segments[i]->number, sizeof(uint64_t), 1, file);
     }
-    fread(buffer, 1, len, dump);
+    int rc = ferror(file) || fflush(file) || fdatasync(fileno(file)) ? -1 : 0;
+    if(fclose(file))
+        rc = -1;
+    return sfinish(path, tmp_path, rc);
+}
 
-    sdump_compress(path, buffer, len);
-    fclose(dump);
-    free(buffer);
+void sremove(const char *path) {
+    FILE *file = fopen(path, "rb");
+    char magic[8];
+    uint32_t header[2];
+    uint64_t mark[3];
+    uint32_t nsegments;
+    if(file && fread(magic, sizeof(magic), 1, file) == 1 &&
+       !memcmp(magic, SERIALIZER_MANIFEST_MAGIC, sizeof(magic)) &&
+       fread(header, sizeof(header), 1, file) == 1 && fread(mark, sizeof(mark), 1, file) == 1 &&
+       fread(&nsegments, sizeof(nsegments), 1, file) == 1) {
+        uint64_t number;
+        for(uint32_t i = 0; i < nsegments && fread(&number, sizeof(number), 1, file) == 1; i++) {
+            dstring segment_path = ssegment_path(path, number);
+            unlink(dtext(segment_path));
+            dfree(segment_path);
+        }
+    }
+    if(file)
+        fclose(file);
+    unlink(path);
 }
 
-static FILE *sload_compressed(const char *path) {
-    FILE *db;
-    if((db = fopen(path, "rb"))) {
-        uint64_t original_size;
-        fread(&original_size, 8, 1, db);
+int sdump(const char *path, struct database *db) {
+    database_freeze(db);
+    uint64_t number = db->next_segment++;
+    if(sflush(path, db, number, db->log_id, db->log_offset) == -1) {
+        perror("Could not write a segment. DB file will not be saved");
+        return -1;
+    }
+    struct segment *seg = ssegment_open(path, number);
+    if(!seg)
+        return -1;
+    database_install(db, seg);
+    return smanifest(path, db);
+}
 
-        fseek(db, 0, SEEK_END);
-        long length = ftell(db);
-        fseek(db, 0, SEEK_SET);
+// The file holds the payload size followed by the whole payload compressed at once
+static int sload_compressed(FILE *db, uint64_t original_size, struct sreader *r) {
+    long start = ftell(db);
+    fseek(db, 0, SEEK_END);
+    long length = ftell(db) - start;
+    fseek(db, start, SEEK_SET);
 
-        // Skip first 8 bytes which are to indicate the original size of the db file.
+    unsigned char *data;
+    if((data = malloc(length)) == NULL) {
+        perror("Could not allocate memory. DB file will not be loaded.");
+        return -1;
+    }
+    fread(data, 1, length, db);
 
-        length -= 8;
-        fseek(db, 8, SEEK_CUR);
+    unsigned char *decompressed;
+    if((decompressed = malloc(original_size)) == NULL) {
+        perror("Could not allocate memory. DB file will not be loaded.");
+        free(data);
+        return -1;
+    }
+    r->raw = decompressed;
 
-        unsigned char *data;
-        if((data = malloc(length)) == NULL) {
-            perror("Could not allocate memory. DB file will not be loaded.");
-            fclose(db);
-            return NULL;
-        }
+    if(lzf_decompress(data, length, decompressed, original_size) != original_size) {
+        fprintf(stderr, "Error decompressing DB file. DB file will not be loaded.\n");
+        free(data);
+        return -1;
+    }
+    free(data);
+    r->length = original_size;
+    return 0;
+}
 
-        fread(data, 1, length, db);
+// Databases written before document ids existed store every posting as the document name
+static void sload_legacy(struct sreader *r, struct database *db, uint32_t num_keys) {
+    for(uint32_t i = 0; i < num_keys && !r->failed; i++) {
+        uint32_t key_size = sread_u32(r);
+        const char *key = sread_bytes(r, key_size);
+        if(!key)
+            break;
+        dstring dkey = dcreaten(key, key_size);
+        uint32_t num_vals = sread_u32(r);
 
-        unsigned char *decompressed;
-        if((decompressed = malloc(original_size)) == NULL) {
-            perror("Could not allocate memory. DB file will not be loaded.");
-            free(data);
-            fclose(db);
-            return NULL;
+        for(uint32_t j = 0; j < num_vals && !r->failed; j++) {
+            uint32_t val_size = sread_u32(r);
+            const char *value = sread_bytes(r, val_size);
+            if(!value)
+                break;
+            dstring dvalue = dcreaten(value, val_size);
+            db->hm = hset(db->hm, dkey, docdict_add(db->docs, dvalue));
+            dfree(dvalue);
         }
+        dfree(dkey);
+    }
+}
 
-        if(!lzf_decompress(data, length, decompressed, original_size)) {
-            printf("Error decompressing DB file");
-            free(data);
-            free(decompressed);
-            fclose(db);
-            return NULL;
-        }
+static void sload_mode(struct database *db, uint32_t mode) {
+    if(mode != (uint32_t)db->mode) {
+        printf("Database file was indexed in another IndexMode, keeping the mode of the file.\n");
+        db->mode = mode;
+    }
+}
 
-        fclose(db);
+// The keys stay in the segment files and are only read when they are searched, just the document
+// names are copied to the heap
+static int sload_manifest(FILE *file, const char *path, struct database *db) {
+    uint32_t header[2];
+    uint32_t nsegments;
+    if(fread(header, sizeof(header), 1, file) != 1 ||
+       fread(&db->log_id, sizeof(db->log_id), 1, file) != 1 ||
+       fread(&db->log_offset, sizeof(db->log_offset), 1, file) != 1 ||
+       fread(&db->next_segment, sizeof(db->next_segment), 1, file) != 1 ||
+       fread(&nsegments, sizeof(nsegments), 1, file) != 1) {
+        fprintf(stderr, "%s is truncated. DB file will not be loaded.\n", path);
+        return -1;
+    }
+    sload_mode(db, header[1]);
 
-        FILE *tmp = tmpfile();
-        if(tmp == NULL) {
-            perror("Could not create tmpfile during sload_compressed. DB file will not be loaded.");
-            free(data);
-            free(decompressed);
-            return NULL;
+    for(uint32_t i = 0; i < nsegments; i++) {
+        uint64_t number;
+        struct segment *seg = NULL;
+        if(fread(&number, sizeof(number), 1, file) != 1 || !(seg = ssegment_open(path, number)) ||
+           segment_load_docs(seg, db->docs) == -1) {
+            fprintf(stderr, "Segment %u of %s is missing or damaged. DB file will not be "
+                    "loaded.\n", i, path);
+            segment_close(seg);
+            return -1;
         }
-        fwrite(decompressed, original_size, 1, tmp);
-        rewind(tmp);
-        free(data);
-        free(decompressed);
-        return tmp;
+        database_install(db, seg);
     }
-
-    return NULL;
+    return 0;
 }
 
-hashmap *sload(const char *path) {
-    hashmap *hmap = hcreate();
+struct database *sload(const char *path, int mode, int max_phrase_length) {
+    struct database *db = database_create(mode, max_phrase_length);
+    struct sreader r;
+    memset(&r, 0, sizeof(r));
 
-    FILE *db;
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
 
-    if((db = sload_compressed(path)) != NULL) {
-        uint32_t num_keys;
-        fread(&num_keys, sizeof(num_keys), 1, db);
-        for(int i = 0; i < num_keys; i++) {
-            uint32_t key_size;
-            fread(&key_size, sizeof(key_size), 1, db);
-            char key[key_size + 1];
-            key[key_size] = 0;
-            fread(key, key_size, 1, db);
-            uint32_t num_vals;
-            fread(&num_vals, sizeof(num_vals), 1, db);
+    FILE *db_file;
+    char head[8];
+    if(!(db_file = fopen(path, "rb"))) {
+        printf("No previous state found. Creating new database file.\n");
+        return db;
+    }
+    if(fread(head, sizeof(head), 1, db_file) != 1) {
+        long size = ftell(db_file);
+        fclose(db_file);
+        if(size == 0) {
+            printf("No previous state found. Creating new database file.\n");
+            return db;
+        }
+        fprintf(stderr, "%s is truncated. DB file will not be loaded.\n", path);
+        database_free(db);
+        return NULL;
+    }
 
-            for(int j = 0; j < num_vals; j++) {
-                uint32_t val_size;
-                fread(&val_size, sizeof(val_size), 1, db);
-                char value[val_size + 1];
-                value[val_size] = 0;
-                fread(value, val_size, 1, db);
-                hmap = hset(hmap, dcreate(key), dcreate(value));
-            }
+    if(!memcmp(head, SERIALIZER_MANIFEST_MAGIC, sizeof(head))) {
+        int rc = sload_manifest(db_file, path, db);
+        fclose(db_file);
+        // Starting from part of the segments would lose the rest at the next save, which writes a
+        // manifest of only what was loaded and truncates the command log
+        if(rc == -1) {
+            database_free(db);
+            return NULL;
         }
-        printf("Database file has been loaded. Previous state restored.\n");
-        fclose(db);
-    } else {
-        printf("No previous state found. Creating new database file.\n");
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        double seconds = (finished.tv_sec - started.tv_sec) +
+                         (finished.tv_nsec - started.tv_nsec) / 1000000000.0;
+        // The keys stay where they are mapped, only the documents are read in
+        uint64_t mapped = 0, read = 0;
+        for(uint32_t i = 0; i < db->nsegments; i++) {
+            mapped += db->segments[i]->size;
+            read += segment_docs_size(db->segments[i]);
+        }
+        printf("Database file has been loaded in %.3f seconds (%u segments, %.1f MB mapped, %.1f "
+               "MB/s read, %llu keys, %u documents). Previous state restored.\n",
+               seconds, db->nsegments, mapped / 1048576.0, read / 1048576.0 / MAX(seconds, 1e-9),
+               (unsigned long long)database_keys(db), db->docs->length);
+        return db;
     }
 
-    return hmap;
+    // Anything else is a file from before segments
+    uint64_t original_size;
+    memcpy(&original_size, head, sizeof(original_size));
+    if(sload_compressed(db_file, original_size, &r) == -1) {
+        fclose(db_file);
+        free((void *)r.raw);
+        database_free(db);
+        return NULL;
+    }
+    db->mode = INDEX_MODE_PHRASE;
+    sload_legacy(&r, db, sread_u32(&r));
+    free((void *)r.raw);
+    long size = ftell(db_file);
+    fclose(db_file);
+    // What was read is incomplete, and the first save would replace the file with it
+    if(r.failed) {
+        fprintf(stderr, "%s is truncated or damaged. DB file will not be loaded.\n", path);
+        database_free(db);
+        return NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double seconds = (finished.tv_sec - started.tv_sec) +
+                     (finished.tv_nsec - started.tv_nsec) / 1000000000.0;
+    printf("Database file has been loaded in %.2f seconds (%.1f MB/s read, %.1f MB/s "
+           "decompressed). Previous state restored.\n",
+           seconds, size / 1048576.0 / seconds, r.length / 1048576.0 / seconds);
+    return db;
 }
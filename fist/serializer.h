@@ -1,10 +1,42 @@
 #ifndef H_SERIALIZER
 #define H_SERIALIZER
 
+#include "database.h"
 #include "dstring.h"
-#include "hashmap.h"
+#include "segment.h"
 
-void sdump(const char *path, hashmap *hmap);
-hashmap *sload(const char *path);
+// The database file is a manifest listing the segments of the database, see segment.h, which are
+// kept next to it as <database file>.<number>. It starts with SERIALIZER_MANIFEST_MAGIC, then the
+// uint32 version and IndexMode, the uint64 command log id and offset, the uint64 number of the
+// next segment, the uint32 number of segments and the uint64 numbers of the segments, oldest
+// first. Saving writes only what changed since as a new segment and rewrites the manifest.
+//
+// Files from before segments are still loaded into memory and saved as a segment the next time.
+// They start with the payload size followed by the whole payload LZF compressed.
+#define SERIALIZER_MANIFEST_MAGIC "FISTMAN1"
+#define SERIALIZER_MANIFEST_VERSION 1
+
+dstring ssegment_path(const char *path, uint64_t number); // Path of a segment of the database
+// Opens the segment of the database at path with the given number, NULL if it is missing
+struct segment *ssegment_open(const char *path, uint64_t number);
+// Writes the frozen layer of db, or the active one if there is none, as the segment with the given
+// number, stamped with the command log mark. Returns -1 on failure with errno set, and prints
+// nothing so that a forked child can call it.
+int sflush(const char *path, struct database *db, uint64_t number, uint64_t log_id,
+           uint64_t log_offset);
+// Writes the merge of count consecutive segments of a database as the segment with the given
+// number. oldest tells whether segments[0] is the oldest segment of the database, tombstones are
+// dropped then. Only reads the segments, so it can run while the database changes.
+int smerge(const char *path, struct segment **segments, uint32_t count, int oldest,
+           uint64_t number);
+// Writes the manifest listing the segments of db. Returns -1 on failure.
+int smanifest(const char *path, struct database *db);
+void sremove(const char *path); // Deletes the database file and the segments it lists
+// Saves everything db holds now as a new segment and writes the manifest. Returns -1 on failure.
+int sdump(const char *path, struct database *db);
+// Loads the database at path, or returns an empty one. Segments are mapped rather than read,
+// older files are read into memory. A file keeps the IndexMode it was indexed with, mode is only
+// used for new databases. Returns NULL when the file, or a segment it lists, can't be read.
+struct database *sload(const char *path, int mode, int max_phrase_length);
 
 #endif
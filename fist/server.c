@@ -2,140 +2,628 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "bst.h"
+#include "cache.h"
+#include "cmdlog.h"
 #include "config.h"
+#include "database.h"
+#include "docdict.h"
 #include "dstring.h"
+#include "eventloop.h"
 #include "hashmap.h"
 #include "indexer.h"
+#include "linebuf.h"
+#include "outbuf.h"
+#include "query.h"
+#include "rank.h"
 #include "serializer.h"
 #include "server.h"
+#include "shardlock.h"
 #include "utils.h"
 #include "version.h"
 
-#define READ_MAX 1024
+#define READ_MIN 16384     // Free space offered to each recv()
+#define OUTPUT_BATCH 65536 // Replies queued up before they are written out in the middle of a read
+#define COMMAND_MAX 15
+#define EVENTS_MAX 256
 
 #define BYE "Bye\n"
 #define INDEXED "Text has been indexed\n"
 #define INVALID_COMMAND "Invalid command\n"
+#define INVALID_QUERY "Invalid query\n"
+#define INVALID_RANK_COUNT "The number of results must be between 1 and 10000\n"
 #define NOT_FOUND "[]\n"
 #define TOO_FEW_ARGUMENTS "Too few arguments\n"
 #define DELETED "Key Removed\n"
+#define DOCUMENT_DELETED "Document Removed\n"
+#define DOCUMENT_NOT_FOUND "Document not found\n"
+#define PHRASE_NOT_DELETED "Only single words can be deleted in positional mode\n"
+#define SAVED "Database saved\n"
+#define SAVE_FAILED "Saving the database failed\n"
+#define SAVE_IN_PROGRESS "Background save already in progress\n"
+#define BGSAVE_STARTED "Background saving started\n"
 
-typedef int (*command_handler_t)(struct config *config, hashmap *hm, int fd, dstringa params);
+struct connection_info
+{
+    struct linebuf input; // Unfinished command, empty between commands
+    struct outbuf output; // Replies the socket did not take yet
+    int closing;          // Close once output is written, nothing more is read
+};
+
+// State shared by every worker. SEARCH runs under a read lock of the worker's own shard, INDEX and
+// DELETE take the write lock, which serializes them against each other and every reader.
+struct server
+{
+    struct config *config;
+    struct database *db;
+    struct shardlock lock;
+    struct cmdlog *log; // NULL unless CommandLog is on
+    struct connection_info *connection_infos;
+    int dtablesize;
+    int stop_fds[2]; // Writing to stop_fds[1] wakes every worker up to exit
+
+    // Snapshots, guarded by save_lock, which is taken before lock
+    pthread_mutex_t save_lock;
+    pid_t save_pid;            // Child writing a background snapshot, 0 if there is none
+    uint64_t save_segment;     // Number of the segment save_pid writes
+    uint64_t save_log_id;      // Where the command log was when save_pid was forked
+    uint64_t save_log_offset;
+    double save_started;       // When save_pid was forked
+    double last_save_duration; // Seconds the last save took, until the child exited for BGSAVE
+    double last_fork_duration; // Seconds the last fork() kept writers out
+    time_t last_save_time;     // When the last successful save finished
+    int last_save_ok;
+    pthread_t merger; // Merges segments in the background, see database_merge_policy()
+    int merging;      // The merger is running
+    int merger_started;
+    int merge_stop; // Set on shutdown, no further merges are started
+    struct worker *workers;
+    int nworkers;
+};
+
+// A thread running its own event loop. Connections stay with the worker that accepted them.
+struct worker
+{
+    struct server *server;
+    int id; // Also the lock shard it reads under
+    int listen_fd;
+    struct event_loop *loop;
+    struct linebuf input; // Reads of connections without an unfinished command land here
+    uint64_t log_position; // Command log records the replies written next have to wait for
+    struct cache cache;    // SEARCH replies, only used by this worker
+    pthread_t thread;
+};
+
+// args is the normalized text after the command name, handlers may modify it in place
+typedef int (*command_handler_t)(struct worker *worker, struct connection_info *conn, char *args,
+                                 uint32_t length);
 
 static const int YES = 1;
 
-static int dirty = 0;
 static volatile int running = 1;
 static volatile int should_save = 0;
+static volatile int child_exited = 0;
 static struct bst_node *command_tree;
 
-struct connection_info
-{
-    dstring last_command;
-};
+static void reply(struct connection_info *conn, const char *text) {
+    outbuf_add(&conn->output, text, strlen(text));
+}
+
+// DELETE DOC <name>
+static int delete_document(struct worker *worker, struct connection_info *conn, char *name,
+                           uint32_t length) {
+    struct server *server = worker->server;
+    dstring document = dcreaten(name, length);
+    shardlock_wrlock(&server->lock);
+    int found = database_delete_document(server->db, document);
+    if(found && server->log)
+        worker->log_position =
+            cmdlog_append(server->log, CMDLOG_DELETE_DOCUMENT, name, length, NULL, 0);
+    shardlock_wrunlock(&server->lock);
+    dfree(document);
+    reply(conn, found ? DOCUMENT_DELETED : DOCUMENT_NOT_FOUND);
+    return 0;
+}
+
+static int do_delete(struct worker *worker, struct connection_info *conn, char *args,
+                  uint32_t length) {
+    struct server *server = worker->server;
+    if(length == 0) {
+        reply(conn, TOO_FEW_ARGUMENTS);
+        return 0;
+    }
+    if(length > 4 && !memcmp(args, "DOC ", 4))
+        return delete_document(worker, conn, args + 4, length - 4);
+
+    shardlock_wrlock(&server->lock);
+    int rc = database_delete(server->db, args, length);
+    if(rc == 0 && server->log)
+        worker->log_position = cmdlog_append(server->log, CMDLOG_DELETE, args, length, NULL, 0);
+    shardlock_wrunlock(&server->lock);
+    reply(conn, rc == 0 ? DELETED : PHRASE_NOT_DELETED);
+    return 0;
+}
+
+static int do_exit(struct worker *worker, struct connection_info *conn, char *args,
+                  uint32_t length) {
+    reply(conn, BYE);
+    return 1;
+}
 
-static int do_delete(hashmap *hm, int fd, dstringa params) {
-    if(params.length < 2) {
-        send(fd, TOO_FEW_ARGUMENTS, strlen(TOO_FEW_ARGUMENTS), 0);
+// INDEX and REINDEX, which first removes everything indexed under the name
+static int index_document(struct worker *worker, struct connection_info *conn, char *args,
+                          uint32_t length, int reindex) {
+    struct server *server = worker->server;
+    uint32_t offset = 0;
+    struct span name;
+    if(!tnext(args, length, &offset, &name) || offset == length) {
+        reply(conn, TOO_FEW_ARGUMENTS);
         return 0;
     }
+    dstring document = dcreaten(name.text, name.length);
+    char *text = args + offset + 1;
+    uint32_t text_length = length - offset - 1;
+    shardlock_wrlock(&server->lock);
+    if(server->log)
+        worker->log_position =
+            cmdlog_append(server->log, reindex ? CMDLOG_REINDEX : CMDLOG_INDEX, name.text,
+                          name.length, text, text_length);
+    int keys = reindex ? database_reindex(server->db, document, text, text_length)
+                       : database_index(server->db, document, text, text_length);
+    shardlock_wrunlock(&server->lock);
+    printf("INDEX SIZE: %d\n", keys);
+    dfree(document);
+    reply(conn, INDEXED);
+    return 0;
+}
+
+static int do_index(struct worker *worker, struct connection_info *conn, char *args,
+                    uint32_t length) {
+    return index_document(worker, conn, args, length, 0);
+}
+
+static int do_reindex(struct worker *worker, struct connection_info *conn, char *args,
+                      uint32_t length) {
+    return index_document(worker, conn, args, length, 1);
+}
 
-    dstring key = dempty();
-    for(int i = 1; i < params.length; i++) {
-        key = dappend(key, dtext(params.values[i]));
-        key = dappendc(key, ' ');
+// The names of the documents as a JSON array, frees ids. Called under the read lock the ids were
+// found under. The length of the reply is added up first, so it is written in one allocation.
+static struct outshared *render_documents(struct server *server, uint32_t *ids, uint32_t count) {
+    if(count == 0) {
+        free(ids);
+        struct outshared *output = outshared_create(strlen(NOT_FOUND));
+        memcpy(output->data, NOT_FOUND, output->length);
+        return output;
     }
+    uint32_t length = 3 * count + 2; // Quotes and a comma for each name, the brackets and newline
+    for(uint32_t i = 0; i < count; i++) {
+        length += docdict_name(server->db->docs, ids[i])->length;
+    }
+    struct outshared *output = outshared_create(length);
+    char *out = output->data;
+    *out++ = '[';
+    for(uint32_t i = 0; i < count; i++) {
+        const istring *on = docdict_name(server->db->docs, ids[i]);
+        *out++ = '"';
+        memcpy(out, itext(on), on->length);
+        out += on->length;
+        *out++ = '"';
+        *out++ = ',';
+    }
+    free(ids);
+    out[-1] = ']';
+    *out = '\n';
+    return output;
+}
 
-    key = dtrim(key);
-    hdel(hm, key);
-    dirty = 1;
-    send(fd, DELETED, strlen(DELETED), 0);
+static void reply_documents(struct server *server, struct connection_info *conn, uint32_t *ids,
+                            uint32_t count) {
+    struct outshared *output = render_documents(server, ids, count);
+    outbuf_add_shared(&conn->output, output);
+    outshared_release(output);
+}
+
+static int do_search(struct worker *worker, struct connection_info *conn, char *args,
+                  uint32_t length) {
+    struct server *server = worker->server;
+    if(length == 0) {
+        reply(conn, TOO_FEW_ARGUMENTS);
+        return 0;
+    }
+    uint32_t *ids;
+    shardlock_rdlock(&server->lock, worker->id);
+    // A cached reply is sent as long as no write since touched the keys the search reads
+    uint64_t generation = 0;
+    if(worker->cache.capacity) {
+        generation = database_generation(server->db, args, length);
+        struct outshared *cached = cache_get(&worker->cache, args, length, generation);
+        if(cached) {
+            outbuf_add_shared(&conn->output, cached);
+            shardlock_rdunlock(&server->lock, worker->id);
+            return 0;
+        }
+    }
+    uint32_t count = database_search(server->db, args, length, &ids);
+    struct outshared *output = render_documents(server, ids, count);
+    cache_put(&worker->cache, args, length, generation, output);
+    outbuf_add_shared(&conn->output, output);
+    outshared_release(output);
+    shardlock_rdunlock(&server->lock, worker->id);
     return 0;
 }
 
-static int do_exit(hashmap *hm, int fd, dstringa params) {
-    send(fd, BYE, strlen(BYE), 0);
-    return 1;
+static int do_query(struct worker *worker, struct connection_info *conn, char *args,
+                    uint32_t length) {
+    struct server *server = worker->server;
+    struct query query;
+    if(length == 0) {
+        reply(conn, TOO_FEW_ARGUMENTS);
+        return 0;
+    }
+    if(query_parse(&query, args, length) == -1) {
+        reply(conn, INVALID_QUERY);
+        return 0;
+    }
+    uint32_t *ids;
+    shardlock_rdlock(&server->lock, worker->id);
+    uint32_t count = query_run(&query, server->db, &ids);
+    reply_documents(server, conn, ids, count);
+    shardlock_rdunlock(&server->lock, worker->id);
+    query_free(&query);
+    return 0;
 }
 
-static int do_index(struct config *config, hashmap *hm, int fd, dstringa params) {
-    if(params.length < 3) {
-        send(fd, TOO_FEW_ARGUMENTS, strlen(TOO_FEW_ARGUMENTS), 0);
+// RANK <k> <words>
+static int do_rank(struct worker *worker, struct connection_info *conn, char *args,
+                   uint32_t length) {
+    struct server *server = worker->server;
+    uint32_t offset = 0;
+    struct span count;
+    if(!tnext(args, length, &offset, &count) || offset == length) {
+        reply(conn, TOO_FEW_ARGUMENTS);
         return 0;
     }
-    dstring document = params.values[1];
-    dstring text = djoin(drange(params, 2, params.length), ' ');
-    dstringa index = indexer(text, config->max_phrase_length);
-    printf("INDEX SIZE: %d\n", index.length);
-    for(int i = 0; i < index.length; i++) {
-        dstring on = index.values[i];
-        hm = hset(hm, on, document);
+    uint32_t k = 0;
+    for(uint32_t i = 0; i < count.length && k <= RANK_MAX; i++) {
+        if(count.text[i] < '0' || count.text[i] > '9') {
+            k = 0;
+            break;
+        }
+        k = k * 10 + count.text[i] - '0';
+    }
+    if(k == 0 || k > RANK_MAX) {
+        reply(conn, INVALID_RANK_COUNT);
+        return 0;
     }
-    dirty = 1;
-    send(fd, INDEXED, strlen(INDEXED), 0);
+    uint32_t *ids;
+    shardlock_rdlock(&server->lock, worker->id);
+    uint32_t found = rank_search(server->db, args + offset + 1, length - offset - 1, k, &ids);
+    reply_documents(server, conn, ids, found);
+    shardlock_rdunlock(&server->lock, worker->id);
     return 0;
 }
 
-static int do_search(struct config *config, hashmap *hm, int fd, dstringa params) {
-    if(params.length < 2) {
-        send(fd, TOO_FEW_ARGUMENTS, strlen(TOO_FEW_ARGUMENTS), 0);
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Maps the segment a snapshot was just written to, puts it in place of the frozen layer it holds
+// and lists it in the database file. Called under save_lock. Returns -1 on failure, the layer is
+// then kept if the segment could not be mapped.
+static int install_segment(struct server *server, uint64_t number, uint64_t log_id,
+                           uint64_t log_offset) {
+    const char *path = dtext(server->config->db_path);
+    struct segment *seg = ssegment_open(path, number);
+    if(!seg)
+        return -1;
+    shardlock_wrlock(&server->lock);
+    database_install(server->db, seg);
+    server->db->log_id = log_id;
+    server->db->log_offset = log_offset;
+    shardlock_wrunlock(&server->lock);
+    return smanifest(path, server->db);
+}
+
+// Merges segments as long as the merge policy finds some. The segments are only read, so the
+// merge runs without locks, save_lock is only taken to pick the segments and to swap in the
+// result. Flushes meanwhile only append segments, so the merged ones stay in place.
+static void *merge_run(void *arg) {
+    struct server *server = arg;
+    const char *path = dtext(server->config->db_path);
+    uint32_t first, count;
+    pthread_mutex_lock(&server->save_lock);
+    while(!server->merge_stop && database_merge_policy(server->db, &first, &count)) {
+        struct segment **merged = malloc(sizeof(struct segment *) * count);
+        memcpy(merged, &server->db->segments[first], sizeof(struct segment *) * count);
+        uint64_t number = server->db->next_segment++;
+        pthread_mutex_unlock(&server->save_lock);
+
+        double started = now_seconds();
+        struct segment *seg = NULL;
+        if(smerge(path, merged, count, first == 0, number) == 0)
+            seg = ssegment_open(path, number);
+
+        pthread_mutex_lock(&server->save_lock);
+        if(!seg) {
+            free(merged);
+            break;
+        }
+        shardlock_wrlock(&server->lock);
+        database_replace(server->db, first, count, seg);
+        shardlock_wrunlock(&server->lock);
+        // The merged files are still listed until the manifest was replaced
+        int listed = smanifest(path, server->db) == -1;
+        for(uint32_t i = 0; i < count; i++) {
+            if(!listed) {
+                dstring segment_path = ssegment_path(path, merged[i]->number);
+                unlink(dtext(segment_path));
+                dfree(segment_path);
+            }
+            segment_close(merged[i]);
+        }
+        free(merged);
+        printf("Merged %u segments in %.3f seconds\n", count, now_seconds() - started);
+    }
+    server->merging = 0;
+    pthread_mutex_unlock(&server->save_lock);
+    return NULL;
+}
+
+// Starts the merger if the segments need merging and it is not running. Called under save_lock.
+static void start_merge(struct server *server) {
+    uint32_t first, count;
+    if(server->merging || server->merge_stop ||
+       !database_merge_policy(server->db, &first, &count))
+        return;
+    // A merger that stopped has already given up save_lock, joining it cannot block for long
+    if(server->merger_started)
+        pthread_join(server->merger, NULL);
+    server->merger_started = 0;
+    if(pthread_create(&server->merger, NULL, merge_run, server)) {
+        perror("pthread_create");
+        return;
+    }
+    server->merging = 1;
+    server->merger_started = 1;
+}
+
+// Saves in the calling thread, under save_lock. The changes so far are frozen and written as a
+// new segment while searches keep running. A write can get in between the freeze and the read
+// lock sflush() is called under, so the segment is written from what database_freeze() kept and
+// holds nothing past the mark of the command log. The command log then only keeps what comes
+// after the snapshot. Returns -1 on failure.
+static int save(struct server *server, int shard) {
+    const char *path = dtext(server->config->db_path);
+    uint64_t log_id = 0, log_offset = 0;
+    shardlock_wrlock(&server->lock);
+    if(!database_unsaved(server->db)) {
+        shardlock_wrunlock(&server->lock);
         return 0;
     }
-    dstring text = djoin(drange(params, 1, params.length), ' ');
-    dstringa value = hget(hm, text);
-    if(value.length == 0) {
-        send(fd, NOT_FOUND, strlen(NOT_FOUND), 0);
+    database_freeze(server->db);
+    if(server->log)
+        cmdlog_mark(server->log, &log_id, &log_offset);
+    uint64_t number = server->db->next_segment++;
+    shardlock_wrunlock(&server->lock);
+
+    shardlock_rdlock(&server->lock, shard);
+    int rc = sflush(path, server->db, number, log_id, log_offset);
+    shardlock_rdunlock(&server->lock, shard);
+    if(rc == -1)
+        perror("Could not write a segment. DB file will not be saved");
+    if(rc == -1 || install_segment(server, number, log_id, log_offset) == -1)
+        return -1;
+    if(server->log)
+        cmdlog_rewrite(server->log, log_offset);
+    start_merge(server);
+    return 0;
+}
+
+// Forks a child that writes a snapshot from its copy-on-write image of the database while the
+// server keeps serving. The main thread reaps it. Returns 1 if the child was started, 0 if a
+// snapshot is already being written or there is nothing to save, -1 if fork() failed.
+static int bgsave(struct server *server, int only_if_dirty) {
+    int rc = 1;
+    pthread_mutex_lock(&server->save_lock);
+    if(server->save_pid) {
+        pthread_mutex_unlock(&server->save_lock);
         return 0;
     }
-    dstring output = dcreate("[");
-    for(int i = 0; i < value.length; i++) {
-        dstring on = value.values[i];
-        output = dappendc(output, '"');
-        output = dappendd(output, on);
-        output = dappendc(output, '"');
-        if(i != value.length - 1) {
-            output = dappendc(output, ',');
+
+    // The write lock keeps every worker out while the changes so far are frozen, so the child
+    // gets a database no command is changing. The child writes the frozen layer as a segment.
+    shardlock_wrlock(&server->lock);
+    if(only_if_dirty && !database_unsaved(server->db)) {
+        rc = 0;
+    } else {
+        // The snapshot holds every command logged so far
+        database_freeze(server->db);
+        server->save_log_id = server->save_log_offset = 0;
+        if(server->log)
+            cmdlog_mark(server->log, &server->save_log_id, &server->save_log_offset);
+        server->save_segment = server->db->next_segment++;
+        double started = now_seconds();
+        pid_t pid = fork();
+        if(pid == 0) {
+            // Only this thread goes on in the child, locks the merge thread, the command log
+            // thread or a worker outside the write lock held stay held. glibc takes its malloc
+            // and stdio locks across fork() and resets them in the child, which is all sflush()
+            // takes: it allocates and writes through a FILE of its own. It prints nothing, what
+            // failed is passed as the exit status and printed by reap_bgsave().
+            int failed = sflush(dtext(server->config->db_path), server->db, server->save_segment,
+                                server->save_log_id, server->save_log_offset) == -1;
+            _exit(failed ? (errno ? errno : EIO) : 0);
+        }
+        if(pid == -1) {
+            perror("fork");
+            rc = -1;
+        } else {
+            server->save_pid = pid;
+            server->save_started = started;
+            server->last_fork_duration = now_seconds() - started;
         }
     }
-    output = dappendc(output, ']');
-    output = dappendc(output, '\n');
-    send(fd, dtext(output), output.length, 0);
+    shardlock_wrunlock(&server->lock);
+    pthread_mutex_unlock(&server->save_lock);
+    return rc;
+}
+
+// Collects the background save child if it exited. With block set, waits for it to exit.
+static void reap_bgsave(struct server *server, int block) {
+    int status;
+    pthread_mutex_lock(&server->save_lock);
+    if(server->save_pid && waitpid(server->save_pid, &status, block ? 0 : WNOHANG) > 0) {
+        server->last_save_duration = now_seconds() - server->save_started;
+        server->last_save_ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        server->save_pid = 0;
+        if(server->last_save_ok && install_segment(server, server->save_segment,
+                                                   server->save_log_id,
+                                                   server->save_log_offset) == -1)
+            server->last_save_ok = 0;
+        if(server->last_save_ok) {
+            server->last_save_time = time(NULL);
+            if(server->log)
+                cmdlog_rewrite(server->log, server->save_log_offset);
+            start_merge(server);
+        }
+        printf("Background save %s after %.3f seconds\n", server->last_save_ok ? "done" : "failed",
+               server->last_save_duration);
+        if(WIFEXITED(status) && WEXITSTATUS(status))
+            fprintf(stderr, "Could not write a segment: %s. DB file will not be saved.\n",
+                    strerror(WEXITSTATUS(status)));
+        else if(WIFSIGNALED(status))
+            fprintf(stderr, "Background save killed by signal %d\n", WTERMSIG(status));
+    }
+    pthread_mutex_unlock(&server->save_lock);
+}
+
+static int do_bgsave(struct worker *worker, struct connection_info *conn, char *args,
+                     uint32_t length) {
+    switch(bgsave(worker->server, 0)) {
+    case 1:
+        reply(conn, BGSAVE_STARTED);
+        break;
+    case 0:
+        reply(conn, SAVE_IN_PROGRESS);
+        break;
+    default:
+        reply(conn, SAVE_FAILED);
+        break;
+    }
+    return 0;
+}
+
+// Saves in the foreground. Searches keep running, INDEX and DELETE wait until it is done.
+static int do_save(struct worker *worker, struct connection_info *conn, char *args,
+                   uint32_t length) {
+    struct server *server = worker->server;
+    pthread_mutex_lock(&server->save_lock);
+    if(server->save_pid) {
+        pthread_mutex_unlock(&server->save_lock);
+        reply(conn, SAVE_IN_PROGRESS);
+        return 0;
+    }
+
+    double started = now_seconds();
+    server->last_save_ok = save(server, worker->id) == 0;
+    server->last_save_duration = now_seconds() - started;
+    if(server->last_save_ok)
+        server->last_save_time = time(NULL);
+    int ok = server->last_save_ok;
+    pthread_mutex_unlock(&server->save_lock);
+
+    reply(conn, ok ? SAVED : SAVE_FAILED);
+    return 0;
+}
+
+static int do_stats(struct worker *worker, struct connection_info *conn, char *args,
+                    uint32_t length) {
+    struct server *server = worker->server;
+    char output[1024];
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+    for(int i = 0; i < server->nworkers; i++) {
+        uint64_t hits, misses;
+        cache_stats(&server->workers[i].cache, &hits, &misses);
+        cache_hits += hits;
+        cache_misses += misses;
+    }
+
+    pthread_mutex_lock(&server->save_lock);
+    shardlock_rdlock(&server->lock, worker->id);
+    uint64_t memory_used, memory_reserved;
+    database_memory(server->db, &memory_used, &memory_reserved);
+    snprintf(output, sizeof(output),
+             "{\"documents\":%u,\"deleted_documents\":%u,\"keys\":%llu,\"delta_keys\":%llu,"
+             "\"segments\":%u,"
+             "\"merge_in_progress\":%d,\"dirty\":%d,\"bgsave_in_progress\":%d,"
+             "\"last_save_time\":%lld,\"last_save_ok\":%d,\"last_save_duration\":%.6f,"
+             "\"last_fork_duration\":%.6f,\"search_cache_hits\":%llu,"
+             "\"search_cache_misses\":%llu,\"memory_used\":%llu,\"memory_reserved\":%llu}\n",
+             server->db->docs->length - server->db->docs->nremoved, server->db->docs->nremoved,
+             (unsigned long long)database_keys(server->db),
+             (unsigned long long)database_delta_keys(server->db), server->db->nsegments,
+             server->merging, database_unsaved(server->db),
+             server->save_pid != 0, (long long)server->last_save_time, server->last_save_ok,
+             server->last_save_duration, server->last_fork_duration,
+             (unsigned long long)cache_hits, (unsigned long long)cache_misses,
+             (unsigned long long)memory_used, (unsigned long long)memory_reserved);
+    shardlock_rdunlock(&server->lock, worker->id);
+    pthread_mutex_unlock(&server->save_lock);
+
+    reply(conn, output);
     return 0;
 }
 
-static int do_version(struct config *config, hashmap *hm, int fd, dstringa params) {
+static int do_version(struct worker *worker, struct connection_info *conn, char *args,
+                  uint32_t length) {
     dstring output = dcreate(VERSION);
     output = dappendc(output, '\n');
-    send(fd, dtext(output), output.length, 0);
+    outbuf_add_dstring(&conn->output, output);
     return 0;
 }
 
-static int process_command(struct config *config, hashmap *hm, int fd, dstring req) {
-    dstringa commands;
-    dstring trimmed;
-    command_handler_t handler;
+// Runs one command line, which is parsed in place. Returns 1 if the connection should be closed.
+static int process_command(struct worker *worker, struct connection_info *conn, char *line,
+                           uint32_t length) {
+    char name[COMMAND_MAX + 1];
+    struct span command;
+    command_handler_t handler = NULL;
+    uint32_t offset = 0;
 
-    trimmed = dtrim(req);
-    commands = dsplit(trimmed, ' ');
-    printf("%d '%s'\n", req.length, dtext(trimmed));
+    length = tnormalize(line, length);
+    printf("%u '%.*s'\n", length, (int)length, line);
 
-    handler = (command_handler_t)bst_search(command_tree, dtext(commands.values[0]));
+    if(tnext(line, length, &offset, &command) && command.length <= COMMAND_MAX) {
+        memcpy(name, command.text, command.length);
+        name[command.length] = '\0';
+        handler = (command_handler_t)bst_search(command_tree, name);
+    }
     if(!handler) {
-        send(fd, INVALID_COMMAND, strlen(INVALID_COMMAND), 0);
+        reply(conn, INVALID_COMMAND);
         return 0;
     }
 
-    return handler(config, hm, fd, commands);
+    // Skip the space after the command name
+    if(offset < length)
+        offset++;
+    return handler(worker, conn, line + offset, length - offset);
 }
 
 static void sighandler_alarm(int signum) {
@@ -146,6 +634,10 @@ static void sighandler_int(int signum) {
     running = 0;
 }
 
+static void sighandler_chld(int signum) {
+    child_exited = 1;
+}
+
 static void install_sighandlers(struct config *config) {
     struct sigaction sa_int;
     sa_int.sa_flags = 0;
@@ -154,6 +646,20 @@ static void install_sighandlers(struct config *config) {
     sigaddset(&(sa_int.sa_mask), SIGINT);
     sigaction(SIGINT, &sa_int, NULL);
 
+    // Writing to a connection the client closed fails with EPIPE instead
+    struct sigaction sa_pipe;
+    sa_pipe.sa_flags = 0;
+    sa_pipe.sa_handler = SIG_IGN;
+    sigemptyset(&(sa_pipe.sa_mask));
+    sigaction(SIGPIPE, &sa_pipe, NULL);
+
+    // Lets the main thread know a background save finished
+    struct sigaction sa_chld;
+    sa_chld.sa_flags = SA_NOCLDSTOP;
+    sa_chld.sa_handler = sighandler_chld;
+    sigemptyset(&(sa_chld.sa_mask));
+    sigaction(SIGCHLD, &sa_chld, NULL);
+
     if(config->save_period > 0) {
         struct sigaction sa_alrm;
         sa_alrm.sa_flags = 0;
@@ -165,155 +671,414 @@ static void install_sighandlers(struct config *config) {
     }
 }
 
-int start_server(struct config *config) {
-    char buf[READ_MAX];
-    struct sockaddr_in client_addr;
-    struct connection_info *connection_infos;
-    int dtablesize;
-    int fd_max;
-    hashmap *hm;
-    fd_set master_fds;
-    fd_set copy_fds;
-    int rc = 0;
-    struct sockaddr_in server_addr;
-    int server_fd;
+// Lets the server hold as many connections as the hard limit allows instead of the usual soft
+// limit of 1024
+static void raise_fd_limit() {
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        perror("getrlimit");
+        return;
+    }
+    if(limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if(setrlimit(RLIMIT_NOFILE, &limit) == -1)
+            perror("setrlimit");
+    }
+}
 
-    command_tree = NULL;
-    // not a self balancing tree, be mindful of the order
-    bst_insert(&command_tree, "INDEX", do_index);
-    bst_insert(&command_tree, "EXIT", do_exit);
-    bst_insert(&command_tree, "SEARCH", do_search);
-    bst_insert(&command_tree, "DELETE", do_delete);
-    bst_insert(&command_tree, "VERSION", do_version);
+// The buffers are dropped before the descriptor is closed. Once it is, another worker can accept
+// a connection with the same number and must not find replies meant for this one.
+static void close_connection(struct worker *worker, int fd) {
+    struct connection_info *conn = &worker->server->connection_infos[fd];
+    event_loop_del(worker->loop, fd);
+    linebuf_free(&conn->input);
+    outbuf_free(&conn->output);
+    conn->closing = 0;
+    close(fd);
+}
 
-    dtablesize = getdtablesize();
-    connection_infos = calloc(dtablesize, sizeof(struct connection_info));
+// Accepts every pending connection, the listening socket is non-blocking. When workers share a
+// listening socket the others find nothing left to accept.
+static void accept_connections(struct worker *worker) {
+    struct server *server = worker->server;
+    for(;;) {
+        struct sockaddr_in client_addr;
+        socklen_t addrlen = sizeof(struct sockaddr_in);
+        int new_fd = accept(worker->listen_fd, (struct sockaddr *)&client_addr, &addrlen);
+        if(new_fd == -1) {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
+        }
+        if(new_fd >= server->dtablesize ||
+           fcntl(new_fd, F_SETFL, fcntl(new_fd, F_GETFL) | O_NONBLOCK) == -1 ||
+           event_loop_add(worker->loop, new_fd) == -1) {
+            close(new_fd);
+            continue;
+        }
+    }
+}
 
-    install_sighandlers(config);
+// Replies may only be written once the command log holds the commands they answer. Committing
+// once for everything the worker ran since the last time lets the log write and flush them
+// together, along with what other workers logged meanwhile. Returns -1 if the log could not be
+// written, the position is kept then so the replies waiting for it are never sent.
+static int commit_log(struct worker *worker) {
+    if(!worker->log_position)
+        return 0;
+    if(cmdlog_commit(worker->server->log, worker->log_position) == -1)
+        return -1;
+    worker->log_position = 0;
+    return 0;
+}
+
+// Reads everything the client sent and runs each complete command in order. Their replies are
+// queued up and written out together by the caller, or as soon as OUTPUT_BATCH bytes are waiting.
+// When the socket does not take them, the remaining commands wait in the connection's buffer and
+// nothing more is read until it is writable again. Returns 1 if the connection failed.
+static int read_connection(struct worker *worker, int fd, struct connection_info *conn) {
+    struct linebuf *pending = &conn->input;
+    // Commands left over from when the replies backed up run first
+    struct linebuf *lb = pending;
+    for(;;) {
+        char *line;
+        uint32_t length;
+        int backed_up = 0;
+        while(!conn->closing && linebuf_next(lb, &line, &length)) {
+            conn->closing = process_command(worker, conn, line, length);
+            if(outbuf_pending(&conn->output) >= OUTPUT_BATCH) {
+                backed_up = 1;
+                break;
+            }
+        }
+        if(conn->closing)
+            linebuf_clear(lb);
+        else if(lb == &worker->input)
+            linebuf_move(pending, lb);
+        else if(!linebuf_pending(pending))
+            linebuf_free(pending);
+
+        if(conn->closing)
+            return 0;
+        if(backed_up) {
+            if(commit_log(worker) == -1 || outbuf_flush(&conn->output, fd) == -1)
+                return 1;
+            if(outbuf_pending(&conn->output))
+                return 0;
+            lb = pending;
+            continue;
+        }
+
+        // Only a connection in the middle of a command needs a buffer of its own, so idle
+        // connections hold no memory
+        lb = linebuf_pending(pending) ? pending : &worker->input;
+        uint32_t available;
+        char *space = linebuf_space(lb, READ_MIN, &available);
+        int nbytes;
+        while((nbytes = recv(fd, space, available, 0)) < 0 && errno == EINTR)
+            ;
+        if(nbytes == 0) {
+            conn->closing = 1;
+            return 0;
+        }
+        if(nbytes < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            perror("recv");
+            return 1;
+        }
+        linebuf_commit(lb, nbytes);
+    }
+}
+
+// Handles a connection reported ready by the event loop. Backed up replies go first, reading
+// resumes once they are written. Returns 0 if the connection was closed, otherwise the new replies
+// are left for finish_connection().
+static int serve_connection(struct worker *worker, int fd) {
+    struct connection_info *conn = &worker->server->connection_infos[fd];
+    if(outbuf_flush(&conn->output, fd) == -1 || read_connection(worker, fd, conn)) {
+        close_connection(worker, fd);
+        return 0;
+    }
+    return 1;
+}
+
+// Writes everything the commands replied with as few writev() calls as the socket allows
+static void finish_connection(struct worker *worker, int fd) {
+    struct connection_info *conn = &worker->server->connection_infos[fd];
+    int limit = worker->server->config->output_limit;
+
+    if(outbuf_flush(&conn->output, fd) == -1) {
+        close_connection(worker, fd);
+        return;
+    }
+
+    uint64_t pending = outbuf_pending(&conn->output);
+    if(limit > 0 && pending > (uint64_t)limit) {
+        fprintf(stderr, "Closing connection %d, %llu bytes of replies are over OutputLimit\n", fd,
+                (unsigned long long)pending);
+        close_connection(worker, fd);
+    } else if(conn->closing && !pending) {
+        close_connection(worker, fd);
+    } else {
+        event_loop_want_write(worker->loop, fd, pending > 0);
+    }
+}
+
+static void *worker_run(void *arg) {
+    struct worker *worker = arg;
+    int stop_fd = worker->server->stop_fds[0];
+    int ready[EVENTS_MAX];
+
+    for(;;) {
+        int nready = event_loop_wait(worker->loop, ready, EVENTS_MAX);
+        int nserved = 0;
+        for(int i = 0; i < nready; i++) {
+            int fd = ready[i];
+            if(fd == stop_fd) {
+                return NULL;
+            } else if(fd == worker->listen_fd) {
+                accept_connections(worker);
+            } else if(serve_connection(worker, fd)) {
+                ready[nserved++] = fd;
+            }
+        }
+
+        // Every command of this wake-up is logged with one commit before any of them is answered.
+        // When the log can't be written the connections are closed, their replies could
+        // acknowledge writes that are lost on a restart.
+        if(commit_log(worker) == -1) {
+            worker->log_position = 0;
+            for(int i = 0; i < nserved; i++)
+                close_connection(worker, ready[i]);
+            continue;
+        }
+        for(int i = 0; i < nserved; i++)
+            finish_connection(worker, ready[i]);
+    }
+}
 
-    hm = sload(dtext(
-        config->db_path)); // Loads database file if it exists, otherwise returns an empty hash map
+// Creates a non-blocking listening socket. With reuseport every worker gets its own socket on the
+// same address and the kernel spreads new connections over them.
+static int open_listener(struct config *config, int reuseport) {
+    struct sockaddr_in server_addr;
+    int server_fd;
 
-    FD_ZERO(&copy_fds);
-    FD_ZERO(&master_fds);
-    memset(buf, 0, READ_MAX);
-    memset(&client_addr, 0, sizeof(struct sockaddr_in));
     memset(&server_addr, 0, sizeof(struct sockaddr_in));
 
     if((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
         perror("socket");
-        rc = -1;
-        goto exit;
+        return -1;
     }
 
     if(setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &YES, sizeof(int)) == -1) {
         perror("setsockopt");
-        rc = -1;
-        goto exit;
+        goto error;
     }
 
+#ifdef SO_REUSEPORT
+    if(reuseport && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &YES, sizeof(int)) == -1) {
+        perror("setsockopt");
+        goto error;
+    }
+#endif
+
     // TODO: respect host parameter
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
     if(!inet_aton(dtext(config->host), &server_addr.sin_addr)) {
         perror("inet_aton");
-        rc = -1;
-        goto exit;
+        goto error;
     }
     server_addr.sin_port = htons(config->port);
     if(bind(server_fd, (struct sockaddr *)&server_addr, sizeof(struct sockaddr_in)) == -1) {
         perror("bind");
-        rc = -1;
-        goto exit;
+        goto error;
     }
 
     if(listen(server_fd, config->so_backlog) == -1) {
         perror("listen");
+        goto error;
+    }
+
+    if(fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        goto error;
+    }
+    return server_fd;
+
+error:
+    close(server_fd);
+    return -1;
+}
+
+int start_server(struct config *config) {
+    struct server server;
+    struct worker *workers;
+    int nworkers = config->workers;
+    int started = 0;
+    int rc = 0;
+    int reuseport = 0;
+    sigset_t blocked, unblocked;
+
+    if(nworkers <= 0)
+        nworkers = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+#ifdef SO_REUSEPORT
+    reuseport = 1;
+#endif
+
+    command_tree = NULL;
+    // not a self balancing tree, be mindful of the order
+    bst_insert(&command_tree, "INDEX", do_index);
+    bst_insert(&command_tree, "EXIT", do_exit);
+    bst_insert(&command_tree, "SEARCH", do_search);
+    bst_insert(&command_tree, "QUERY", do_query);
+    bst_insert(&command_tree, "RANK", do_rank);
+    bst_insert(&command_tree, "DELETE", do_delete);
+    bst_insert(&command_tree, "REINDEX", do_reindex);
+    bst_insert(&command_tree, "VERSION", do_version);
+    bst_insert(&command_tree, "BGSAVE", do_bgsave);
+    bst_insert(&command_tree, "SAVE", do_save);
+    bst_insert(&command_tree, "STATS", do_stats);
+
+    memset(&server, 0, sizeof(server));
+    pthread_mutex_init(&server.save_lock, NULL);
+    server.config = config;
+    server.stop_fds[0] = server.stop_fds[1] = -1;
+    raise_fd_limit();
+    server.dtablesize = getdtablesize();
+    server.connection_infos = calloc(server.dtablesize, sizeof(struct connection_info));
+    workers = calloc(nworkers, sizeof(struct worker));
+    for(int i = 0; i < nworkers; i++) {
+        workers[i].listen_fd = -1;
+        cache_init(&workers[i].cache, MAX(config->search_cache, 0));
+    }
+    server.workers = workers;
+    server.nworkers = nworkers;
+
+    // Only the main thread handles signals, the workers inherit the blocked mask
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGALRM);
+    sigaddset(&blocked, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &blocked, &unblocked);
+    install_sighandlers(config);
+
+    // Loads database file if it exists, otherwise returns an empty database
+    server.db = sload(dtext(config->db_path), config->index_mode, config->max_phrase_length);
+    if(!server.db) {
         rc = -1;
         goto exit;
     }
 
-    printf("Fist started at %s:%d\n", inet_ntoa(server_addr.sin_addr), config->port);
+    // Then runs the commands that came after the snapshot
+    if(config->command_log) {
+        dstring log_path = dappend(dcreate(dtext(config->db_path)), ".log");
+        server.log = cmdlog_open(dtext(log_path), config->command_log_fsync, server.db);
+        dfree(log_path);
+        if(!server.log) {
+            rc = -1;
+            goto exit;
+        }
+        printf("Replayed %u commands from the command log\n", cmdlog_replay(server.log, server.db));
+    }
 
-    FD_SET(server_fd, &master_fds);
-    fd_max = server_fd;
+    if(shardlock_init(&server.lock, nworkers) == -1) {
+        rc = -1;
+        goto exit;
+    }
 
-    while(running) {
-        int i;
+    if(pipe(server.stop_fds) == -1) {
+        perror("pipe");
+        rc = -1;
+        goto exit;
+    }
 
-        if(should_save) {
-            should_save = 0;
-            if(dirty) {
-                dirty = 0;
-                // puts("Saving db...");
-                sdump(dtext(config->db_path), hm);
-            }
-            alarm(config->save_period);
+    for(int i = 0; i < nworkers; i++) {
+        struct worker *worker = &workers[i];
+        worker->server = &server;
+        worker->id = i;
+        if(i == 0 || reuseport)
+            worker->listen_fd = open_listener(config, reuseport);
+        else
+            worker->listen_fd = workers[0].listen_fd;
+        if(worker->listen_fd == -1 || !(worker->loop = event_loop_create(config->event_backend)) ||
+           event_loop_add(worker->loop, worker->listen_fd) == -1 ||
+           event_loop_add(worker->loop, server.stop_fds[0]) == -1) {
+            rc = -1;
+            goto exit;
         }
+    }
 
-        copy_fds = master_fds;
-
-        if(select(fd_max + 1, &copy_fds, NULL, NULL, NULL) == -1) {
-            if(errno != EINTR)
-                perror("select");
-            continue;
+    for(; started < nworkers; started++) {
+        if(pthread_create(&workers[started].thread, NULL, worker_run, &workers[started])) {
+            perror("pthread_create");
+            rc = -1;
+            goto exit;
         }
+    }
 
-        for(i = 0; i <= fd_max; i++) {
-            if(FD_ISSET(i, &copy_fds)) {
-                if(i == server_fd) {
-                    socklen_t addrlen = sizeof(struct sockaddr_in);
-                    int new_fd = accept(server_fd, (struct sockaddr *)&client_addr, &addrlen);
-                    if(new_fd == -1) {
-                        perror("accept");
-                        continue;
-                    }
-                    FD_SET(new_fd, &master_fds);
-                    fd_max = MAX(new_fd, fd_max);
-                    connection_infos[new_fd].last_command = dempty();
-                } else {
-                    // -1 to preserve final NULL
-                    int nbytes = recv(i, buf, READ_MAX - 1, 0);
-                    buf[nbytes] = '\0';
-                    if(nbytes <= 0) {
-                        if(nbytes < 0) {
-                            perror("recv");
-                        }
-                        close(i);
-                        FD_CLR(i, &master_fds);
-                        dfree(connection_infos[i].last_command);
-                    } else {
-                        struct connection_info *this = &connection_infos[i];
-                        int found_bs_r = 0;
-                        for(int j = 0; j < nbytes; j++) {
-                            char on = buf[j];
-                            this->last_command = dappendc(this->last_command, on);
-                            if(on == '\r') {
-                                found_bs_r = 1;
-                            } else if(on == '\n' && found_bs_r) {
-                                int should_close =
-                                    process_command(config, hm, i, this->last_command);
-                                this->last_command = dempty();
-                                if(should_close) {
-                                    close(i);
-                                    FD_CLR(i, &master_fds);
-                                    dfree(connection_infos[i].last_command);
-                                    break;
-                                }
-                            } else {
-                                found_bs_r = 0;
-                            }
-                        }
-                    }
-                }
-            }
+    printf("Fist started at %s:%d using %s with %d workers\n", dtext(config->host), config->port,
+           event_backend_name(config->event_backend), nworkers);
+
+    while(running) {
+        if(child_exited) {
+            child_exited = 0;
+            reap_bgsave(&server, 0);
+        }
+        if(should_save) {
+            should_save = 0;
+            bgsave(&server, 1);
+            alarm(config->save_period);
         }
+        // Signals stay blocked outside of here, so none can slip in between the checks and waiting
+        sigsuspend(&unblocked);
     }
-    sdump(dtext(config->db_path), hm);
+
 exit:
-    hfree(hm);
+    if(started > 0) {
+        if(write(server.stop_fds[1], "", 1) == -1)
+            perror("write");
+        for(int i = 0; i < started; i++)
+            pthread_join(workers[i].thread, NULL);
+    }
+    // A background save or merge still running would race the final save for the file
+    pthread_mutex_lock(&server.save_lock);
+    server.merge_stop = 1;
+    pthread_mutex_unlock(&server.save_lock);
+    reap_bgsave(&server, 1);
+    if(server.merger_started)
+        pthread_join(server.merger, NULL);
+    if(rc == 0) {
+        pthread_mutex_lock(&server.save_lock);
+        save(&server, 0);
+        pthread_mutex_unlock(&server.save_lock);
+    }
+    if(server.log)
+        cmdlog_close(server.log);
+
+    for(int i = 0; i < nworkers; i++) {
+        if(workers[i].listen_fd != -1 && (i == 0 || reuseport))
+            close(workers[i].listen_fd);
+        event_loop_free(workers[i].loop);
+        linebuf_free(&workers[i].input);
+        cache_free(&workers[i].cache);
+    }
+    if(server.stop_fds[0] != -1) {
+        close(server.stop_fds[0]);
+        close(server.stop_fds[1]);
+    }
+    if(server.lock.shards)
+        shardlock_destroy(&server.lock);
+    pthread_mutex_destroy(&server.save_lock);
+    pthread_sigmask(SIG_SETMASK, &unblocked, NULL);
+    free(workers);
+    if(server.db)
+        database_free(server.db);
     bst_free(command_tree);
-    free(connection_infos);
+    free(server.connection_infos);
     puts("Exiting cleanly...");
     return rc;
 }
@@ -0,0 +1,50 @@
+#include "shardlock.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int shardlock_init(struct shardlock *lock, int nshards) {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    // glibc prefers readers by default, which starves INDEX on a read-heavy mix
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+
+    lock->nshards = nshards;
+    if(posix_memalign((void **)&lock->shards, SHARDLOCK_CACHE_LINE,
+                      sizeof(union shardlock_shard) * nshards)) {
+        perror("posix_memalign");
+        lock->shards = NULL;
+        pthread_rwlockattr_destroy(&attr);
+        return -1;
+    }
+    for(int i = 0; i < nshards; i++)
+        pthread_rwlock_init(&lock->shards[i].lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    return 0;
+}
+
+void shardlock_destroy(struct shardlock *lock) {
+    for(int i = 0; i < lock->nshards; i++)
+        pthread_rwlock_destroy(&lock->shards[i].lock);
+    free(lock->shards);
+}
+
+void shardlock_rdlock(struct shardlock *lock, int shard) {
+    pthread_rwlock_rdlock(&lock->shards[shard % lock->nshards].lock);
+}
+
+void shardlock_rdunlock(struct shardlock *lock, int shard) {
+    pthread_rwlock_unlock(&lock->shards[shard % lock->nshards].lock);
+}
+
+void shardlock_wrlock(struct shardlock *lock) {
+    for(int i = 0; i < lock->nshards; i++)
+        pthread_rwlock_wrlock(&lock->shards[i].lock);
+}
+
+void shardlock_wrunlock(struct shardlock *lock) {
+    for(int i = lock->nshards - 1; i >= 0; i--)
+        pthread_rwlock_unlock(&lock->shards[i].lock);
+}
@@ -0,0 +1,29 @@
+#ifndef H_SHARDLOCK
+#define H_SHARDLOCK
+
+#include <pthread.h>
+
+#define SHARDLOCK_CACHE_LINE 64
+
+// A reader-writer lock split into shards so readers on different threads never write to the same
+// cache line. A reader locks only its own shard, the writer locks every shard in order, so it
+// excludes all readers and other writers.
+struct shardlock
+{
+    int nshards;
+    union shardlock_shard {
+        pthread_rwlock_t lock;
+        char pad[SHARDLOCK_CACHE_LINE * ((sizeof(pthread_rwlock_t) + SHARDLOCK_CACHE_LINE - 1) /
+                                         SHARDLOCK_CACHE_LINE)];
+    } * shards;
+};
+
+// Returns -1 if the shards could not be allocated
+int shardlock_init(struct shardlock *lock, int nshards);
+void shardlock_destroy(struct shardlock *lock);
+void shardlock_rdlock(struct shardlock *lock, int shard);
+void shardlock_rdunlock(struct shardlock *lock, int shard);
+void shardlock_wrlock(struct shardlock *lock);
+void shardlock_wrunlock(struct shardlock *lock);
+
+#endif
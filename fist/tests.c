@@ -1,14 +1,33 @@
+#include "alloc.h"
 #include "bst.h"
+#include "cache.h"
+#include "cmdlog.h"
 #include "config.h"
+#include "database.h"
+#include "docdict.h"
 #include "dstring.h"
+#include "eventloop.h"
 #include "hashmap.h"
+#include "idset.h"
 #include "indexer.h"
+#include "istring.h"
+#include "linebuf.h"
+#include "lzf.h"
 #include "minunit.h"
+#include "outbuf.h"
+#include "postings.h"
+#include "query.h"
+#include "rank.h"
 #include "serializer.h"
+#include "shardlock.h"
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 int tests_run = 0;
 
@@ -39,6 +58,19 @@ static char *test_append_dstring() {
     mu_assert("dappend: Empty Append Length", empty.length == strlen("Empty What?"));
     mu_assert("dappend: Empty Append Text", !strcmp("Empty What?", dtext(empty)));
 
+    dstring grown = dempty();
+    int reallocations = 0;
+    for(int i = 0; i < 1000; i++) {
+        int capacity = grown.alloc_len;
+        grown = dappendn(grown, "abc", i % 4);
+        reallocations += grown.alloc_len != capacity;
+    }
+    mu_assert("dappendn: Length", grown.length == 1500 && strlen(dtext(grown)) == 1500);
+    mu_assert("dappendn: Capacity doubles", reallocations <= 7 && grown.alloc_len == 2048);
+
+    dfree(string);
+    dfree(empty);
+    dfree(grown);
     return 0;
 }
 
@@ -120,6 +152,21 @@ static char *test_push_array_dstring() {
     return 0;
 }
 
+static char *test_adopt_array_dstring() {
+    dstring owned = dcreate("a string too long to be kept in static_text");
+    dstringa array = dcreatea();
+    array = dadopt(array, owned);
+    mu_assert("dadopt: Not copied", array.length == 1 && array.values[0].text == owned.text);
+    for(int i = 0; i < 100; i++) {
+        array = dpush(array, owned);
+    }
+    mu_assert("dadopt: Capacity doubles", array.length == 101 && array.capacity == 128);
+    array = dpop(array);
+    mu_assert("dpop: Capacity kept", array.length == 100 && array.capacity == 128);
+    dfreea(array);
+    return 0;
+}
+
 static char *test_free_array_dstring() {
     dstring test_val = dcreate("Eml1");
     dstring test_val_2 = dcreate("Eml2");
@@ -241,31 +288,312 @@ static char *test_getset_hm() {
     hashmap *hm = hcreate();
     dstring key = dcreate("key");
     dstring key2 = dcreate("key2");
-    dstring value = dcreate("value");
-    dstring value2 = dcreate("value2");
-    hm = hset(hm, key, value);
-    dstringa output = hget(hm, key);
-    mu_assert("hset+hget: Test basic get", dequals(output.values[0], value));
-    hm = hset(hm, key, value2);
+    hm = hset(hm, key, 1);
+    postings output = hget(hm, key);
+    mu_assert("hset+hget: Test basic get", output.length == 1 && pcontains(&output, 1));
+    hm = hset(hm, key, 2);
     output = hget(hm, key);
-    mu_assert("hset+hget: Test new value same key", dequals(output.values[1], value2));
-    hm = hset(hm, key2, value);
+    mu_assert("hset+hget: Test new value same key", pcontains(&output, 2));
+    hm = hset(hm, key, 2);
+    output = hget(hm, key);
+    mu_assert("hset+hget: Test duplicate value same key", output.length == 2);
+    hm = hset(hm, key2, 1);
     output = hget(hm, key2);
-    mu_assert("hset+hget: Test new value new key", dequals(output.values[0], value));
-    hm = hset(hm, key2, value2);
+    mu_assert("hset+hget: Test new value new key", pcontains(&output, 1));
+    hm = hset(hm, key2, 2);
     output = hget(hm, key2);
-    mu_assert("hset+hget: Test new value same key", dequals(output.values[1], value2));
+    mu_assert("hset+hget: Test new value same key", pcontains(&output, 2));
     hm = hdel(hm, key2);
     output = hget(hm, key2);
     mu_assert("hdel: Test deleting value from hm", output.length == 0);
-    dfree(value);
-    dfree(value2);
+    dfree(key);
+    dfree(key2);
+    hfree(hm);
+    return 0;
+}
+
+static char *test_postings() {
+    postings list = pcreate();
+    for(uint32_t id = 0; id < 1000; id += 2) {
+        padd(&list, id);
+    }
+    mu_assert("padd: Appended ids", list.length == 500);
+    mu_assert("padd: Filled blocks", list.nblocks == 500 / POSTINGS_BLOCK + 1);
+    mu_assert("padd: Duplicate of last id", !padd(&list, 998));
+    mu_assert("padd: Duplicate of old id", !padd(&list, 200));
+    mu_assert("pcontains: Old id", pcontains(&list, 200));
+    mu_assert("pcontains: Missing id", !pcontains(&list, 201));
+    mu_assert("pcontains: Past the end", !pcontains(&list, 5000));
+
+    // Out of order inserts split full blocks
+    for(uint32_t id = 1; id < 1000; id += 2) {
+        mu_assert("padd: Out of order id", padd(&list, id));
+    }
+    mu_assert("padd: Length after inserts", list.length == 1000);
+
+    uint32_t ids[1000];
+    mu_assert("pdecode: Count", pdecode(&list, ids) == 1000);
+    int sorted = 1;
+    for(uint32_t i = 0; i < 1000; i++) {
+        sorted &= ids[i] == i;
+    }
+    mu_assert("pdecode: Sorted without duplicates", sorted);
+
+    struct pcursor cursor;
+    uint32_t id;
+    uint32_t expected = 0;
+    pcursor_init(&cursor, &list);
+    while(pcursor_next(&cursor, &id)) {
+        sorted &= id == expected++;
+    }
+    mu_assert("pcursor_next: Visits every id in order", sorted && expected == 1000);
+    pfree(&list);
+
+    for(uint32_t i = 0; i <= 1000; i++) {
+        padd(&list, i);
+    }
+    // Removing ids rebuilds only their block, a block left empty is dropped
+    mu_assert("premove: Id removed", premove(&list, 500) && !pcontains(&list, 500));
+    mu_assert("premove: Missing id", !premove(&list, 500) && !premove(&list, 5000));
+    mu_assert("premove: Last id of a block", premove(&list, 1000) && list.length == 999);
+    uint32_t drop[] = {3, 4, 700};
+    postings kept;
+    mu_assert("pwithout: Ids dropped", pwithout(&kept, &list, drop, 3) && kept.length == 996 &&
+                                           !pcontains(&kept, 4) && pcontains(&kept, 5));
+    postings none;
+    mu_assert("pwithout: Nothing to drop", !pwithout(&none, &kept, drop, 3));
+    pfree(&kept);
+
+    pfree(&list);
+    return 0;
+}
+
+// Sorted ids below limit, each taken with a chance of one in every
+static uint32_t test_random_ids(uint32_t *ids, uint32_t limit, uint32_t every, uint32_t *state) {
+    uint32_t count = 0;
+    for(uint32_t id = 0; id < limit; id++) {
+        *state = *state * 1103515245 + 12345;
+        if((*state >> 8) % every == 0)
+            ids[count++] = id;
+    }
+    return count;
+}
+
+static char *test_intersect() {
+    static uint32_t a[20000], b[20000], both[20000], out[40000];
+    uint32_t state = 7;
+    // Similar lengths are merged, 4 ids at a time where SSE2 is available, very different ones
+    // gallop
+    uint32_t every[][2] = {{2, 3}, {3, 2}, {1, 5}, {2, 200}, {500, 1}};
+    for(size_t t = 0; t < sizeof(every) / sizeof(every[0]); t++) {
+        uint32_t na = test_random_ids(a, 20000, every[t][0], &state);
+        uint32_t nb = test_random_ids(b, 20000, every[t][1], &state);
+        uint32_t nboth = 0, nunion = 0, nsubtract = 0;
+        for(uint32_t i = 0, j = 0; i < na || j < nb; nunion++) {
+            if(j == nb || (i < na && a[i] < b[j])) {
+                nsubtract++;
+                i++;
+            } else if(i == na || b[j] < a[i]) {
+                j++;
+            } else {
+                both[nboth++] = a[i];
+                i++;
+                j++;
+            }
+        }
+        uint32_t count = pintersect(out, a, na, b, nb);
+        mu_assert("pintersect: Common ids",
+                  count == nboth && !memcmp(out, both, sizeof(uint32_t) * count));
+        mu_assert("punion: Count", punion(out, a, na, b, nb) == nunion);
+        mu_assert("psubtract: Count", psubtract(out, a, na, b, nb) == nsubtract);
+        mu_assert("psubtract: In place", psubtract(a, a, na, b, nb) == nsubtract);
+    }
+
+    // Filtering ids through postings only decodes the blocks they fall into
+    postings list = pcreate();
+    for(uint32_t id = 0; id < 10000; id += 3) {
+        padd(&list, id);
+    }
+    uint32_t ids[] = {0, 1, 3, 4000, 4001, 9999, 20000};
+    mu_assert("pfilter: Kept", pfilter(&list, ids, 7, 1) == 3 && ids[1] == 3 && ids[2] == 9999);
+    uint32_t others[] = {0, 1, 3, 4000, 20000};
+    mu_assert("pfilter: Dropped", pfilter(&list, others, 5, 0) == 3 && others[2] == 20000);
+    pfree(&list);
+    padd(&list, 5);
+    uint32_t first[] = {0, 5};
+    mu_assert("pfilter: Missing first id", pfilter(&list, first, 2, 1) == 1 && first[0] == 5);
+    pfree(&list);
+    return 0;
+}
+
+static char *test_docdict() {
+    struct docdict *docs = docdict_create();
+    dstring first = dcreate("document_1");
+    dstring second = dcreate("a document name longer than the small string buffer");
+    uint32_t id;
+    mu_assert("docdict_add: First id", docdict_add(docs, first) == 0);
+    mu_assert("docdict_add: Second id", docdict_add(docs, second) == 1);
+    mu_assert("docdict_add: Existing name keeps id", docdict_add(docs, first) == 0);
+    mu_assert("docdict_find: Finds name", docdict_find(docs, second, &id) && id == 1);
+    mu_assert("docdict_name: Name of id",
+              iequals(docdict_name(docs, 1), dtext(second), second.length));
+    mu_assert("docdict_renew: New id", docdict_renew(docs, second) == 2 &&
+                                           docdict_find(docs, second, &id) && id == 2);
+    mu_assert("docdict_renew: Name shared with the old id",
+              itext(docdict_name(docs, 2)) == itext(docdict_name(docs, 1)));
+
+    char buffer[32];
+    for(int i = 0; i < 1000; i++) {
+        sprintf(buffer, "doc%d", i);
+        dstring name = dcreate(buffer);
+        docdict_add(docs, name);
+        dfree(name);
+    }
+    dstring last = dcreate("doc999");
+    mu_assert("docdict_find: Finds name after growth", docdict_find(docs, last, &id) && id == 1002);
+    mu_assert("docdict_find: Unknown name", !docdict_find(docs, dcreate("nope"), &id));
+
+    dfree(first);
+    dfree(second);
+    dfree(last);
+    docdict_free(docs);
+    return 0;
+}
+
+static char *test_idset() {
+    struct idset set = {0};
+    struct idset other = {0};
+    idset_add(&set, 3);
+    idset_add(&set, 1000);
+    mu_assert("idset_has: Added ids", idset_has(&set, 3) && idset_has(&set, 1000));
+    mu_assert("idset_has: Other ids", !idset_has(&set, 4) && !idset_has(&set, 100000));
+    idset_add(&other, 5000);
+    idset_move(&set, &other);
+    mu_assert("idset_move: Ids moved", idset_has(&set, 5000) && idset_has(&set, 3));
+    mu_assert("idset_move: Source emptied", !idset_has(&other, 5000) && other.nwords == 0);
+    idset_free(&set);
+    return 0;
+}
+
+static char *test_hash_hm() {
+    const char *fox = "The quick brown fox jumps over the lazy dog";
+    mu_assert("hhash: Empty", hhash("", 0) == 0xEF46DB3751D8E999ULL);
+    mu_assert("hhash: Short", hhash("abc", 3) == 0x44BC2CF5AD770999ULL);
+    mu_assert("hhash: Long", hhash(fox, strlen(fox)) == 0x0B242D361FDA71BCULL);
+    mu_assert("hhash: Order matters", hhash("ab", 2) != hhash("ba", 2));
+    return 0;
+}
+
+static char *test_grow_hm() {
+    hashmap *hm = hcreate();
+    char buffer[32];
+    for(int i = 0; i < 10000; i++) {
+        sprintf(buffer, "key%d", i);
+        dstring key = dcreate(buffer);
+        hm = hset(hm, key, i);
+        dfree(key);
+    }
+    mu_assert("hset: Length after growth", hm->length == 10000);
+    mu_assert("hset: Capacity grew", hm->capacity > 10000);
+
+    for(int i = 0; i < 10000; i += 2) {
+        sprintf(buffer, "key%d", i);
+        dstring key = dcreate(buffer);
+        hm = hdel(hm, key);
+        dfree(key);
+    }
+    mu_assert("hdel: Length after delete", hm->length == 5000);
+
+    int found = 0;
+    for(int i = 0; i < 10000; i++) {
+        sprintf(buffer, "key%d", i);
+        dstring key = dcreate(buffer);
+        postings values = hget(hm, key);
+        if(values.length == 1 && pcontains(&values, i))
+            found += i % 2;
+        else if(values.length != 0 || i % 2)
+            found = -1;
+        dfree(key);
+    }
+    mu_assert("hget: Remaining keys found after delete", found == 5000);
+
+    uint32_t slot = 0;
+    int iterated = 0;
+    while(hnext(hm, &slot))
+        iterated++;
+    mu_assert("hnext: Visits every key", iterated == 5000);
+
     hfree(hm);
     return 0;
 }
 
+static char *test_alloc() {
+    struct arena arena = {NULL, 0, 0};
+    char *first = arena_alloc(&arena, 10);
+    char *large = arena_alloc(&arena, ARENA_CHUNK);
+    mu_assert("arena_alloc: Large allocation keeps the chunk in use",
+              arena_alloc(&arena, 6) == first + 10 && large);
+    arena_release(&arena, 6);
+    mu_assert("arena_release: Counted", arena.used == 10 + ARENA_CHUNK &&
+                                            arena.reserved > 2 * ARENA_CHUNK);
+    arena_free(&arena);
+    mu_assert("arena_free: Empty", !arena.chunks && !arena.used && !arena.reserved);
+
+    struct slab slab = {{NULL}, NULL, 0, NULL, 0, 0};
+    void *small = slab_alloc(&slab, 10);
+    mu_assert("slab_realloc: Same class stays", slab_realloc(&slab, small, 10, 16) == small);
+    slab_free(&slab, small, 16);
+    mu_assert("slab_alloc: Freed chunk reused", slab_alloc(&slab, 12) == small);
+    void *moved = slab_realloc(&slab, small, 12, 100);
+    mu_assert("slab_realloc: Other class moves", moved != small);
+    void *huge = slab_alloc(&slab, SLAB_MAX + 1);
+    mu_assert("slab_alloc: Used counted", slab.used == 100 + SLAB_MAX + 1);
+    slab_free(&slab, huge, SLAB_MAX + 1);
+    slab_free(&slab, moved, 100);
+    mu_assert("slab_free: Nothing used", slab.used == 0 && !slab.large);
+    slab_destroy(&slab);
+    mu_assert("slab_destroy: Empty", !slab.pages && !slab.reserved);
+
+    // Postings and long keys of a map live in its slab and arena, removing them gives it all back
+    hashmap *hm = hcreate();
+    const char *key = "a key longer than the static text of a dstring";
+    postings *list = hputn(hm, key, strlen(key));
+    for(uint32_t i = 0; i < 1000; i++) {
+        padd(list, i * 3);
+    }
+    mu_assert("hputn: Postings in the slab", list->slab == &hm->slab && hm->slab.used > 0);
+    mu_assert("hputn: Key in the arena", hm->keys.used == strlen(key));
+    for(uint32_t i = 0; i < 1000; i++) {
+        premove(list, i * 3);
+    }
+    mu_assert("premove: Blocks freed", hm->slab.used == 0 && !list->blocks);
+    padd(list, 1);
+    hdeln(hm, key, strlen(key));
+    mu_assert("hdeln: Key and postings freed", hm->keys.used == 0 && hm->slab.used == 0);
+    hfree(hm);
+    return 0;
+}
+
+static char *test_istring() {
+    struct arena arena = {NULL, 0, 0};
+    istring empty = icreate(&arena, "", 0);
+    mu_assert("icreate: Empty", empty.length == 0 && iequals(&empty, "", 0));
+    istring small = icreate(&arena, "twelve bytes", 12);
+    mu_assert("icreate: Short text kept inline",
+              iequals(&small, "twelve bytes", 12) && itext(&small) == small.data &&
+                  isize(&small) == 0 && arena.used == 0);
+    istring large = icreate(&arena, "thirteen byte", 13);
+    mu_assert("icreate: Long text in the arena", iequals(&large, "thirteen byte", 13) &&
+                                                     isize(&large) == 13 && arena.used == 13);
+    mu_assert("iequals: Same prefix", !iequals(&large, "thirteen bytf", 13));
+    mu_assert("iequals: Other prefix", !iequals(&large, "Thirteen byte", 13));
+    mu_assert("iequals: Other length", !iequals(&small, "twelve byte", 11));
+    arena_free(&arena);
+    return 0;
+}
+
 static char *test_indexer() {
-    dstring test = dcreate("This is very cool");
+    char test[] = "This is very cool";
     dstringa answers = dcreatea();
     answers = dpush(answers, dcreate("This"));
     answers = dpush(answers, dcreate("is"));
@@ -278,10 +606,16 @@ static char *test_indexer() {
     answers = dpush(answers, dcreate("is very cool"));
     answers = dpush(answers, dcreate("This is very cool"));
 
-    dstringa index = indexer(test, 10);
-
-    answers = dsorta(answers);
-    index = dsorta(index);
+    dstringa index = dcreatea();
+    struct ngrams it;
+    struct span phrase;
+    ngrams_init(&it, test, strlen(test), 10);
+    while(ngrams_next(&it, &phrase)) {
+        dstring on = dcreaten(phrase.text, phrase.length);
+        index = dpush(index, on);
+        dfree(on);
+    }
+    mu_assert("ngrams_next: Phrase count", index.length == answers.length);
 
     for(int i = 0; i < answers.length; i++) {
         int found = 0;
@@ -299,6 +633,30 @@ static char *test_indexer() {
     }
     dfreea(answers);
     dfreea(index);
+
+    ngrams_init(&it, test, strlen(test), 2);
+    int count = 0;
+    while(ngrams_next(&it, &phrase))
+        count++;
+    mu_assert("ngrams_next: Limited to max words", count == 7);
+    return 0;
+}
+
+static char *test_tokenizer() {
+    char text[] = "  Hello \t my\r\n  name   is ";
+    uint32_t length = tnormalize(text, strlen(text));
+    mu_assert("tnormalize: Collapsed whitespace", !strncmp(text, "Hello my name is", length));
+    mu_assert("tnormalize: Length", length == strlen("Hello my name is"));
+
+    const char *raw = " one  two\tthree ";
+    uint32_t offset = 0;
+    struct span word;
+    mu_assert("tnext: First word", tnext(raw, strlen(raw), &offset, &word) && word.length == 3 &&
+                                       !strncmp(word.text, "one", 3));
+    mu_assert("tnext: Second word", tnext(raw, strlen(raw), &offset, &word) && word.length == 3 &&
+                                        !strncmp(word.text, "two", 3));
+    mu_assert("tnext: Third word", tnext(raw, strlen(raw), &offset, &word) && word.length == 5);
+    mu_assert("tnext: No more words", !tnext(raw, strlen(raw), &offset, &word));
     return 0;
 }
 
@@ -367,31 +725,592 @@ static char *test_dappendd_dstring() {
     return 0;
 }
 
+// Removes a database written by a test along with its segments
+static void remove_database(const char *path, struct database *db) {
+    for(uint64_t number = 1; number < db->next_segment; number++) {
+        dstring segment_path = ssegment_path(path, number);
+        unlink(dtext(segment_path));
+        dfree(segment_path);
+    }
+    unlink(path);
+}
+
+static uint32_t test_search_key(struct database *db, int number, uint32_t *first) {
+    char key[32];
+    uint32_t *ids;
+    int length = snprintf(key, sizeof(key), "key number %d", number);
+    uint32_t count = database_search(db, key, length, &ids);
+    if(count)
+        *first = ids[0];
+    free(ids);
+    return count;
+}
+
 static char *test_serialize_hmap() {
-    rename("fist.db", "fist.db.real");
-    hashmap *hm = hcreate();
+    const char *path = "/tmp/fist-test.db";
+    struct database *db = database_create(INDEX_MODE_PHRASE, 10);
     dstring key = dcreate("index");
     dstring key2 = dcreate("index2");
     dstring value = dcreate("d1");
     dstring value2 = dcreate("d2");
     dstring value3 = dcreate("d3");
-    hm = hset(hm, key, value);
-    hm = hset(hm, key, value2);
-    hm = hset(hm, key2, value3);
-    sdump("fist.db", hm);
-    hashmap *loaded = sload("fist.db");
-    dstringa get_from_loaded = hget(loaded, key2);
-    dstringa key1vals = hget(loaded, key);
-    mu_assert("Serialized data size", get_from_loaded.length == 1);
-    mu_assert("key2 == value3", dequals(get_from_loaded.values[0], value3));
-    mu_assert("key1 contains value", dequals(key1vals.values[0], value));
-    mu_assert("key2 contains value2", dequals(key1vals.values[1], value2));
-    rename("fist.db.real", "fist.db");
-    hfree(hm);
+    db->hm = hset(db->hm, key, docdict_add(db->docs, value));
+    db->hm = hset(db->hm, key, docdict_add(db->docs, value2));
+    db->hm = hset(db->hm, key2, docdict_add(db->docs, value3));
+    sdump(path, db);
+    struct database *loaded = sload(path, INDEX_MODE_PHRASE, 10);
+    uint32_t *ids;
+    mu_assert("Serialized data size", database_search(loaded, dtext(key2), key2.length, &ids) == 1);
+    mu_assert("key2 == value3",
+              iequals(docdict_name(loaded->docs, ids[0]), dtext(value3), value3.length));
+    free(ids);
+    database_search(loaded, dtext(key), key.length, &ids);
+    mu_assert("key1 contains value",
+              iequals(docdict_name(loaded->docs, ids[0]), dtext(value), value.length));
+    mu_assert("key2 contains value2",
+              iequals(docdict_name(loaded->docs, ids[1]), dtext(value2), value2.length));
+    free(ids);
+    remove_database(path, db);
+    database_free(db);
+    dfree(key);
+    dfree(key2);
     dfree(value);
     dfree(value2);
     dfree(value3);
-    hfree(loaded);
+    database_free(loaded);
+    return 0;
+}
+
+// Writes a database file the way the baseline did: the payload size, then the payload compressed
+static void test_write_baseline(const char *path, const char *payload, uint32_t length,
+                                uint64_t original_size) {
+    char packed[256];
+    uint32_t size = lzf_compress(payload, length, packed, sizeof(packed));
+    FILE *file = fopen(path, "wb");
+    fwrite(&original_size, sizeof(original_size), 1, file);
+    fwrite(packed, size, 1, file);
+    fclose(file);
+}
+
+static char *test_serialize_baseline() {
+    const char *path = "/tmp/fist-test.db";
+    // One key with two document names, then the same payload cut short
+    const char payload[] = "\1\0\0\0\4\0\0\0wolf\2\0\0\0\2\0\0\0d1\2\0\0\0d2";
+    uint32_t length = sizeof(payload) - 1;
+    test_write_baseline(path, payload, length, length);
+    struct database *loaded = sload(path, INDEX_MODE_PHRASE, 10);
+    uint32_t *ids;
+    mu_assert("sload: Baseline file", loaded && loaded->docs->length == 2 &&
+                                          database_search(loaded, "wolf", 4, &ids) == 2);
+    free(ids);
+    database_free(loaded);
+
+    test_write_baseline(path, payload, length - 6, length - 6);
+    mu_assert("sload: Truncated payload", sload(path, INDEX_MODE_PHRASE, 10) == NULL);
+    test_write_baseline(path, payload, length, length + 1);
+    mu_assert("sload: Wrong payload size", sload(path, INDEX_MODE_PHRASE, 10) == NULL);
+    unlink(path);
+    return 0;
+}
+
+static char *test_serialize_segments() {
+    const char *path = "/tmp/fist-test.db";
+    struct database *db = database_create(INDEX_MODE_PHRASE, 10);
+    dstring d1 = dcreate("d1");
+    dstring d2 = dcreate("d2");
+    uint32_t id = docdict_add(db->docs, d1);
+    docdict_add(db->docs, d2);
+    char key[32];
+    for(int i = 0; i < 100000; i++) {
+        int length = snprintf(key, sizeof(key), "key number %d", i);
+        padd(hputn(db->hm, key, length), id + i % 2);
+    }
+    mu_assert("sdump: Segment written", sdump(path, db) == 0);
+    struct database *loaded = sload(path, INDEX_MODE_PHRASE, 10);
+    mu_assert("sload: Segment mapped", loaded->nsegments == 1 && loaded->hm->length == 0 &&
+                                           database_keys(loaded) == 100000);
+    uint32_t first;
+    mu_assert("sload: Last key restored",
+              test_search_key(loaded, 99999, &first) == 1 && first == 1);
+
+    // Changes go on top of the segment, a delete hides the key in the layers below
+    int length = snprintf(key, sizeof(key), "key number %d", 99999);
+    database_delete(loaded, key, length);
+    mu_assert("database_delete: Key in the segment", test_search_key(loaded, 99999, &first) == 0);
+    padd(hputn(loaded->hm, key, length), 1);
+    length = snprintf(key, sizeof(key), "key number %d", 1);
+    padd(hputn(loaded->hm, key, length), 0);
+    mu_assert("database_search: Merged with the segment", test_search_key(loaded, 1, &first) == 2);
+    mu_assert("sdump: Second segment", sdump(path, loaded) == 0 && loaded->nsegments == 2);
+    mu_assert("sdump: Tombstone written", loaded->segments[1]->header->ntombstones == 1 &&
+                                              test_search_key(loaded, 99999, &first) == 1);
+
+    // A snapshot written from the frozen layer leaves out what changed after the freeze
+    database_freeze(loaded);
+    length = snprintf(key, sizeof(key), "key number %d", 2);
+    database_delete(loaded, key, length);
+    uint64_t number = loaded->next_segment++;
+    mu_assert("sflush: Frozen layer written", sflush(path, loaded, number, 0, 0) == 0);
+    database_install(loaded, ssegment_open(path, number));
+    mu_assert("database_install: Frozen layer dropped",
+              loaded->frozen == NULL && loaded->nsegments == 3);
+    mu_assert("database_install: Later delete kept", test_search_key(loaded, 2, &first) == 0);
+
+    // Merging keeps tombstones while older segments are left below them
+    uint32_t from, count;
+    mu_assert("database_merge_policy: Small segments merged",
+              database_merge_policy(loaded, &from, &count) && from == 1 && count == 2);
+    number = loaded->next_segment++;
+    mu_assert("smerge: Merged", smerge(path, &loaded->segments[from], count, 0, number) == 0);
+    struct segment *merged = ssegment_open(path, number);
+    mu_assert("smerge: Tombstone kept", merged && merged->header->ntombstones == 1);
+    segment_close(loaded->segments[1]);
+    segment_close(loaded->segments[2]);
+    database_replace(loaded, from, count, merged);
+    number = loaded->next_segment++;
+    mu_assert("smerge: Merged into one", smerge(path, loaded->segments, 2, 1, number) == 0);
+    merged = ssegment_open(path, number);
+    mu_assert("smerge: Tombstone dropped", merged && merged->header->ntombstones == 0 &&
+                                               segment_keys(merged) == 100000);
+    segment_close(loaded->segments[0]);
+    segment_close(loaded->segments[1]);
+    database_replace(loaded, 0, 2, merged);
+    mu_assert("database_replace: Keys", loaded->nsegments == 1 &&
+                                            test_search_key(loaded, 99999, &first) == 1 &&
+                                            first == 1 && test_search_key(loaded, 1, &first) == 2);
+    mu_assert("smanifest: Written", smanifest(path, loaded) == 0);
+
+    struct database *reloaded = sload(path, INDEX_MODE_PHRASE, 10);
+    mu_assert("sload: Merged segment", reloaded->nsegments == 1 && reloaded->docs->length == 2);
+    mu_assert("sload: Frozen changes restored", test_search_key(reloaded, 2, &first) == 1);
+    mu_assert("sload: Merged key restored", test_search_key(reloaded, 1, &first) == 2);
+
+    // Nothing is loaded when a segment the manifest lists is gone
+    dstring segment_path = ssegment_path(path, number);
+    unlink(dtext(segment_path));
+    dfree(segment_path);
+    mu_assert("sload: Missing segment", sload(path, INDEX_MODE_PHRASE, 10) == NULL);
+
+    remove_database(path, loaded);
+    database_free(db);
+    database_free(loaded);
+    database_free(reloaded);
+    dfree(d1);
+    dfree(d2);
+    return 0;
+}
+
+static char *test_serialize_lengths() {
+    const char *path = "/tmp/fist-test.db";
+    struct database *db = database_create(INDEX_MODE_POSITIONAL, 10);
+    char name[32];
+    char text[] = "one two three";
+    for(int i = 0; i < DOCDICT_RANGE + 10; i++) {
+        dstring document = dcreaten(name, snprintf(name, sizeof(name), "d%d", i));
+        database_index(db, document, text, strlen(text));
+        dfree(document);
+    }
+    mu_assert("sdump: Every range written", sdump(path, db) == 0 &&
+                                                db->segments[0]->header->nranges == 2);
+
+    // Only the ranges holding documents that grew are written again
+    dstring document = dcreate("d5");
+    char more[] = "four five";
+    database_index(db, document, more, strlen(more));
+    mu_assert("sdump: Changed range", sdump(path, db) == 0 &&
+                                          db->segments[1]->header->nranges == 1);
+    char none[] = "";
+    database_index(db, document, none, 0);
+    mu_assert("sdump: No range changed", sdump(path, db) == 0 &&
+                                             db->segments[2]->header->nranges == 0);
+    dfree(document);
+
+    uint64_t number = db->next_segment++;
+    mu_assert("smerge: Merged", smerge(path, &db->segments[1], 2, 0, number) == 0);
+    struct segment *merged = ssegment_open(path, number);
+    mu_assert("smerge: Newest ranges kept", merged && merged->header->nranges == 1);
+    segment_close(db->segments[1]);
+    segment_close(db->segments[2]);
+    database_replace(db, 1, 2, merged);
+    mu_assert("smanifest: Written", smanifest(path, db) == 0);
+
+    struct database *loaded = sload(path, INDEX_MODE_POSITIONAL, 10);
+    mu_assert("sload: Documents", loaded->docs->length == DOCDICT_RANGE + 10);
+    mu_assert("sload: Word counts", !memcmp(loaded->docs->lengths, db->docs->lengths,
+                                            sizeof(uint32_t) * loaded->docs->length));
+    mu_assert("sload: Nothing to save", !database_unsaved(loaded));
+    database_free(loaded);
+
+    // What is indexed between the freeze and the flush is left to the next snapshot, as the command
+    // log is only replayed from the freeze
+    dstring grown = dcreate("d7");
+    database_index(db, grown, more, strlen(more));
+    database_freeze(db);
+    uint32_t frozen_length = db->docs->lengths[7];
+    database_index(db, grown, more, strlen(more));
+    dstring late = dcreate("late");
+    database_index(db, late, text, strlen(text));
+    number = db->next_segment++;
+    mu_assert("sflush: Written after writes", sflush(path, db, number, 0, 0) == 0);
+    struct segment *seg = ssegment_open(path, number);
+    mu_assert("sflush: Documents of the freeze", seg && seg->header->ndocs == DOCDICT_RANGE + 10 &&
+                                                      seg->header->nranges == 1);
+    database_install(db, seg);
+    mu_assert("smanifest: Written after writes", smanifest(path, db) == 0);
+    loaded = sload(path, INDEX_MODE_POSITIONAL, 10);
+    mu_assert("sload: Word counts of the freeze",
+              loaded->docs->length == DOCDICT_RANGE + 10 &&
+                  loaded->docs->lengths[7] == frozen_length &&
+                  db->docs->lengths[7] != frozen_length);
+    dfree(grown);
+    dfree(late);
+    remove_database(path, db);
+    database_free(db);
+    database_free(loaded);
+    return 0;
+}
+
+static uint32_t test_search(struct database *db, const char *text) {
+    char phrase[64];
+    uint32_t *ids;
+    strcpy(phrase, text);
+    uint32_t count = database_search(db, phrase, strlen(phrase), &ids);
+    free(ids);
+    return count;
+}
+
+static char *test_delete_document() {
+    const char *path = "/tmp/fist-test.db";
+    struct database *db = database_create(INDEX_MODE_PHRASE, 10);
+    dstring d1 = dcreate("d1");
+    dstring d2 = dcreate("d2");
+    char text[64];
+    strcpy(text, "the quick brown fox");
+    database_index(db, d1, text, strlen(text));
+    strcpy(text, "the lazy dog");
+    database_index(db, d2, text, strlen(text));
+
+    // Keys only d1 added are gone from the delta, shared ones keep the other document
+    mu_assert("database_delete_document: Removed", database_delete_document(db, d1));
+    mu_assert("database_delete_document: Own keys dropped",
+              !hcontainsn(db->hm, "quick", 5) && db->hm->length == 6);
+    mu_assert("database_delete_document: Shared key", test_search(db, "the") == 1);
+    mu_assert("database_delete_document: Twice", !database_delete_document(db, d1));
+
+    // Documents in a segment are skipped until a merge drops their postings
+    mu_assert("sdump: Removed documents", sdump(path, db) == 0);
+    strcpy(text, "the lazy cat");
+    database_reindex(db, d2, text, strlen(text));
+    mu_assert("database_reindex: New id", docdict_removed(db->docs, 1) &&
+                                               db->docs->length == 3);
+    mu_assert("database_reindex: Old text gone", test_search(db, "lazy dog") == 0);
+    mu_assert("database_reindex: New text", test_search(db, "lazy cat") == 1);
+    mu_assert("sdump: Reindexed document", sdump(path, db) == 0);
+
+    struct database *loaded = sload(path, INDEX_MODE_PHRASE, 10);
+    uint32_t id;
+    mu_assert("sload: Removed documents", loaded->docs->nremoved == 2 &&
+                                              docdict_find(loaded->docs, d2, &id) && id == 2);
+    mu_assert("sload: Old text gone", test_search(loaded, "the") == 1);
+    mu_assert("sload: Name indexed again", database_delete_document(loaded, d1) == 0);
+    uint64_t number = loaded->next_segment++;
+    mu_assert("smerge: Merged", smerge(path, loaded->segments, 2, 1, number) == 0);
+    struct segment *merged = ssegment_open(path, number);
+    postings list;
+    uint32_t flags;
+    mu_assert("smerge: Removed ids kept", merged && merged->header->nremoved == 2);
+    mu_assert("smerge: Postings dropped", !segment_find(merged, "quick", 5, &list, &flags) &&
+                                              segment_find(merged, "the", 3, &list, &flags) &&
+                                              list.length == 1);
+    const unsigned char *blocks = (const unsigned char *)list.blocks;
+    mu_assert("segment_find: Read in place",
+              list.stored && blocks > merged->data && blocks < merged->data + merged->size);
+    segment_close(merged);
+
+    remove_database(path, loaded);
+    database_free(db);
+    database_free(loaded);
+
+    // Positional mode finds the words of the document again
+    db = database_create(INDEX_MODE_POSITIONAL, 10);
+    strcpy(text, "one two one");
+    database_index(db, d1, text, strlen(text));
+    strcpy(text, "three");
+    database_index(db, d1, text, strlen(text));
+    mu_assert("database_delete_document: Positional",
+              database_delete_document(db, d1) && db->hm->length == 0);
+
+    // A phrase is not deleted word by word, the words of other documents stay
+    strcpy(text, "one two");
+    database_index(db, d1, text, strlen(text));
+    strcpy(text, "one three");
+    database_index(db, d2, text, strlen(text));
+    mu_assert("database_delete: Phrase refused", database_delete(db, "one two", 7) == -1 &&
+                                                     test_search(db, "one two") == 1 &&
+                                                     test_search(db, "one") == 2);
+    mu_assert("database_delete: Single word", database_delete(db, "two", 3) == 0 &&
+                                                  test_search(db, "two") == 0 &&
+                                                  test_search(db, "one three") == 1);
+    database_free(db);
+    dfree(d1);
+    dfree(d2);
+    return 0;
+}
+
+// Runs the query and returns the names it found joined by spaces, or "invalid"
+static const char *test_query_run(struct database *db, const char *text) {
+    static char found[256];
+    char buffer[128];
+    struct query query;
+    strcpy(buffer, text);
+    if(query_parse(&query, buffer, tnormalize(buffer, strlen(buffer))) == -1)
+        return "invalid";
+    uint32_t *ids;
+    uint32_t count = query_run(&query, db, &ids);
+    found[0] = 0;
+    for(uint32_t i = 0; i < count; i++) {
+        if(i > 0)
+            strcat(found, " ");
+        const istring *name = docdict_name(db->docs, ids[i]);
+        strncat(found, itext(name), name->length);
+    }
+    free(ids);
+    query_free(&query);
+    return found;
+}
+
+static char *test_query() {
+    const char *texts[] = {"the quick brown fox", "the lazy dog", "a quick dog",
+                           "brown bread and AND"};
+    for(int mode = INDEX_MODE_PHRASE; mode <= INDEX_MODE_POSITIONAL; mode++) {
+        struct database *db = database_create(mode, 10);
+        for(int i = 0; i < 4; i++) {
+            char name[8], text[64];
+            snprintf(name, sizeof(name), "d%d", i);
+            strcpy(text, texts[i]);
+            dstring document = dcreate(name);
+            database_index(db, document, text, strlen(text));
+            dfree(document);
+        }
+        mu_assert("query_run: Word", !strcmp(test_query_run(db, "quick"), "d0 d2"));
+        mu_assert("query_run: Implicit AND", !strcmp(test_query_run(db, "quick dog"), "d2"));
+        mu_assert("query_run: AND", !strcmp(test_query_run(db, "dog AND the"), "d1"));
+        mu_assert("query_run: OR",
+                  !strcmp(test_query_run(db, "fox OR lazy OR bread"), "d0 d1 d3"));
+        mu_assert("query_run: AND before OR",
+                  !strcmp(test_query_run(db, "quick dog OR bread"), "d2 d3"));
+        mu_assert("query_run: Parentheses",
+                  !strcmp(test_query_run(db, "quick (dog OR fox)"), "d0 d2"));
+        mu_assert("query_run: AND NOT", !strcmp(test_query_run(db, "dog NOT lazy"), "d2"));
+        mu_assert("query_run: NOT alone", !strcmp(test_query_run(db, "NOT the"), "d2 d3"));
+        mu_assert("query_run: Double NOT", !strcmp(test_query_run(db, "NOT NOT fox"), "d0"));
+        mu_assert("query_run: Phrase", !strcmp(test_query_run(db, "\" quick  brown \""), "d0"));
+        mu_assert("query_run: Phrase not found",
+                  !strcmp(test_query_run(db, "\"brown quick\""), ""));
+        mu_assert("query_run: Quoted operator", !strcmp(test_query_run(db, "\"AND\" brown"), "d3"));
+        mu_assert("query_run: Missing key", !strcmp(test_query_run(db, "quick missing"), ""));
+
+        const char *invalid[] = {"", "AND", "quick OR", "(quick", "quick)", "\"quick", "\"\"",
+                                 "NOT", "dog NOT"};
+        for(size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+            mu_assert("query_parse: Invalid", !strcmp(test_query_run(db, invalid[i]), "invalid"));
+        }
+        char deep[2 * QUERY_DEPTH_MAX + 8];
+        memset(deep, '(', QUERY_DEPTH_MAX + 1);
+        strcpy(deep + QUERY_DEPTH_MAX + 1, "x");
+        mu_assert("query_parse: Too deep", !strcmp(test_query_run(db, deep), "invalid"));
+
+        dstring removed = dcreate("d2");
+        database_delete_document(db, removed);
+        dfree(removed);
+        mu_assert("query_run: Removed document", !strcmp(test_query_run(db, "quick"), "d0"));
+        mu_assert("query_run: NOT skips removed documents",
+                  !strcmp(test_query_run(db, "NOT the"), "d3"));
+        database_free(db);
+    }
+    return 0;
+}
+
+static uint32_t test_rank_run(struct database *db, const char *text, uint32_t k,
+                              uint32_t *ids) {
+    uint32_t *found;
+    uint32_t count = rank_search(db, text, strlen(text), k, &found);
+    memcpy(ids, found, sizeof(uint32_t) * count);
+    free(found);
+    return count;
+}
+
+static char *test_rank() {
+    const char *texts[] = {"fox fox fox and a dog", "a fox", "the dog and the cat", "fox",
+                           "a cat and a fox in a very long text about many other things"};
+    uint32_t ids[512];
+    for(int mode = INDEX_MODE_PHRASE; mode <= INDEX_MODE_POSITIONAL; mode++) {
+        struct database *db = database_create(mode, 3);
+        for(int i = 0; i < 5; i++) {
+            char name[8], text[128];
+            snprintf(name, sizeof(name), "d%d", i);
+            strcpy(text, texts[i]);
+            dstring document = dcreate(name);
+            database_index(db, document, text, strlen(text));
+            dfree(document);
+        }
+        mu_assert("database_index: Document lengths", db->docs->lengths[4] == 14 &&
+                                                          db->docs->total_length == 28);
+        // Shorter documents first, in positional mode repeating the word counts
+        mu_assert("rank_search: Best first",
+                  test_rank_run(db, "fox", 10, ids) == 4 && ids[0] == (mode ? 0 : 3));
+        mu_assert("rank_search: Longest last", ids[3] == 4);
+        mu_assert("rank_search: Top k", test_rank_run(db, "fox", 2, ids) == 2);
+        mu_assert("rank_search: Rare word weighs more",
+                  test_rank_run(db, "cat fox", 1, ids) == 1 && ids[0] == 2);
+        mu_assert("rank_search: Missing word", test_rank_run(db, "wolf", 10, ids) == 0);
+        dstring removed = dcreate("d3");
+        database_delete_document(db, removed);
+        dfree(removed);
+        mu_assert("rank_search: Removed document",
+                  test_rank_run(db, "fox fox", 10, ids) == 3 && ids[0] != 3);
+        mu_assert("docdict_remove: Length dropped", db->docs->total_length == 27);
+        database_free(db);
+    }
+
+    // Postings of removed documents stay in the segment, the word must still weigh the same
+    const char *path = "/tmp/fist-test.db";
+    struct database *db = database_create(INDEX_MODE_POSITIONAL, 10);
+    dstring d0 = dcreate("d0");
+    dstring d1 = dcreate("d1");
+    char text[32];
+    strcpy(text, "fox cat");
+    database_index(db, d0, text, strlen(text));
+    strcpy(text, "fox fox dog");
+    database_index(db, d1, text, strlen(text));
+    mu_assert("sdump: Ranked documents", sdump(path, db) == 0);
+    for(int i = 0; i < 3; i++) {
+        strcpy(text, "fox fox dog");
+        database_reindex(db, d1, text, strlen(text));
+    }
+    mu_assert("rank_search: Removed documents not counted",
+              test_rank_run(db, "fox", 10, ids) == 2 && ids[0] == 4 && ids[1] == 0);
+    remove_database(path, db);
+    database_free(db);
+    dfree(d0);
+    dfree(d1);
+
+    // Pruning must not change the k best, compared with ranking everything
+    db = database_create(INDEX_MODE_POSITIONAL, 10);
+    uint32_t state = 3;
+    for(int i = 0; i < 500; i++) {
+        char name[8], text[256] = "";
+        snprintf(name, sizeof(name), "d%d", i);
+        for(int j = 0, words = 5 + i % 20; j < words; j++) {
+            state = state * 1103515245 + 12345;
+            // Word n appears about twice as often as word n + 1
+            char word[8];
+            snprintf(word, sizeof(word), "w%d ", __builtin_ctz((state >> 8) | 1 << 12));
+            strcat(text, word);
+        }
+        dstring document = dcreate(name);
+        database_index(db, document, text, strlen(text));
+        dfree(document);
+    }
+    const char *queries[] = {"w0 w5 w9", "w1 w2 w3 w4", "w10 w0", "w7 w6 w0 w1 w2"};
+    for(size_t i = 0; i < sizeof(queries) / sizeof(queries[0]); i++) {
+        uint32_t all[512];
+        uint32_t nall = test_rank_run(db, queries[i], 500, all);
+        uint32_t top = test_rank_run(db, queries[i], 10, ids);
+        mu_assert("rank_search: Pruned top k",
+                  top == 10 && !memcmp(ids, all, sizeof(uint32_t) * 10));
+        mu_assert("rank_search: Ranked all", nall > 10);
+    }
+    database_free(db);
+    return 0;
+}
+
+static char *test_positional_search() {
+    struct database *db = database_create(INDEX_MODE_POSITIONAL, 10);
+    dstring d1 = dcreate("d1");
+    dstring d2 = dcreate("d2");
+    dstring t1 = dcreate("the quick brown fox jumps over the lazy dog");
+    dstring t2 = dcreate("the lazy brown dog sleeps and the quick fox jumps");
+    mu_assert("database_index: Unique words are keys",
+              database_index(db, d1, dtext(t1), t1.length) == 8);
+    database_index(db, d2, dtext(t2), t2.length);
+
+    uint32_t *ids;
+    dstring phrase = dcreate("quick brown fox jumps over the lazy dog");
+    mu_assert("database_search: Phrase longer than MaxPhraseLength words",
+              database_search(db, dtext(phrase), phrase.length, &ids) == 1 && ids[0] == 0);
+    free(ids);
+    dfree(phrase);
+
+    phrase = dcreate("quick fox jumps");
+    mu_assert("database_search: Phrase in second document",
+              database_search(db, dtext(phrase), phrase.length, &ids) == 1 && ids[0] == 1);
+    free(ids);
+    dfree(phrase);
+
+    phrase = dcreate("the");
+    mu_assert("database_search: Single word",
+              database_search(db, dtext(phrase), phrase.length, &ids) == 2);
+    free(ids);
+    dfree(phrase);
+
+    phrase = dcreate("fox brown");
+    mu_assert("database_search: Words out of order",
+              database_search(db, dtext(phrase), phrase.length, &ids) == 0);
+    free(ids);
+    dfree(phrase);
+
+    // Text indexed later is appended to the document without forming phrases across the gap
+    dstring t3 = dcreate("cat");
+    database_index(db, d1, dtext(t3), t3.length);
+    phrase = dcreate("dog cat");
+    mu_assert("database_search: No phrase across INDEX commands",
+              database_search(db, dtext(phrase), phrase.length, &ids) == 0);
+    free(ids);
+    dfree(phrase);
+
+    const char *path = "/tmp/fist-test.db";
+    sdump(path, db);
+    struct database *loaded = sload(path, INDEX_MODE_PHRASE, 10);
+    remove_database(path, db);
+    mu_assert("sload: Keeps positional mode", loaded->mode == INDEX_MODE_POSITIONAL);
+    phrase = dcreate("lazy brown dog");
+    mu_assert("sload: Positions restored",
+              database_search(loaded, dtext(phrase), phrase.length, &ids) == 1 && ids[0] == 1);
+    free(ids);
+    dfree(phrase);
+
+    dfree(d1);
+    dfree(d2);
+    dfree(t1);
+    dfree(t2);
+    dfree(t3);
+    database_free(db);
+    database_free(loaded);
+    return 0;
+}
+
+static char *test_positions_postings() {
+    postings list = pcreate();
+    uint32_t first[] = {1, 5, 9};
+    uint32_t second[] = {3, 5};
+    padd_positions(&list, 7, first, 3);
+    padd_positions(&list, 2, second, 2);
+    mu_assert("padd_positions: Merge into existing id", !padd_positions(&list, 7, second, 2));
+
+    struct pcursor cursor;
+    uint32_t id;
+    uint32_t positions[8];
+    pcursor_init(&cursor, &list);
+    mu_assert("pcursor_next: Lowest id first", pcursor_next(&cursor, &id) && id == 2);
+    mu_assert("pcursor_npos: Positions of first id", pcursor_npos(&cursor) == 2);
+    mu_assert("pcursor_seek: Skips to id", pcursor_seek(&cursor, 3, &id) && id == 7);
+    pcursor_positions(&cursor, positions);
+    mu_assert("pcursor_positions: Merged positions",
+              pcursor_npos(&cursor) == 4 && positions[0] == 1 && positions[1] == 3 &&
+                  positions[2] == 5 && positions[3] == 9);
+    mu_assert("pcursor_seek: Past the end", !pcursor_seek(&cursor, 8, &id));
+    pfree(&list);
     return 0;
 }
 
@@ -418,24 +1337,344 @@ static char *test_insert_and_search_bst() {
     return 0;
 }
 
+static char *test_event_loop_backend(int backend) {
+    int pair[2];
+    int ready[4];
+    struct event_loop *loop = event_loop_create(backend);
+    mu_assert("event_loop_create: Backend available", loop != NULL);
+    mu_assert("socketpair", socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+    mu_assert("event_loop_add: Added", event_loop_add(loop, pair[0]) == 0);
+
+    mu_assert("write", write(pair[1], "x", 1) == 1);
+    mu_assert("event_loop_wait: One ready", event_loop_wait(loop, ready, 4) == 1);
+    mu_assert("event_loop_wait: Ready fd", ready[0] == pair[0]);
+
+    event_loop_del(loop, pair[0]);
+    close(pair[0]);
+    close(pair[1]);
+    event_loop_free(loop);
+    return 0;
+}
+
+static char *test_event_loop() {
+    char *rc;
+#ifdef HAVE_EPOLL
+    if((rc = test_event_loop_backend(EVENT_BACKEND_EPOLL)))
+        return rc;
+#endif
+    if((rc = test_event_loop_backend(EVENT_BACKEND_SELECT)))
+        return rc;
+    return 0;
+}
+
+static void linebuf_test_append(struct linebuf *lb, const char *data) {
+    uint32_t available;
+    char *space = linebuf_space(lb, strlen(data), &available);
+    memcpy(space, data, strlen(data));
+    linebuf_commit(lb, strlen(data));
+}
+
+static char *test_linebuf() {
+    struct linebuf lb, moved;
+    char *line;
+    uint32_t length;
+    memset(&lb, 0, sizeof(lb));
+    memset(&moved, 0, sizeof(moved));
+
+    linebuf_test_append(&lb, "SEARCH a\r\nINDEX b c\r");
+    mu_assert("linebuf_next: First line", linebuf_next(&lb, &line, &length) == 1);
+    mu_assert("linebuf_next: Without CRLF", length == 8 && !memcmp(line, "SEARCH a", 8));
+    mu_assert("linebuf_next: CR alone ends nothing", linebuf_next(&lb, &line, &length) == 0);
+    mu_assert("linebuf_pending: Unfinished line", linebuf_pending(&lb) == 10);
+
+    linebuf_move(&moved, &lb);
+    mu_assert("linebuf_move: Source emptied", linebuf_pending(&lb) == 0);
+    linebuf_test_append(&moved, "\nVERSION\n\r\n");
+    mu_assert("linebuf_next: CRLF split across reads",
+              linebuf_next(&moved, &line, &length) == 1 && length == 9 &&
+                  !memcmp(line, "INDEX b c", 9));
+    mu_assert("linebuf_next: Bare LF is part of the line",
+              linebuf_next(&moved, &line, &length) == 1 && length == 8 &&
+                  !memcmp(line, "VERSION\n", 8));
+    mu_assert("linebuf_pending: Nothing left", linebuf_pending(&moved) == 0);
+
+    linebuf_free(&lb);
+    linebuf_free(&moved);
+    return 0;
+}
+
+static struct outshared *test_reply(const char *text) {
+    struct outshared *reply = outshared_create(strlen(text));
+    memcpy(reply->data, text, reply->length);
+    return reply;
+}
+
+static char *test_cache() {
+    struct cache cache;
+    struct outshared *d1 = test_reply("[\"d1\"]\n");
+    struct outshared *none = test_reply("[]\n");
+    cache_init(&cache, 2);
+    mu_assert("cache_get: Empty", !cache_get(&cache, "fox", 3, 1));
+    cache_put(&cache, "fox", 3, 1, d1);
+    mu_assert("cache_put: Reference taken", d1->refs == 2);
+    mu_assert("cache_get: Hit", cache_get(&cache, "fox", 3, 1) == d1);
+    mu_assert("cache_get: Other generation", !cache_get(&cache, "fox", 3, 2));
+    cache_put(&cache, "fox", 3, 2, none);
+    mu_assert("cache_put: Replaced", cache.length == 1 && d1->refs == 1 &&
+                                         cache_get(&cache, "fox", 3, 2) == none);
+
+    // fox was hit since, so the clock passes over it and takes dog
+    cache_put(&cache, "dog", 3, 1, none);
+    cache_put(&cache, "cat", 3, 1, d1);
+    mu_assert("cache_put: Hit entry kept", cache_get(&cache, "fox", 3, 2) == none);
+    mu_assert("cache_put: Unreferenced entry evicted", !cache_get(&cache, "dog", 3, 1));
+    mu_assert("cache_put: New entry", cache_get(&cache, "cat", 3, 1) == d1);
+    struct outshared *big = outshared_create(CACHE_REPLY_MAX + 1);
+    cache_put(&cache, "big", 3, 1, big);
+    mu_assert("cache_put: Long reply not cached",
+              !cache_get(&cache, "big", 3, 1) && big->refs == 1);
+    outshared_release(big);
+    uint64_t hits, misses;
+    cache_stats(&cache, &hits, &misses);
+    mu_assert("cache_stats: Counted", hits == 4 && misses == 4);
+    cache_free(&cache);
+    mu_assert("cache_free: References dropped", d1->refs == 1 && none->refs == 1);
+
+    cache_init(&cache, 0);
+    cache_put(&cache, "fox", 3, 1, none);
+    mu_assert("cache_init: Off", !cache_get(&cache, "fox", 3, 1));
+    cache_stats(&cache, &hits, &misses);
+    mu_assert("cache_stats: Nothing counted when off", hits == 0 && misses == 0);
+    cache_free(&cache);
+    outshared_release(d1);
+    outshared_release(none);
+
+    // Generations change with the writes that change what a search finds
+    for(int mode = INDEX_MODE_PHRASE; mode <= INDEX_MODE_POSITIONAL; mode++) {
+        struct database *db = database_create(mode, 10);
+        dstring d1 = dcreate("d1");
+        dstring d2 = dcreate("d2");
+        char text[64];
+        strcpy(text, "the quick brown fox");
+        database_index(db, d1, text, strlen(text));
+        uint64_t fox = database_generation(db, "brown fox", 9);
+        uint64_t wolf = database_generation(db, "wolf", 4);
+        strcpy(text, "a grey wolf");
+        database_index(db, d2, text, strlen(text));
+        mu_assert("database_generation: Unrelated key",
+                  database_generation(db, "brown fox", 9) == fox);
+        mu_assert("database_generation: Indexed key", database_generation(db, "wolf", 4) != wolf);
+        wolf = database_generation(db, "wolf", 4);
+        database_delete(db, "wolf", 4);
+        mu_assert("database_generation: Deleted key", database_generation(db, "wolf", 4) != wolf);
+        database_freeze(db);
+        database_delete_document(db, d1);
+        mu_assert("database_generation: Removed document",
+                  database_generation(db, "brown fox", 9) != fox);
+        fox = database_generation(db, "brown fox", 9);
+        strcpy(text, "brown fox");
+        database_index(db, d2, text, strlen(text));
+        mu_assert("database_generation: Indexed after a freeze",
+                  database_generation(db, "brown fox", 9) != fox);
+        dfree(d1);
+        dfree(d2);
+        database_free(db);
+    }
+    return 0;
+}
+
+static char *test_outbuf() {
+    struct outbuf ob;
+    int pair[2];
+    memset(&ob, 0, sizeof(ob));
+    mu_assert("socketpair", socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+    fcntl(pair[0], F_SETFL, fcntl(pair[0], F_GETFL) | O_NONBLOCK);
+
+    outbuf_add(&ob, "Bye\n", 4);
+    outbuf_add(&ob, "[]\n", 3);
+    mu_assert("outbuf_add: Small replies share a segment", ob.count == 1);
+    dstring big = dempty();
+    for(int i = 0; i < 1 << 20; i++)
+        big = dappendc(big, 'a' + i % 26);
+    char *text = big.text;
+    outbuf_add_dstring(&ob, big);
+    mu_assert("outbuf_add_dstring: Large strings are not copied",
+              ob.count == 2 && ob.segs[1].data == text);
+    outbuf_add(&ob, "\n", 1);
+    mu_assert("outbuf_add: Nothing appended to a queued string", ob.count == 3);
+    mu_assert("outbuf_pending: All bytes", outbuf_pending(&ob) == 8 + (1 << 20));
+
+    // The socket cannot take it all at once, drain it until everything arrived in order
+    char *received = malloc(8 + (1 << 20));
+    uint32_t nreceived = 0;
+    while(outbuf_pending(&ob) || nreceived < 8 + (1 << 20)) {
+        mu_assert("outbuf_flush: No error", outbuf_flush(&ob, pair[0]) == 0);
+        ssize_t nbytes = read(pair[1], received + nreceived, 8 + (1 << 20) - nreceived);
+        mu_assert("read", nbytes > 0);
+        nreceived += nbytes;
+    }
+    mu_assert("outbuf_flush: Replies in order", !memcmp(received, "Bye\n[]\nabc", 10) &&
+                                                    received[7 + (1 << 20)] == '\n');
+    free(received);
+
+    struct outshared *shared = outshared_create(OUTBUF_CHUNK);
+    memset(shared->data, 'x', shared->length);
+    outbuf_add_shared(&ob, shared);
+    outbuf_add_shared(&ob, shared);
+    mu_assert("outbuf_add_shared: Not copied", ob.count == 2 && ob.segs[1].data == shared->data &&
+                                                   shared->refs == 3);
+    outbuf_free(&ob);
+    mu_assert("outbuf_free: Shared replies released", shared->refs == 1);
+    outshared_release(shared);
+    close(pair[0]);
+    close(pair[1]);
+    return 0;
+}
+
+struct shardlock_test
+{
+    struct shardlock *lock;
+    int shard;
+    int *counter;
+    int torn; // Times a reader saw the two halves of counter disagree
+};
+
+static void *shardlock_test_run(void *arg) {
+    struct shardlock_test *test = arg;
+    for(int i = 0; i < 10000; i++) {
+        shardlock_wrlock(test->lock);
+        test->counter[0]++;
+        test->counter[1]++;
+        shardlock_wrunlock(test->lock);
+
+        shardlock_rdlock(test->lock, test->shard);
+        test->torn += test->counter[0] != test->counter[1];
+        shardlock_rdunlock(test->lock, test->shard);
+    }
+    return NULL;
+}
+
+static char *test_shardlock() {
+    struct shardlock lock;
+    struct shardlock_test tests[4];
+    pthread_t threads[4];
+    int counter[2] = {0, 0};
+    mu_assert("shardlock_init: Initialized", shardlock_init(&lock, 4) == 0);
+    for(int i = 0; i < 4; i++) {
+        tests[i] = (struct shardlock_test){&lock, i, counter, 0};
+        pthread_create(&threads[i], NULL, shardlock_test_run, &tests[i]);
+    }
+    for(int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        mu_assert("shardlock_rdlock: Writers excluded", tests[i].torn == 0);
+    }
+    mu_assert("shardlock_wrlock: Writers serialized", counter[0] == 40000);
+    shardlock_destroy(&lock);
+    return 0;
+}
+
+static uint32_t cmdlog_test_search(struct database *db, const char *phrase) {
+    uint32_t *ids;
+    uint32_t count = database_search(db, phrase, strlen(phrase), &ids);
+    free(ids);
+    return count;
+}
+
+static char *test_cmdlog() {
+    const char *path = "/tmp/fist-test.log";
+    char text[64];
+    unlink(path);
+
+    struct database *db = database_create(INDEX_MODE_PHRASE, 10);
+    struct cmdlog *log = cmdlog_open(path, CMDLOG_FSYNC_ALWAYS, db);
+    mu_assert("cmdlog_open: New log", log != NULL && log->id == 1);
+    strcpy(text, "hello world");
+    uint64_t position = cmdlog_append(log, CMDLOG_INDEX, "d1", 2, text, strlen(text));
+    strcpy(text, "hello again");
+    position = cmdlog_append(log, CMDLOG_INDEX, "d2", 2, text, strlen(text));
+    mu_assert("cmdlog_commit: Written", cmdlog_commit(log, position) == 0);
+    uint64_t id, offset;
+    cmdlog_mark(log, &id, &offset);
+    position = cmdlog_append(log, CMDLOG_DELETE, "world", 5, NULL, 0);
+    strcpy(text, "goodbye");
+    position = cmdlog_append(log, CMDLOG_REINDEX, "d2", 2, text, strlen(text));
+    cmdlog_close(log);
+
+    // Everything is replayed into an empty database
+    struct database *replayed = database_create(INDEX_MODE_PHRASE, 10);
+    log = cmdlog_open(path, CMDLOG_FSYNC_NO, replayed);
+    mu_assert("cmdlog_replay: Every record", cmdlog_replay(log, replayed) == 4);
+    mu_assert("cmdlog_replay: INDEX", cmdlog_test_search(replayed, "hello") == 1);
+    mu_assert("cmdlog_replay: DELETE", cmdlog_test_search(replayed, "world") == 0);
+    mu_assert("cmdlog_replay: REINDEX", cmdlog_test_search(replayed, "goodbye") == 1);
+    cmdlog_close(log);
+    database_free(replayed);
+
+    // A snapshot taken at the mark only needs what came after it, also once the log was rewritten
+    replayed = database_create(INDEX_MODE_PHRASE, 10);
+    replayed->log_id = id;
+    replayed->log_offset = offset;
+    log = cmdlog_open(path, CMDLOG_FSYNC_NO, replayed);
+    mu_assert("cmdlog_replay: Records after the mark", cmdlog_replay(log, replayed) == 2);
+    mu_assert("cmdlog_rewrite: Succeeds", cmdlog_rewrite(log, offset) == 0 && log->id == id + 1);
+    strcpy(text, "late");
+    cmdlog_commit(log, cmdlog_append(log, CMDLOG_INDEX, "d3", 2, text, strlen(text)));
+    cmdlog_close(log);
+    log = cmdlog_open(path, CMDLOG_FSYNC_NO, replayed);
+    mu_assert("cmdlog_replay: Rewritten log", cmdlog_replay(log, db) == 3);
+    mu_assert("cmdlog_replay: Records before the mark dropped",
+              cmdlog_test_search(db, "hello") == 0);
+    mu_assert("cmdlog_replay: Records after the rewrite", cmdlog_test_search(db, "late") == 1);
+    cmdlog_close(log);
+
+    // A record cut short by a crash is dropped
+    int fd = open(path, O_WRONLY | O_APPEND);
+    mu_assert("cmdlog: Partial record written", write(fd, "\x20\0\0\0\0\0", 6) == 6);
+    close(fd);
+    log = cmdlog_open(path, CMDLOG_FSYNC_NO, replayed);
+    uint64_t size = log->size;
+    mu_assert("cmdlog_replay: Partial record", cmdlog_replay(log, replayed) == 3);
+    mu_assert("cmdlog_replay: Partial record cut off", log->size == size - 6);
+    cmdlog_close(log);
+
+    database_free(db);
+    database_free(replayed);
+    unlink(path);
+    return 0;
+}
+
 static char *test_config_parse() {
     rename("fist_config", "fist_config.real");
     FILE *f = fopen("fist_config", "w+");
+    fwrite("CommandLog yes\n", 1, 15, f);
+    fwrite("CommandLogFsync always\n", 1, 23, f);
     fwrite("DatabaseFile fist2.db\n", 1, 22, f);
+    fwrite("EventLoop select\n", 1, 17, f);
     fwrite("Host 0.0.0.0\n", 1, 13, f);
     fwrite("Port 1234\n", 1, 10, f);
+    fwrite("IndexMode positional\n", 1, 21, f);
     fwrite("MaxPhraseLength 11\n", 1, 19, f);
+    fwrite("OutputLimit 4096\n", 1, 17, f);
     fwrite("SavePeriod 500\n", 1, 15, f);
-    fwrite("SoBacklog 5\n", 1, 11, f);
+    fwrite("SearchCache 100\n", 1, 16, f);
+    fwrite("SoBacklog 5\n", 1, 12, f);
+    fwrite("Workers 3\n", 1, 10, f);
     fclose(f);
 
     struct config *config = config_parse("./fist_config");
+    mu_assert("CommandLog matches", config->command_log == 1);
+    mu_assert("CommandLogFsync matches", config->command_log_fsync == CMDLOG_FSYNC_ALWAYS);
     mu_assert("DatabaseFile matches", dequalsc(config->db_path, "fist2.db"));
+    mu_assert("EventLoop matches", config->event_backend == EVENT_BACKEND_SELECT);
     mu_assert("Host matches", dequalsc(config->host, "0.0.0.0"));
     mu_assert("Port matches", config->port == 1234);
+    mu_assert("IndexMode matches", config->index_mode == INDEX_MODE_POSITIONAL);
     mu_assert("MaxPhraseLength matches", config->max_phrase_length == 11);
+    mu_assert("OutputLimit matches", config->output_limit == 4096);
     mu_assert("SavePeriod matches", config->save_period == 500);
+    mu_assert("SearchCache matches", config->search_cache == 100);
     mu_assert("SoBacklog matches", config->so_backlog == 5);
+    mu_assert("Workers matches", config->workers == 3);
     config_free(config);
 
     rename("fist_config.real", "fist_config");
@@ -445,11 +1684,28 @@ static char *test_config_parse() {
 
 static char *all_tests() {
     mu_run_test(test_serialize_hmap);
+    mu_run_test(test_serialize_baseline);
+    mu_run_test(test_serialize_segments);
+    mu_run_test(test_serialize_lengths);
     mu_run_test(test_dappendd_dstring);
     mu_run_test(test_djoin_dstring);
     mu_run_test(test_drange_dstring);
     mu_run_test(test_indexer);
+    mu_run_test(test_tokenizer);
     mu_run_test(test_getset_hm);
+    mu_run_test(test_hash_hm);
+    mu_run_test(test_grow_hm);
+    mu_run_test(test_alloc);
+    mu_run_test(test_istring);
+    mu_run_test(test_docdict);
+    mu_run_test(test_idset);
+    mu_run_test(test_postings);
+    mu_run_test(test_intersect);
+    mu_run_test(test_positions_postings);
+    mu_run_test(test_positional_search);
+    mu_run_test(test_delete_document);
+    mu_run_test(test_query);
+    mu_run_test(test_rank);
     mu_run_test(test_dsplit_dstring);
     mu_run_test(test_replace_dstring);
     mu_run_test(test_trim_dstring);
@@ -460,6 +1716,7 @@ static char *all_tests() {
     mu_run_test(test_indexof_array_dstring);
     mu_run_test(test_free_array_dstring);
     mu_run_test(test_push_array_dstring);
+    mu_run_test(test_adopt_array_dstring);
     mu_run_test(test_create_array_dstring);
     mu_run_test(test_indexof_dstring);
     mu_run_test(test_empty_dstring);
@@ -471,6 +1728,12 @@ static char *all_tests() {
     mu_run_test(test_count_dstring);
     mu_run_test(test_create_bst);
     mu_run_test(test_insert_and_search_bst);
+    mu_run_test(test_event_loop);
+    mu_run_test(test_linebuf);
+    mu_run_test(test_outbuf);
+    mu_run_test(test_cache);
+    mu_run_test(test_shardlock);
+    mu_run_test(test_cmdlog);
     mu_run_test(test_config_parse);
     return 0;
 }